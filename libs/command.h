@@ -0,0 +1,57 @@
+#ifndef COMMAND_H
+#define COMMAND_H
+/**
+ * 服务器和客户端共用的命令描述表：命令名、参数形式、是否需要写权限、对应的文档命令类型
+ * 查找按命令名首字节分派，每条命令只比较一次命令名。
+ */
+#include <stddef.h>
+#include "markdown.h"
+
+// 命令编号，同时是描述表的下标
+typedef enum {
+    COMMAND_INSERT,
+    COMMAND_DEL,
+    COMMAND_NEWLINE,
+    COMMAND_HEADING,
+    COMMAND_BOLD,
+    COMMAND_ITALIC,
+    COMMAND_BLOCKQUOTE,
+    COMMAND_ORDERED_LIST,
+    COMMAND_UNORDERED_LIST,
+    COMMAND_CODE,
+    COMMAND_HORIZONTAL_RULE,
+    COMMAND_LINK,
+    COMMAND_DOC,
+    COMMAND_PERM,
+    COMMAND_LOG,
+    COMMAND_DISCONNECT,
+    COMMAND_QUIT,
+    COMMAND_STATS,
+    COMMAND_COUNT
+} command_id;
+
+// 命令参数形式
+typedef enum {
+    ARGS_NONE,          // 无参数
+    ARGS_POS,           // <pos>
+    ARGS_POS_POS,       // <pos> <pos>，DEL 为 <pos> <no_char>
+    ARGS_LEVEL_POS,     // <level> <pos>
+    ARGS_POS_TEXT,      // <pos> <content>，内容可以包含空格
+    ARGS_POS_POS_TEXT,  // <pos> <pos> <link>，链接可以包含空格
+    ARGS_OPT_POS_POS    // 无参数，或 <start> <length>
+} command_args;
+
+// 命令描述
+typedef struct {
+    const char *name;
+    size_t length;         // 命令名长度
+    command_id id;
+    command_args args;
+    int needs_write;       // 编辑命令，需要写权限
+    command_type type;     // 编辑命令对应的文档命令类型
+} command_desc;
+
+const command_desc *command_lookup(const char *name, size_t length);
+const command_desc *command_parse(const char *line, parsed_cmd *cmd);
+
+#endif
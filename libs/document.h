@@ -7,6 +7,7 @@
  */
 #include <stddef.h>
 #include <stdint.h>
+#include <sys/uio.h>
 
 // 定义返回码
 #define SUCCESS 0
@@ -42,31 +43,201 @@ typedef struct edit_command {
     char *username;       // 用户名
     char *original_cmd;   // 原始命令字符串
     int status;           // 命令状态 (0=成功, 非0=错误码)
+    char *strings;        // content、username、original_cmd 共用的内存块
     struct edit_command *next;
 } edit_command;
 
-// 定义文档块结构（链表节点）
+// 定义文本存储模式
+typedef enum {
+    STORAGE_CHUNKED,     // 每段插入内容单独分配一个缓冲区
+    STORAGE_PIECE_TABLE  // 插入内容追加到共享的只追加缓冲区，块只记录片段
+} storage_mode;
+
+// 片段表模式下追加缓冲区的默认容量
+#define ADD_BUFFER_CAPACITY 65536
+
+// 暂存插入有序段的最大数量：相邻两段中后一段严格更短，段数不超过长度的位数
+#define STAGED_RUN_MAX 64
+
+// 定义文本缓冲区（只追加，已写入的内容不再修改，可被多个块共享）
+typedef struct text_block {
+    char *data;
+    size_t capacity;
+    size_t used;        // 已写入的字节数
+    size_t refs;        // 引用计数（引用它的块、快照，以及作为追加缓冲区时的文档；原子操作）
+    size_t mapped;      // 非 0 时 data 是只读的文件映射（映射长度），释放时解除映射
+} text_block;
+
+// 定义文档块结构（rope 节点：按子树长度索引的平衡树，treap）
 typedef struct chunk {
-    char *content;
+    char *content;          // 指向 block 内的内容片段（不以 '\0' 结尾）
     size_t length;
-    struct chunk *next;
+    text_block *block;      // 内容所在的缓冲区
+    size_t newlines;        // 本块中换行符的数量
+    struct chunk *left;     // 左子树（位于本块之前的内容）
+    struct chunk *right;    // 右子树（位于本块之后的内容）
+    size_t subtree_length;  // 子树内容总长度
+    size_t subtree_chunks;  // 子树中的块数量
+    size_t subtree_newlines; // 子树中换行符的数量（行索引）
+    uint64_t hash;          // 本块内容的多项式哈希（CHUNK_HASH_OWN 时有效）
+    uint64_t subtree_hash;  // 子树内容的多项式哈希（CHUNK_HASH_SUBTREE 时有效）
+    uint64_t subtree_power; // 基数的 subtree_length 次幂，用于拼接哈希
+    uint32_t priority;      // 随机优先级，用于保持树的平衡
+    uint32_t hash_flags;    // 哈希缓存的有效标志，按需计算，结构变化时失效
 } chunk;
 
+// 块哈希缓存的有效标志
+#define CHUNK_HASH_OWN 1u
+#define CHUNK_HASH_SUBTREE 2u
+
+// 定位缓存（finger）的最大路径深度
+#define FINGER_DEPTH 128
+
+// 定义定位缓存：上一次查找时从根到目标块的路径，附近的查找可从路径中途开始
+typedef struct {
+    chunk *path[FINGER_DEPTH];   // 路径上的节点，path[0] 为根
+    size_t base[FINGER_DEPTH];   // 每个节点的子树在文档中的起始位置
+    size_t depth;                // 路径长度，0 表示缓存无效
+} rope_finger;
+
+// 定义区间迭代器：按文档顺序逐块给出 [pos, pos + length) 与各块相交的内容
+typedef struct {
+    const chunk *root;
+    const chunk *stack[FINGER_DEPTH]; // 尚未输出的祖先，区间的后续部分在这些节点及其右子树中
+    size_t depth;
+    int truncated;                    // 路径超过栈深度时丢弃了祖先，栈空后从根重新定位
+    const chunk *current;             // 下一个输出的块，NULL 表示需要出栈或重新定位
+    size_t offset;                    // 在 current 中的起始偏移
+    size_t pos;                       // 下一个输出字节在文档中的位置
+    size_t remaining;                 // 剩余字节数
+} rope_iter;
+
+// 定义暂存的插入：位置是已提交版本中的位置，内容已放入块中，提交时整体拼接
+typedef struct {
+    size_t pos;     // 插入位置（同一位置上后暂存的插入排在前面）
+    chunk *piece;   // 插入的内容
+} staged_insert;
+
+// 定义暂存的删除区间 [start, end)：已提交版本中的位置，相邻或重叠的区间会合并
+typedef struct {
+    size_t start;
+    size_t end;
+} deleted_range;
+
+// 定义上次提交的一项位置变化：插入记为 start == end 的空区间（同一位置的插入合并），
+// 删除记为 [start, end)；total 为截至本项（含）的累计插入或删除长度
+typedef struct {
+    size_t start;
+    size_t end;
+    size_t total;
+} version_shift;
+
+// 定义上一版本到当前版本的位置变换，用于接受基于上一版本的编辑
+typedef struct {
+    int valid;               // 是否记录了上一版本（文档被整体替换后失效）
+    size_t length;           // 上一版本的文档长度
+    version_shift *inserts;  // 上次提交的插入，按位置排序
+    size_t insert_count;
+    size_t insert_capacity;
+    version_shift *deletes;  // 上次提交的删除区间，按位置排序
+    size_t delete_count;
+    size_t delete_capacity;
+} version_transform;
+
+// 定义已提交版本的快照：按顺序指向各块内容的 iovec 列表，按引用计数在多个读者间共享
+// 快照持有内容所在缓冲区的引用，缓冲区中已写入的内容不会被修改，因此可在锁外直接 writev
+typedef struct {
+    uint64_t version;       // 快照对应的版本号
+    size_t length;          // 内容总长度
+    size_t refs;            // 引用计数（原子操作，可在锁外释放）
+    struct iovec *iov;      // 各块内容
+    size_t *offsets;        // 各块在文档中的起始位置，用于按区间读取
+    size_t iov_count;
+    text_block **blocks;    // 持有引用的缓冲区
+    size_t block_count;
+    version_transform previous; // 上一版本到该版本的位置变换，数组与快照在同一次分配中
+} doc_snapshot;
+
+// 定义编辑历史的版本段：同一版本提交的命令在历史链表中连续存放
+typedef struct {
+    uint64_t version;      // 命令提交时的文档版本
+    edit_command *first;   // 段内第一条命令
+    edit_command *last;    // 段内最后一条命令
+    size_t count;          // 段内命令数量
+} history_segment;
+
 // 定义文档结构
 typedef struct {
-    chunk *head;           // 文档内容链表头
+    chunk *root;           // 文档内容 rope 的根
     size_t total_length;   // 文档总长度
     uint64_t version;      // 当前版本号
     edit_command *pending_edits; // 待处理的编辑命令
     edit_command *edit_history;  // 编辑历史
+    edit_command *pending_tail;  // 待处理命令链表的尾节点，追加为 O(1)
+    edit_command *history_tail;  // 编辑历史链表的尾节点
+    size_t pending_count;        // 待处理命令数量
+    history_segment *history_segments; // 编辑历史的版本索引，按版本递增
+    size_t history_segment_count;
+    size_t history_segment_capacity;
+    size_t history_limit;        // 内存中保留的最近版本数，0 表示不限制
+    struct history_archive *archive; // 超出限制的旧版本写入的归档，NULL 时直接丢弃
+    storage_mode storage;        // 文本存储模式
+    text_block *add_buffer;      // 片段表模式下的当前追加缓冲区
+    size_t compact_cursor;       // 下一轮块合并的起始位置
+    size_t chunks_coalesced;     // 累计被合并掉的块数量
+    rope_finger finger;          // 位置查找缓存，rope 结构变化时失效
+    doc_snapshot *snapshot;      // 已发布的最近提交版本快照，只通过原子操作读写
+    unsigned int reader_epoch;   // 读者纪元，发布新快照时递增
+    unsigned int active_readers[2]; // 按纪元奇偶登记的正在取快照的读者数量
+    staged_insert *staged_inserts;   // 本版本暂存的插入：按暂存顺序排列的若干有序段
+    size_t staged_insert_count;
+    size_t staged_insert_capacity;
+    size_t staged_runs[STAGED_RUN_MAX]; // 各有序段的长度，先暂存的段在前
+    size_t staged_run_count;
+    staged_insert *staged_scratch;   // 排序用的临时数组，与暂存插入等长
+    size_t staged_scratch_capacity;
+    deleted_range *deleted_ranges;   // 本版本暂存的删除区间，按位置排序
+    size_t deleted_range_count;
+    size_t deleted_range_capacity;
+    version_transform previous;      // 上一版本到当前版本的位置变换
 } document;
 
 // 辅助函数声明
+text_block *create_text_block(size_t capacity);
+text_block *map_text_block(int fd, size_t length);
+void release_text_block(text_block *block);
 chunk *create_chunk(const char *content, size_t length);
+chunk *create_piece(text_block *block, const char *content, size_t length);
 void free_chunk(chunk *c);
 edit_command *create_command(command_type type, uint64_t version, size_t pos1, size_t pos2, const char *content, int level, const char *username, const char *original_cmd);
 void free_command(edit_command *cmd);
+void trim_document_pools(void);
+size_t document_allocation_count(void);
+size_t command_bytes(const edit_command *cmd);
 void add_pending_edit(document *doc, edit_command *cmd);
 void add_edit_history(document *doc, edit_command *cmd);
+void commit_pending_edits(document *doc);
+void trim_edit_history(document *doc);
+const history_segment *find_history_segment(const document *doc, uint64_t version);
+
+// rope 操作：定位、分割、拼接均为 O(log n)
+size_t rope_length(const chunk *root);
+size_t rope_chunk_count(const chunk *root);
+size_t rope_newline_count(const chunk *root);
+size_t rope_newlines_before(const chunk *root, size_t pos);
+size_t rope_line_start(const chunk *root, size_t line);
+chunk *rope_find(chunk *root, size_t pos, size_t *offset);
+chunk *rope_finger_find(rope_finger *finger, chunk *root, size_t pos, size_t *offset);
+int rope_split(chunk *root, size_t pos, chunk **left, chunk **right);
+void rope_split_chunks(chunk *root, size_t count, chunk **left, chunk **right);
+chunk *rope_merge(chunk *left, chunk *right);
+chunk *rope_append(chunk *root, chunk *c);
+int rope_extend_last(chunk *root, text_block *block, const char *content, size_t length);
+void rope_walk(const chunk *root, void (*visit)(const chunk *c, void *ctx), void *ctx);
+size_t rope_copy(const chunk *root, size_t pos, size_t length, char *out);
+void rope_iter_init(rope_iter *it, const chunk *root, size_t pos, size_t length);
+int rope_iter_next(rope_iter *it, const char **data, size_t *length);
+uint64_t rope_hash(chunk *root);
+void rope_free(chunk *root);
 
 #endif // DOCUMENT_H
@@ -0,0 +1,39 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+/**
+ * 编辑历史的格式化和磁盘归档
+ * 归档由只追加的数据文件和版本索引文件组成：数据文件按版本顺序存放与广播相同格式的
+ * VERSION/EDIT/END 文本，索引文件为每个版本记录一条定长的 (版本, 偏移, 长度)。
+ * 读取时把两个文件只读映射，内存中只保留文件描述符和长度，不随归档增长。
+ * 重启恢复时打开已有的归档继续追加，已归档的版本不再重复写入。
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "document.h"
+
+// 索引文件中的一条记录
+typedef struct {
+    uint64_t version;  // 广播时的版本号
+    uint64_t offset;   // 该版本在数据文件中的偏移
+    uint64_t length;   // 该版本文本的长度
+} history_index_entry;
+
+// 编辑历史归档
+typedef struct history_archive {
+    int data_fd;
+    int index_fd;
+    size_t data_length;    // 数据文件长度
+    size_t version_count;  // 已归档的版本数
+    uint64_t last_version; // 最后归档的版本号，version_count 为 0 时无意义
+} history_archive;
+
+const char *command_status_reason(int status);
+void history_write_edits(FILE *stream, uint64_t version, const edit_command *first, const edit_command *last);
+
+int history_archive_open(history_archive *archive, const char *path, int truncate);
+void history_archive_close(history_archive *archive);
+int history_archive_append(history_archive *archive, uint64_t version, const edit_command *first, const edit_command *last);
+int history_archive_write(const history_archive *archive, uint64_t from_version, int fd);
+
+#endif // HISTORY_H
@@ -14,6 +14,13 @@
 void markdown_init(document *doc);
 void markdown_free(document *doc);
 
+// === Storage ===
+void markdown_set_storage_mode(document *doc, storage_mode mode);
+int markdown_load(document *doc, uint64_t version, const char *content, size_t length);
+int markdown_load_file(document *doc, uint64_t version, const char *path);
+int markdown_load_checkpoint(document *doc, const char *path);
+void markdown_set_history_limit(document *doc, size_t versions, struct history_archive *archive);
+
 // === Edit Commands ===
 int markdown_insert(document *doc, uint64_t version, size_t pos, const char *content, const char *username, const char *original_cmd);
 int markdown_delete(document *doc, uint64_t version, size_t pos, size_t len, const char *username, const char *original_cmd);
@@ -30,10 +37,61 @@ int markdown_horizontal_rule(document *doc, uint64_t version, size_t pos, const
 int markdown_link(document *doc, uint64_t version, size_t start, size_t end, const char *url, const char *username, const char *original_cmd);
 int markdown_newline(document *doc, uint64_t version, size_t pos, const char *username, const char *original_cmd);
 
+// === Batch ===
+// 已解析的编辑命令；字符串由调用者持有，在 markdown_apply_batch 返回前保持有效
+typedef struct {
+    command_type type;
+    uint64_t version;
+    size_t pos1;              // 位置，范围命令的起始位置
+    size_t pos2;              // 范围命令的结束位置，DEL 的删除长度
+    int level;                // 标题级别
+    const char *content;      // INSERT 的内容，LINK 的 URL
+    const char *username;
+    const char *original_cmd;
+    int status;               // 不是 SUCCESS 时不执行，只按该状态记录（如权限不足）
+} parsed_cmd;
+
+size_t markdown_apply_batch(document *doc, const parsed_cmd *cmds, size_t count);
+
 // === Utilities ===
 void markdown_print(const document *doc, FILE *stream);
 char *markdown_flatten(const document *doc);
+size_t markdown_iovec(const document *doc, struct iovec *iov, size_t n);
+size_t markdown_read_range(const document *doc, size_t start, size_t length, char *buf);
+void markdown_range_begin(const document *doc, size_t start, size_t length, rope_iter *it);
+int markdown_range_next(rope_iter *it, const char **data, size_t *length);
 
 // === Versioning ===
 void markdown_increment_version(document *doc);
+uint64_t markdown_checksum(document *doc);
+
+// === Snapshots ===
+doc_snapshot *markdown_snapshot(document *doc);
+void markdown_release_snapshot(doc_snapshot *snapshot);
+int markdown_write_snapshot(const doc_snapshot *snapshot, int fd);
+int markdown_write_checkpoint(const doc_snapshot *snapshot, int fd);
+int markdown_write_snapshot_range(const doc_snapshot *snapshot, size_t start, size_t length, int fd);
+
+// === Statistics ===
+// 块大小直方图的桶数：第 0 桶为 [0, 16)，之后每桶上限乘 4，最后一桶为 [64K, ∞)
+#define STATS_SIZE_BUCKETS 8
+
+// 文档内存统计，字节数均为堆内存（文件映射单独统计）
+typedef struct {
+    size_t chunk_count;
+    size_t chunk_sizes[STATS_SIZE_BUCKETS]; // 块大小直方图
+    size_t content_length;    // 文档内容长度
+    size_t content_bytes;     // 文档引用的文本缓冲区（含缓冲区头和已删除但仍被引用的部分）
+    size_t mapped_bytes;      // 文档引用的只读文件映射
+    size_t chunk_bytes;       // 块头
+    size_t pending_count;
+    size_t pending_bytes;     // 待提交命令，以及本版本的暂存插入和删除区间
+    size_t history_count;
+    size_t history_bytes;     // 编辑历史及其版本索引
+    size_t allocations;       // 进程启动以来的分配次数
+} doc_stats;
+
+size_t markdown_chunk_count(const document *doc);
+size_t markdown_average_chunk_size(const document *doc);
+void markdown_stats(const document *doc, doc_stats *stats);
 #endif // MARKDOWN_H
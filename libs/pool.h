@@ -0,0 +1,48 @@
+#ifndef POOL_H
+#define POOL_H
+/**
+ * 内存池：定长对象池（slab）和线性分配器（arena）
+ * 两者都不是线程安全的，调用者负责加锁。
+ */
+#include <stddef.h>
+
+// 定长对象池：按 slab 批量分配，释放的对象进入空闲链表复用
+typedef struct slab_pool {
+    size_t object_size;      // 对象大小（已按指针对齐）
+    size_t objects_per_slab; // 每个 slab 容纳的对象数
+    void *free_list;         // 空闲对象链表
+    void *slabs;             // 已分配的 slab 链表
+    size_t in_use;           // 当前在用对象数
+    size_t slab_count;       // 已分配的 slab 数
+} slab_pool;
+
+// 静态初始化定长对象池
+#define SLAB_POOL_INIT(type, per_slab) { sizeof(type), (per_slab), NULL, NULL, 0, 0 }
+
+void *slab_alloc(slab_pool *pool);
+void slab_free(slab_pool *pool, void *object);
+void slab_free_chain(slab_pool *pool, void *first, void *last, size_t count);
+void slab_pool_destroy(slab_pool *pool);
+
+// arena 内存块
+typedef struct arena_block {
+    struct arena_block *next;
+    size_t capacity;
+    size_t used;
+    char data[];
+} arena_block;
+
+// 线性分配器：分配只移动指针，只能整体重置
+typedef struct arena {
+    arena_block *head;    // 第一个内存块（重置后保留复用）
+    arena_block *current; // 当前分配所在的内存块
+    size_t block_size;    // 默认内存块大小
+} arena;
+
+void arena_init(arena *a, size_t block_size);
+void *arena_alloc(arena *a, size_t size);
+char *arena_strdup(arena *a, const char *str);
+void arena_reset(arena *a);
+void arena_destroy(arena *a);
+
+#endif // POOL_H
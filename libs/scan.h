@@ -0,0 +1,17 @@
+#ifndef SCAN_H
+#define SCAN_H
+/**
+ * 字节扫描内核：换行符的统计与查找、有序列表标记查找、命令字节校验
+ * x86 上首次调用时按 CPU 支持选择 AVX2 或 SSE2 实现，其余平台使用标量实现。
+ * 所有实现的结果完全相同，函数都是线程安全的。
+ */
+#include <stddef.h>
+
+size_t scan_count_newlines(const char *data, size_t length);
+size_t scan_find_newline(const char *data, size_t length);
+size_t scan_find_nth_newline(const char *data, size_t length, size_t n);
+size_t scan_find_list_marker(const char *data, size_t length);
+int scan_is_printable(const char *data, size_t length);
+const char *scan_kernel_name(void);
+
+#endif
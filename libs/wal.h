@@ -0,0 +1,35 @@
+#ifndef WAL_H
+#define WAL_H
+/**
+ * 已提交版本的预写日志（WAL）
+ * 每提交一个版本追加一条记录，内容为该版本被接受的编辑命令：
+ *   VERSION <版本号>
+ *   EDIT <username> [<base_version>] <command>
+ *   ...
+ *   END
+ * 版本号是命令执行时的已提交版本（与广播相同）；基于上一版本被接受的命令与广播一样附带它的基础版本，
+ * 重放时按该版本的坐标执行。一轮的记录先在内存中组装好，只用一次 write 追加
+ * （组提交），可选地在追加后 fdatasync。没有 END 的末尾记录是写入中途崩溃留下的，恢复时忽略。
+ * 恢复时先加载检查点，再从检查点的版本开始通过批量执行路径重放日志。
+ * 后台写检查点时先轮换日志，检查点完成前旧日志与新日志同时存在，恢复时按顺序重放两者。
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include "document.h"
+
+// 预写日志
+typedef struct {
+    int fd;
+    int sync;              // 每次追加后 fdatasync
+    size_t length;         // 日志文件长度
+    size_t records;        // 本次打开以来追加的记录数
+} wal;
+
+int wal_open(wal *log, const char *path, int sync);
+void wal_close(wal *log);
+int wal_append(wal *log, uint64_t version, const edit_command *first, const edit_command *last);
+int wal_reset(wal *log);
+int wal_rotate(wal *log, const char *path, const char *old_path);
+long wal_replay(const char *path, document *doc);
+
+#endif // WAL_H
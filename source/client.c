@@ -12,6 +12,8 @@
 #include <poll.h>
 #include "../libs/document.h"
 #include "../libs/markdown.h"
+#include "../libs/scan.h"
+#include "../libs/command.h"
 
 // 定义实时信号
 #ifndef SIGRTMIN
@@ -20,6 +22,7 @@
 
 #define MAX_COMMAND_LEN 256
 #define MAX_DOCUMENT_SIZE 1048576 // 1MB
+#define HISTORY_VERSIONS 16 // 本地文档只保留最近的编辑历史，日志由 log 记录
 
 // 全局变量
 static pid_t server_pid;
@@ -29,6 +32,10 @@ static int c2s_fd = -1; // 客户端到服务器的管道
 static int s2c_fd = -1; // 服务器到客户端的管道
 static document doc; // 本地文档副本
 static uint64_t document_version; // 文档版本号
+static uint64_t expected_checksum; // 本轮广播附带的提交后文档校验和
+static int checksum_pending = 0;   // 本轮广播是否附带校验和
+static int doc_reply_pending = 0;  // 已收到 DOC? 回复的版本号，下一行是内容长度
+static uint64_t doc_reply_version; // DOC? 回复的版本号
 static int is_write_permission = 0;
 static int client_running = 1;
 static pthread_mutex_t doc_mutex = PTHREAD_MUTEX_INITIALIZER;
@@ -49,7 +56,10 @@ static command_log log = {NULL, 0, 0};
 void handle_signal(int sig);
 void *update_thread(void *arg);
 void process_server_update(const char *update);
-void sync_full_document(const char *content);
+int read_exact(int fd, char *buf, size_t length);
+void receive_full_document(uint64_t version, size_t length);
+void receive_document_range(uint64_t version, size_t start, size_t length);
+void sync_full_document(uint64_t version, const char *content, size_t length);
 void cleanup_resources();
 void print_document();
 void add_log_entry(const char *entry);
@@ -211,6 +221,7 @@ int main(int argc, char *argv[]) {
 
     // 初始化文档
     markdown_init(&doc);
+    markdown_set_history_limit(&doc, HISTORY_VERSIONS, NULL);
 
     // 读取文档内容
     if (doc_length > 0) {
@@ -220,17 +231,18 @@ int main(int argc, char *argv[]) {
             return 1;
         }
 
-        bytes_read = read(s2c_fd, content, doc_length);
-        if (bytes_read != (ssize_t)doc_length) {
+        if (read_exact(s2c_fd, content, doc_length) != 0) {
             free(content);
             cleanup_resources();
             return 1;
         }
         content[doc_length] = '\0';
 
-        // 将内容插入到文档中
-        markdown_insert(&doc, doc.version, 0, content, "client", "INSERT 0 content");
+        // 加载服务器当前版本的内容（已提交，不经过暂存）
+        markdown_load(&doc, document_version, content, doc_length);
         free(content);
+    } else {
+        markdown_load(&doc, document_version, NULL, 0);
     }
 
     // 创建更新线程
@@ -263,28 +275,44 @@ int main(int argc, char *argv[]) {
         if (len == 0) {
             continue;
         }
+
+        // 除末尾换行符外，命令只能包含可打印 ASCII 字符
+        if (!scan_is_printable(command, len)) {
+            printf("Error: Command contains non-printable characters.\n");
+            continue;
+        }
         // 记录客户端发送的命令
         add_log_entry(command);
 
-        // 处理本地命令
-        if (strcmp(command, "DOC?") == 0) {
+        // 本地命令和写权限检查按描述表分派
+        const command_desc *desc = command_lookup(command, strcspn(command, " "));
+        command_id id = desc ? desc->id : COMMAND_COUNT;
+
+        // DOC? <start> <len> 向服务器请求一段内容，不带参数时打印本地文档
+        if (id == COMMAND_DOC && len > desc->length) {
+            command[len] = '\n';
+            write(c2s_fd, command, len + 1);
+            continue;
+        }
+
+        if (id == COMMAND_DOC) {
             pthread_mutex_lock(&doc_mutex);
             print_document();
             pthread_mutex_unlock(&doc_mutex);
             continue;
         }
 
-        if (strcmp(command, "PERM?") == 0) {
+        if (id == COMMAND_PERM) {
             printf("%s\n", is_write_permission ? "write" : "read");
             continue;
         }
 
-        if (strcmp(command, "LOG?") == 0) {
+        if (id == COMMAND_LOG) {
             print_command_log();
             continue;
         }
 
-        if (strcmp(command, "DISCONNECT") == 0) {
+        if (id == COMMAND_DISCONNECT) {
             // 发送断开连接命令给服务器
             write(c2s_fd, command, strlen(command));
             write(c2s_fd, "\n", 1);
@@ -292,23 +320,24 @@ int main(int argc, char *argv[]) {
         }
 
         // 检查是否有写权限
-        if (!is_write_permission &&
-            (strncmp(command, "INSERT", 6) == 0 ||
-             strncmp(command, "DEL", 3) == 0 ||
-             strncmp(command, "HEADING", 7) == 0 ||
-             strncmp(command, "BOLD", 4) == 0 ||
-             strncmp(command, "ITALIC", 6) == 0 ||
-             strncmp(command, "BLOCKQUOTE", 10) == 0 ||
-             strncmp(command, "ORDERED_LIST", 12) == 0 ||
-             strncmp(command, "UNORDERED_LIST", 14) == 0 ||
-             strncmp(command, "CODE", 4) == 0 ||
-             strncmp(command, "HORIZONTAL_RULE", 15) == 0 ||
-             strncmp(command, "LINK", 4) == 0 ||
-             strncmp(command, "NEWLINE", 7) == 0)) {
+        if (!is_write_permission && desc && desc->needs_write) {
             printf("Error: You do not have write permission.\n");
             continue;
         }
-        write(c2s_fd, command, strlen(command));
+        // 编辑命令前带上本地文档的版本号，与服务器的提交交错时按上一个版本被接受，而不是被拒绝；
+        // 版本号和命令一次写入，不与更新线程发出的 DOC? 交错
+        if (desc && desc->needs_write) {
+            char line[MAX_COMMAND_LEN + 32];
+            pthread_mutex_lock(&doc_mutex);
+            int line_len = snprintf(line, sizeof(line), "%lu %s\n", doc.version, command);
+            pthread_mutex_unlock(&doc_mutex);
+            write(c2s_fd, line, line_len);
+            continue;
+        }
+
+        // 每条命令以一个换行符结尾
+        command[len] = '\n';
+        write(c2s_fd, command, len + 1);
     }
 
     // 等待更新线程结束
@@ -438,19 +467,23 @@ void process_server_update(const char *update) {
     // 解析更新消息
     if (strncmp(update, "VERSION", 7) == 0) {
         // 版本更新
+        // 服务器以 -c 启动时版本号后附带提交后文档的校验和
         uint64_t broadcast_version;
-        sscanf(update, "VERSION %lu", &broadcast_version);
+        unsigned long checksum;
+        int fields = sscanf(update, "VERSION %lu %lx", &broadcast_version, &checksum);
+        checksum_pending = fields == 2;
+        expected_checksum = checksum_pending ? checksum : 0;
 
         // 检查本地文档版本是否与广播版本一致
         if (broadcast_version != doc.version) {
             // 版本不一致，可能错过了更新，请求完整文档
-            write(c2s_fd, "DOC?", 4);
+            write(c2s_fd, "DOC?\n", 5);
         }
 
         // 更新全局版本号变量（但不更新doc.version，等到END时再更新）
         document_version = broadcast_version;
     } else if (strncmp(update, "EDIT", 4) == 0) {
-        // EDIT命令行，新格式: EDIT <username> <command> <status>
+        // EDIT命令行，新格式: EDIT <username> [<base_version>] <command> <status>
         // 解析EDIT行，找到最后一个单词作为状态
         char edit_line[MAX_COMMAND_LEN];
         strncpy(edit_line, update, MAX_COMMAND_LEN - 1);
@@ -464,119 +497,32 @@ void process_server_update(const char *update) {
             // 检查状态
             if (strcmp(status, "SUCCESS") == 0) {
                 // 命令成功，解析并执行EDIT命令
-                char edit_username[64];
-                char cmd_type[32];
-
                 // 解析EDIT行: EDIT <username> <command_type> <args...>
                 char *edit_part = edit_line + 5; // 跳过"EDIT "
                 char *first_space = strchr(edit_part, ' ');
                 if (first_space) {
-                    // 提取用户名
-                    size_t username_len = first_space - edit_part;
-                    strncpy(edit_username, edit_part, username_len);
-                    edit_username[username_len] = '\0';
-
-                    // 提取命令部分
+                    // 分离用户名和命令部分
+                    *first_space = '\0';
                     char *cmd_part = first_space + 1;
-                    char *cmd_space = strchr(cmd_part, ' ');
-                    if (cmd_space) {
-                        // 提取命令类型
-                        size_t cmd_type_len = cmd_space - cmd_part;
-                        strncpy(cmd_type, cmd_part, cmd_type_len);
-                        cmd_type[cmd_type_len] = '\0';
-
-                        // 提取参数部分（不再需要移除版本号）
-                        char *args = cmd_space + 1;
-
-                        // 解析命令参数并执行相应操作
-                        size_t pos1 = 0, pos2 = 0;
-                        char content[MAX_COMMAND_LEN];
-                        int level = 0;
-
-                        if (strcmp(cmd_type, "INSERT") == 0) {
-                            // INSERT <pos> <content>
-                            // 手动解析以正确处理包含空格的内容
-                            char *pos_end = strchr(args, ' ');
-                            if (pos_end) {
-                                *pos_end = '\0';
-                                pos1 = atol(args);
-                                char *content_start = pos_end + 1;
-                                if (strlen(content_start) > 0) {
-                                    strncpy(content, content_start, MAX_COMMAND_LEN - 1);
-                                    content[MAX_COMMAND_LEN - 1] = '\0';
-                                    markdown_insert(&doc, doc.version, pos1, content, edit_username, cmd_part);
-                                }
-                            }
-                        } else if (strcmp(cmd_type, "DEL") == 0) {
-                            // DEL <pos> <no_char>
-                            if (sscanf(args, "%zu %zu", &pos1, &pos2) >= 2) {
-                                markdown_delete(&doc, doc.version, pos1, pos2, edit_username, cmd_part);
-                            }
-                        } else if (strcmp(cmd_type, "HEADING") == 0) {
-                            // HEADING <level> <pos>
-                            if (sscanf(args, "%d %zu", &level, &pos1) >= 2) {
-                                markdown_heading(&doc, doc.version, level, pos1, edit_username, cmd_part);
-                            }
-                        } else if (strcmp(cmd_type, "BOLD") == 0) {
-                            // BOLD <pos_start> <pos_end>
-                            if (sscanf(args, "%zu %zu", &pos1, &pos2) >= 2) {
-                                markdown_bold(&doc, doc.version, pos1, pos2, edit_username, cmd_part);
-                            }
-                        } else if (strcmp(cmd_type, "ITALIC") == 0) {
-                            // ITALIC <pos_start> <pos_end>
-                            if (sscanf(args, "%zu %zu", &pos1, &pos2) >= 2) {
-                                markdown_italic(&doc, doc.version, pos1, pos2, edit_username, cmd_part);
-                            }
-                        } else if (strcmp(cmd_type, "BLOCKQUOTE") == 0) {
-                            // BLOCKQUOTE <pos>
-                            if (sscanf(args, "%zu", &pos1) >= 1) {
-                                markdown_blockquote(&doc, doc.version, pos1, edit_username, cmd_part);
-                            }
-                        } else if (strcmp(cmd_type, "ORDERED_LIST") == 0) {
-                            // ORDERED_LIST <pos>
-                            if (sscanf(args, "%zu", &pos1) >= 1) {
-                                markdown_ordered_list(&doc, doc.version, pos1, edit_username, cmd_part);
-                            }
-                        } else if (strcmp(cmd_type, "UNORDERED_LIST") == 0) {
-                            // UNORDERED_LIST <pos>
-                            if (sscanf(args, "%zu", &pos1) >= 1) {
-                                markdown_unordered_list(&doc, doc.version, pos1, edit_username, cmd_part);
-                            }
-                        } else if (strcmp(cmd_type, "CODE") == 0) {
-                            // CODE <pos_start> <pos_end>
-                            if (sscanf(args, "%zu %zu", &pos1, &pos2) >= 2) {
-                                markdown_code(&doc, doc.version, pos1, pos2, edit_username, cmd_part);
-                            }
-                        } else if (strcmp(cmd_type, "HORIZONTAL_RULE") == 0) {
-                            // HORIZONTAL_RULE <pos>
-                            if (sscanf(args, "%zu", &pos1) >= 1) {
-                                markdown_horizontal_rule(&doc, doc.version, pos1, edit_username, cmd_part);
-                            }
-                        } else if (strcmp(cmd_type, "LINK") == 0) {
-                            // LINK <pos_start> <pos_end> <link>
-                            // 手动解析以正确处理包含空格的链接
-                            char *first_space = strchr(args, ' ');
-                            if (first_space) {
-                                *first_space = '\0';
-                                pos1 = atol(args);
-                                char *second_space = strchr(first_space + 1, ' ');
-                                if (second_space) {
-                                    *second_space = '\0';
-                                    pos2 = atol(first_space + 1);
-                                    char *link_start = second_space + 1;
-                                    if (strlen(link_start) > 0) {
-                                        strncpy(content, link_start, MAX_COMMAND_LEN - 1);
-                                        content[MAX_COMMAND_LEN - 1] = '\0';
-                                        markdown_link(&doc, doc.version, pos1, pos2, content, edit_username, cmd_part);
-                                    }
-                                }
-                            }
-                        } else if (strcmp(cmd_type, "NEWLINE") == 0) {
-                            // NEWLINE <pos>
-                            if (sscanf(args, "%zu", &pos1) >= 1) {
-                                markdown_newline(&doc, doc.version, pos1, edit_username, cmd_part);
-                            }
-                        }
+
+                    // 基于上一版本被接受的命令带有基础版本（命令名不以数字开头），
+                    // 按该版本的坐标执行，与服务器一样变换到当前版本
+                    uint64_t base_version = doc.version;
+                    if (*cmd_part >= '0' && *cmd_part <= '9') {
+                        char *version_end;
+                        base_version = strtoull(cmd_part, &version_end, 10);
+                        cmd_part = *version_end == ' ' ? version_end + 1 : version_end;
+                    }
+
+                    // 按描述表解析参数，与服务器相同地执行编辑命令
+                    parsed_cmd cmd;
+                    const command_desc *desc = command_parse(cmd_part, &cmd);
+                    if (desc && desc->needs_write) {
+                        cmd.version = base_version;
+                        cmd.username = edit_part;
+                        cmd.original_cmd = cmd_part;
+                        cmd.status = SUCCESS;
+                        markdown_apply_batch(&doc, &cmd, 1);
                     }
                 }
             } else if (strncmp(status, "Reject", 6) == 0) {
@@ -590,64 +536,130 @@ void process_server_update(const char *update) {
         // 更新结束，将本地文档版本+1，与服务器保持同步
         markdown_increment_version(&doc);
         document_version = doc.version;
+
+        // 应用完本轮编辑后内容与服务器不一致（例如错过或误解了某条编辑），请求完整文档
+        if (checksum_pending && markdown_checksum(&doc) != expected_checksum) {
+            write(c2s_fd, "DOC?\n", 5);
+        }
+        checksum_pending = 0;
+    } else if (strncmp(update, "Reject", 6) == 0) {
+        // 服务器拒绝了本客户端的请求（如 DOC? 的起点超出文档）
+        char reason[64] = "";
+        sscanf(update, "Reject %63s", reason);
+        printf("命令被拒绝 (原因: %s)\n", reason);
     } else {
-        // 检查是否是版本号（纯数字）
+        // DOC? 的回复与连接时相同：版本号一行，长度一行，随后是恰好该长度的文档内容；
+        // DOC? <start> <len> 的回复为 "<version> <start> <length>" 一行，随后是该长度的内容和换行符
         char *endptr;
-        uint64_t parsed_version = strtoull(update, &endptr, 10);
-
-        if (*endptr == '\0' || (*endptr == '\n' && *(endptr + 1) == '\0')) {
-            // 这是一个版本号，说明接下来会收到文档内容
-            printf("接收到服务器版本号: %lu\n", parsed_version);
-            document_version = parsed_version;
-            // 版本号已接收，等待下一行的文档内容
-        } else {
-            // 这是文档内容，进行全量同步
-            sync_full_document(update);
+        uint64_t value = strtoull(update, &endptr, 10);
+        unsigned long range_version;
+        size_t range_start, range_length;
+        int consumed = 0;
+
+        if (endptr != update && *endptr == ' ' &&
+            sscanf(update, "%lu %zu %zu%n", &range_version, &range_start, &range_length, &consumed) == 3 &&
+            update[consumed] == '\0') {
+            receive_document_range(range_version, range_start, range_length);
+        } else if (endptr != update && *endptr == '\0') {
+            if (!doc_reply_pending) {
+                printf("接收到服务器版本号: %lu\n", value);
+                doc_reply_version = value;
+                doc_reply_pending = 1;
+            } else {
+                doc_reply_pending = 0;
+                receive_full_document(doc_reply_version, (size_t)value);
+            }
         }
     }
 }
 
 /**
- * 同步完整文档内容
- * 当版本不一致或客户端请求完整文档时调用
+ * 从管道读取恰好 length 字节，管道为非阻塞模式时等待数据到达
+ * @param fd 文件描述符
+ * @param buf 输出缓冲区
+ * @param length 要读取的字节数
+ * @return 成功返回 0，连接关闭或出错返回 -1
  */
-void sync_full_document(const char *content) {
+int read_exact(int fd, char *buf, size_t length) {
+    struct pollfd pfd = { fd, POLLIN, 0 };
+
+    while (length > 0) {
+        ssize_t bytes_read = read(fd, buf, length);
+        if (bytes_read > 0) {
+            buf += bytes_read;
+            length -= (size_t)bytes_read;
+        } else if (bytes_read == 0) {
+            return -1;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            poll(&pfd, 1, 100);
+        } else if (errno != EINTR) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * 读取 DOC? <start> <len> 回复中的一段内容并打印，不改变本地文档
+ * @param version 内容所属的版本号
+ * @param start 起始位置
+ * @param length 内容长度
+ */
+void receive_document_range(uint64_t version, size_t start, size_t length) {
+    // 内容之后还有一个换行符
+    char *content = (char *)malloc(length + 1);
     if (!content) {
+        client_running = 0; // 无法跳过未读取的内容，只能断开
         return;
     }
 
-    // 释放当前文档内容
-    markdown_free(&doc);
-
-    // 重新初始化文档
-    markdown_init(&doc);
+    if (read_exact(s2c_fd, content, length + 1) != 0) {
+        client_running = 0;
+    } else {
+        printf("[%zu, %zu) @ %lu:\n", start, start + length, version);
+        fwrite(content, 1, length, stdout);
+        printf("\n");
+        fflush(stdout);
+    }
+    free(content);
+}
 
-    // 处理文档内容
-    size_t content_len = strlen(content);
-    if (content_len > 0) {
-        // 检查内容是否只是换行符（空文档的情况）
-        if (content_len == 1 && content[0] == '\n') {
-        } else {
-            // 将完整内容插入到文档的开始位置
-            // 移除末尾的换行符（如果有的话）
-            char *clean_content = strdup(content);
-            if (clean_content) {
-                size_t clean_len = strlen(clean_content);
-                if (clean_len > 0 && clean_content[clean_len - 1] == '\n') {
-                    clean_content[clean_len - 1] = '\0';
-                }
+/**
+ * 读取 DOC? 回复中的文档内容并替换本地文档
+ * @param version 回复的版本号
+ * @param length 内容长度
+ */
+void receive_full_document(uint64_t version, size_t length) {
+    char *content = length > 0 ? (char *)malloc(length) : NULL;
+    if (length > 0 && !content) {
+        client_running = 0; // 无法跳过未读取的内容，只能断开
+        return;
+    }
 
-                if (strlen(clean_content) > 0) {
-                    markdown_insert(&doc, doc.version, 0, clean_content, "server", "FULL_SYNC");
-                }
-                free(clean_content);
-            }
-        }
+    if (read_exact(s2c_fd, content, length) != 0) {
+        client_running = 0;
     } else {
+        sync_full_document(version, content, length);
     }
+    free(content);
+}
+
+/**
+ * 同步完整文档内容
+ * 当版本不一致或客户端请求完整文档时调用
+ * @param version 内容对应的版本号
+ * @param content 文档内容（不以 '\0' 结尾）
+ * @param length 内容长度
+ */
+void sync_full_document(uint64_t version, const char *content, size_t length) {
+    // 丢弃本地文档（包括基于旧内容的编辑历史），加载服务器的已提交内容
+    markdown_free(&doc);
+    markdown_init(&doc);
+    markdown_set_history_limit(&doc, HISTORY_VERSIONS, NULL);
+    markdown_load(&doc, version, content, length);
 
-    // 更新本地版本号为服务器版本
-    doc.version = document_version;
+    document_version = version;
 }
 
 /**
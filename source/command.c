@@ -0,0 +1,186 @@
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include "../libs/command.h"
+
+#define COMMAND(name, id, args, needs_write, type) { name, sizeof(name) - 1, id, args, needs_write, type }
+
+// 命令描述表，按命令编号排列
+static const command_desc command_table[COMMAND_COUNT] = {
+    COMMAND("INSERT", COMMAND_INSERT, ARGS_POS_TEXT, 1, CMD_INSERT),
+    COMMAND("DEL", COMMAND_DEL, ARGS_POS_POS, 1, CMD_DELETE),
+    COMMAND("NEWLINE", COMMAND_NEWLINE, ARGS_POS, 1, CMD_NEWLINE),
+    COMMAND("HEADING", COMMAND_HEADING, ARGS_LEVEL_POS, 1, CMD_HEADING),
+    COMMAND("BOLD", COMMAND_BOLD, ARGS_POS_POS, 1, CMD_BOLD),
+    COMMAND("ITALIC", COMMAND_ITALIC, ARGS_POS_POS, 1, CMD_ITALIC),
+    COMMAND("BLOCKQUOTE", COMMAND_BLOCKQUOTE, ARGS_POS, 1, CMD_BLOCKQUOTE),
+    COMMAND("ORDERED_LIST", COMMAND_ORDERED_LIST, ARGS_POS, 1, CMD_ORDERED_LIST),
+    COMMAND("UNORDERED_LIST", COMMAND_UNORDERED_LIST, ARGS_POS, 1, CMD_UNORDERED_LIST),
+    COMMAND("CODE", COMMAND_CODE, ARGS_POS_POS, 1, CMD_CODE),
+    COMMAND("HORIZONTAL_RULE", COMMAND_HORIZONTAL_RULE, ARGS_POS, 1, CMD_HORIZONTAL_RULE),
+    COMMAND("LINK", COMMAND_LINK, ARGS_POS_POS_TEXT, 1, CMD_LINK),
+    COMMAND("DOC?", COMMAND_DOC, ARGS_OPT_POS_POS, 0, CMD_INSERT),
+    COMMAND("PERM?", COMMAND_PERM, ARGS_NONE, 0, CMD_INSERT),
+    COMMAND("LOG?", COMMAND_LOG, ARGS_NONE, 0, CMD_INSERT),
+    COMMAND("DISCONNECT", COMMAND_DISCONNECT, ARGS_NONE, 0, CMD_INSERT),
+    COMMAND("QUIT", COMMAND_QUIT, ARGS_NONE, 0, CMD_INSERT),
+    COMMAND("STATS", COMMAND_STATS, ARGS_NONE, 0, CMD_INSERT),
+};
+
+/**
+ * 按命令名查找命令描述
+ * 先按首字节（同首字节时再按长度或第二个字节）确定唯一的候选命令，再比较一次命令名
+ * @param name 命令名（不要求以 '\0' 结尾）
+ * @param length 命令名长度
+ * @return 命令描述，未知命令返回 NULL
+ */
+const command_desc *command_lookup(const char *name, size_t length) {
+    command_id id;
+
+    if (!name || length == 0) {
+        return NULL;
+    }
+
+    switch (name[0]) {
+        case 'I': id = name[1] == 'N' ? COMMAND_INSERT : COMMAND_ITALIC; break;
+        case 'N': id = COMMAND_NEWLINE; break;
+        case 'O': id = COMMAND_ORDERED_LIST; break;
+        case 'U': id = COMMAND_UNORDERED_LIST; break;
+        case 'C': id = COMMAND_CODE; break;
+        case 'P': id = COMMAND_PERM; break;
+        case 'Q': id = COMMAND_QUIT; break;
+        case 'S': id = COMMAND_STATS; break;
+        case 'D': id = length == 3 ? COMMAND_DEL : length == 4 ? COMMAND_DOC : COMMAND_DISCONNECT; break;
+        case 'H': id = length == 7 ? COMMAND_HEADING : COMMAND_HORIZONTAL_RULE; break;
+        case 'B': id = length == 4 ? COMMAND_BOLD : COMMAND_BLOCKQUOTE; break;
+        case 'L': id = length == 4 && name[1] == 'I' ? COMMAND_LINK : COMMAND_LOG; break;
+        default: return NULL;
+    }
+
+    const command_desc *desc = &command_table[id];
+    if (desc->length != length || memcmp(desc->name, name, length) != 0) {
+        return NULL;
+    }
+
+    return desc;
+}
+
+/**
+ * 解析一个十进制参数，参数后必须是空格或行尾
+ * @param cursor 当前解析位置的地址，成功时移动到参数之后
+ * @param value 返回参数值
+ * @return 成功返回 1，格式错误返回 0
+ */
+static int parse_number(const char **cursor, size_t *value) {
+    const char *start = *cursor;
+    char *end;
+
+    // strtoull 会跳过前导空白，参数之间只允许一个空格
+    if (*start == ' ' || *start == '\0') {
+        return 0;
+    }
+
+    unsigned long long parsed = strtoull(start, &end, 10);
+    if (end == start || (*end != ' ' && *end != '\0')) {
+        return 0;
+    }
+
+    *value = (size_t)parsed;
+    *cursor = end;
+    return 1;
+}
+
+/**
+ * 跳过参数之间的一个空格
+ * @param cursor 当前解析位置的地址
+ * @return 成功返回 1，没有空格返回 0
+ */
+static int parse_separator(const char **cursor) {
+    if (**cursor != ' ') {
+        return 0;
+    }
+
+    (*cursor)++;
+    return 1;
+}
+
+/**
+ * 解析一行命令：按描述表中的参数形式解析参数
+ * 编辑命令的类型、位置、级别和内容写入 cmd，内容直接指向 line 中的文本；
+ * cmd 的版本号、用户名、原始命令和状态由调用者设置
+ * @param line 命令行，以 '\0' 结尾且不含末尾换行符
+ * @param cmd 输出的已解析命令
+ * @return 命令描述，未知命令或参数格式错误时返回 NULL
+ */
+const command_desc *command_parse(const char *line, parsed_cmd *cmd) {
+    if (!line || !cmd) {
+        return NULL;
+    }
+
+    const char *cursor = line;
+    while (*cursor && *cursor != ' ') {
+        cursor++;
+    }
+
+    const command_desc *desc = command_lookup(line, cursor - line);
+    if (!desc) {
+        return NULL;
+    }
+
+    size_t level = 0;
+    cmd->type = desc->type;
+    cmd->pos1 = 0;
+    cmd->pos2 = 0;
+    cmd->level = 0;
+    cmd->content = NULL;
+
+    switch (desc->args) {
+        case ARGS_NONE:
+            break;
+        case ARGS_POS:
+            if (!parse_separator(&cursor) || !parse_number(&cursor, &cmd->pos1)) {
+                return NULL;
+            }
+            break;
+        case ARGS_POS_POS:
+            if (!parse_separator(&cursor) || !parse_number(&cursor, &cmd->pos1) ||
+                !parse_separator(&cursor) || !parse_number(&cursor, &cmd->pos2)) {
+                return NULL;
+            }
+            break;
+        case ARGS_LEVEL_POS:
+            if (!parse_separator(&cursor) || !parse_number(&cursor, &level) ||
+                !parse_separator(&cursor) || !parse_number(&cursor, &cmd->pos1)) {
+                return NULL;
+            }
+            cmd->level = level <= INT_MAX ? (int)level : -1;
+            break;
+        case ARGS_POS_TEXT:
+            if (!parse_separator(&cursor) || !parse_number(&cursor, &cmd->pos1) ||
+                !parse_separator(&cursor)) {
+                return NULL;
+            }
+            cmd->content = cursor;
+            return desc;
+        case ARGS_OPT_POS_POS:
+            if (*cursor == '\0') {
+                break;
+            }
+            if (!parse_separator(&cursor) || !parse_number(&cursor, &cmd->pos1) ||
+                !parse_separator(&cursor) || !parse_number(&cursor, &cmd->pos2)) {
+                return NULL;
+            }
+            break;
+        case ARGS_POS_POS_TEXT:
+            if (!parse_separator(&cursor) || !parse_number(&cursor, &cmd->pos1) ||
+                !parse_separator(&cursor) || !parse_number(&cursor, &cmd->pos2) ||
+                !parse_separator(&cursor)) {
+                return NULL;
+            }
+            cmd->content = cursor;
+            return desc;
+    }
+
+    // 最后一个参数之后不能有多余内容
+    return *cursor == '\0' ? desc : NULL;
+}
@@ -1,41 +1,229 @@
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include "../libs/document.h"
+#include "../libs/pool.h"
+#include "../libs/scan.h"
+#include "../libs/history.h"
+
+// 块和编辑命令的定长对象池（只由修改文档的线程使用）
+static slab_pool chunk_pool = SLAB_POOL_INIT(chunk, 256);
+static slab_pool command_pool = SLAB_POOL_INIT(edit_command, 128);
+
+// 进程启动以来块、文本缓冲区和编辑命令的分配次数（原子操作，可从其他线程读取）
+static size_t allocation_count = 0;
+
+// treap 优先级的伪随机数状态（xorshift32）
+static uint32_t priority_state = 2463534242u;
 
 /**
- * 创建一个新的文档块
- * @param content 块内容
- * @param length 内容长度
- * @return 新创建的块指针
+ * 生成下一个块优先级
+ * @return 伪随机优先级
  */
-chunk *create_chunk(const char *content, size_t length) {
-    chunk *new_chunk = (chunk *)malloc(sizeof(chunk));
-    if (!new_chunk) {
+static uint32_t next_priority(void) {
+    priority_state ^= priority_state << 13;
+    priority_state ^= priority_state >> 17;
+    priority_state ^= priority_state << 5;
+    return priority_state;
+}
+
+// 内容哈希：模 2^61-1 的多项式哈希 H(s) = sum s[i] * B^(n-1-i)，
+// 拼接满足 H(a + b) = H(a) * B^|b| + H(b)，因此可以按 rope 节点缓存并组合
+#define HASH_MODULUS ((1ULL << 61) - 1)
+#define HASH_BASE 0x1F2E3D4C5B6A7989ULL
+
+/**
+ * 模 2^61-1 乘法
+ */
+static uint64_t hash_mul(uint64_t a, uint64_t b) {
+    unsigned __int128 product = (unsigned __int128)a * b;
+    uint64_t result = (uint64_t)(product & HASH_MODULUS) + (uint64_t)(product >> 61);
+    result = (result & HASH_MODULUS) + (result >> 61);
+    return result >= HASH_MODULUS ? result - HASH_MODULUS : result;
+}
+
+/**
+ * 计算 B^n
+ */
+static uint64_t hash_power(size_t n) {
+    uint64_t result = 1;
+    uint64_t base = HASH_BASE;
+
+    while (n > 0) {
+        if (n & 1) {
+            result = hash_mul(result, base);
+        }
+        base = hash_mul(base, base);
+        n >>= 1;
+    }
+
+    return result;
+}
+
+/**
+ * 拼接两段内容的哈希
+ * @param left 前一段的哈希
+ * @param right 后一段的哈希
+ * @param right_power B^|后一段|
+ */
+static uint64_t hash_concat(uint64_t left, uint64_t right, uint64_t right_power) {
+    uint64_t result = hash_mul(left, right_power) + right;
+    return result >= HASH_MODULUS ? result - HASH_MODULUS : result;
+}
+
+/**
+ * 计算一段内容的哈希（字节值加 1，使前导的 0 字节也影响结果）
+ */
+static uint64_t hash_bytes(const char *data, size_t length) {
+    uint64_t hash = 0;
+
+    for (size_t i = 0; i < length; i++) {
+        hash = hash_mul(hash, HASH_BASE) + (unsigned char)data[i] + 1;
+        if (hash >= HASH_MODULUS) {
+            hash -= HASH_MODULUS;
+        }
+    }
+
+    return hash;
+}
+
+/**
+ * 创建一个新的文本缓冲区
+ * @param capacity 缓冲区容量
+ * @return 新创建的缓冲区指针，引用计数为 1
+ */
+text_block *create_text_block(size_t capacity) {
+    // 缓冲区头部和数据一次分配
+    text_block *block = (text_block *)malloc(sizeof(text_block) + capacity);
+    if (!block) {
         return NULL;
     }
+    __atomic_add_fetch(&allocation_count, 1, __ATOMIC_RELAXED);
+
+    block->data = (char *)(block + 1);
+    block->capacity = capacity;
+    block->used = 0;
+    block->refs = 1;
+    block->mapped = 0;
+
+    return block;
+}
+
+/**
+ * 把文件内容只读映射为一个已写满的文本缓冲区，内容按需分页读入，不复制
+ * 映射是 MAP_PRIVATE 的，调用者不能截断或原地改写该文件（应写入新文件后 rename）
+ * @param fd 文件描述符（映射后可以关闭）
+ * @param length 文件长度，必须大于 0
+ * @return 新创建的缓冲区指针，引用计数为 1，映射或内存分配失败返回 NULL
+ */
+text_block *map_text_block(int fd, size_t length) {
+    text_block *block = (text_block *)malloc(sizeof(text_block));
+    if (!block) {
+        return NULL;
+    }
+
+    void *data = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        free(block);
+        return NULL;
+    }
+
+    __atomic_add_fetch(&allocation_count, 1, __ATOMIC_RELAXED);
+    block->data = (char *)data;
+    block->capacity = length;
+    block->used = length; // 已写满，不会再被追加
+    block->refs = 1;
+    block->mapped = length;
+
+    return block;
+}
+
+/**
+ * 释放引用已归零的文本缓冲区
+ * @param block 文本缓冲区
+ */
+static void destroy_text_block(text_block *block) {
+    if (block->mapped) {
+        munmap(block->data, block->mapped);
+    }
+    free(block);
+}
 
-    new_chunk->content = (char *)malloc(length + 1);
-    if (!new_chunk->content) {
-        free(new_chunk);
+/**
+ * 释放对文本缓冲区的一个引用，引用归零时释放缓冲区
+ * @param block 文本缓冲区
+ */
+void release_text_block(text_block *block) {
+    if (block && __atomic_sub_fetch(&block->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        destroy_text_block(block);
+    }
+}
+
+/**
+ * 创建片段，换行符数量已知
+ */
+static chunk *create_piece_counted(text_block *block, const char *content, size_t length, size_t newlines) {
+    chunk *new_chunk = (chunk *)slab_alloc(&chunk_pool);
+    if (!new_chunk) {
         return NULL;
     }
+    __atomic_add_fetch(&allocation_count, 1, __ATOMIC_RELAXED);
 
-    memcpy(new_chunk->content, content, length);
-    new_chunk->content[length] = '\0';
+    __atomic_add_fetch(&block->refs, 1, __ATOMIC_RELAXED);
+    new_chunk->content = (char *)content;
     new_chunk->length = length;
-    new_chunk->next = NULL;
+    new_chunk->block = block;
+    new_chunk->newlines = newlines;
+    new_chunk->subtree_newlines = newlines;
+    new_chunk->left = NULL;
+    new_chunk->right = NULL;
+    new_chunk->subtree_length = length;
+    new_chunk->subtree_chunks = 1;
+    new_chunk->priority = next_priority();
+    new_chunk->hash_flags = 0;
+
+    return new_chunk;
+}
+
+/**
+ * 创建一个引用已有文本的块（片段），不复制内容
+ * @param block 内容所在的缓冲区
+ * @param content 片段起始地址（位于 block 内）
+ * @param length 片段长度
+ * @return 新创建的块指针
+ */
+chunk *create_piece(text_block *block, const char *content, size_t length) {
+    return create_piece_counted(block, content, length, scan_count_newlines(content, length));
+}
+
+/**
+ * 创建一个新的文档块，内容复制到独立的缓冲区
+ * @param content 块内容
+ * @param length 内容长度
+ * @return 新创建的块指针
+ */
+chunk *create_chunk(const char *content, size_t length) {
+    text_block *block = create_text_block(length);
+    if (!block) {
+        return NULL;
+    }
+
+    memcpy(block->data, content, length);
+    block->used = length;
 
+    chunk *new_chunk = create_piece(block, block->data, length);
+    release_text_block(block); // 缓冲区只由新块持有
     return new_chunk;
 }
 
 /**
- * 释放文档块及其内容
+ * 释放文档块，并释放它对缓冲区的引用
  * @param c 要释放的块
  */
 void free_chunk(chunk *c) {
     if (c) {
-        free(c->content);
-        free(c);
+        release_text_block(c->block);
+        slab_free(&chunk_pool, c);
     }
 }
 
@@ -52,7 +240,7 @@ void free_chunk(chunk *c) {
  * @return 新创建的命令指针
  */
 edit_command *create_command(command_type type, uint64_t version, size_t pos1, size_t pos2, const char *content, int level, const char *username, const char *original_cmd) {
-    edit_command *cmd = (edit_command *)malloc(sizeof(edit_command));
+    edit_command *cmd = (edit_command *)slab_alloc(&command_pool);
     if (!cmd) {
         return NULL;
     }
@@ -65,41 +253,32 @@ edit_command *create_command(command_type type, uint64_t version, size_t pos1, s
     cmd->status = SUCCESS; // 默认成功
     cmd->next = NULL;
 
-    // 复制内容
-    if (content) {
-        cmd->content = strdup(content);
-        if (!cmd->content) {
-            free(cmd);
-            return NULL;
-        }
-    } else {
-        cmd->content = NULL;
-    }
+    // 内容、用户名和原始命令复制到同一块内存中
+    size_t content_len = content ? strlen(content) + 1 : 0;
+    size_t username_len = username ? strlen(username) + 1 : 0;
+    size_t original_len = original_cmd ? strlen(original_cmd) + 1 : 0;
+    size_t total = content_len + username_len + original_len;
 
-    // 复制用户名
-    if (username) {
-        cmd->username = strdup(username);
-        if (!cmd->username) {
-            free(cmd->content);
-            free(cmd);
+    cmd->strings = NULL;
+    if (total > 0) {
+        cmd->strings = (char *)malloc(total);
+        if (!cmd->strings) {
+            slab_free(&command_pool, cmd);
             return NULL;
         }
-    } else {
-        cmd->username = NULL;
+        __atomic_add_fetch(&allocation_count, 1, __ATOMIC_RELAXED);
     }
+    __atomic_add_fetch(&allocation_count, 1, __ATOMIC_RELAXED);
 
-    // 复制原始命令
-    if (original_cmd) {
-        cmd->original_cmd = strdup(original_cmd);
-        if (!cmd->original_cmd) {
-            free(cmd->username);
-            free(cmd->content);
-            free(cmd);
-            return NULL;
-        }
-    } else {
-        cmd->original_cmd = NULL;
-    }
+    char *cursor = cmd->strings;
+
+    cmd->content = content ? memcpy(cursor, content, content_len) : NULL;
+    cursor += content_len;
+
+    cmd->username = username ? memcpy(cursor, username, username_len) : NULL;
+    cursor += username_len;
+
+    cmd->original_cmd = original_cmd ? memcpy(cursor, original_cmd, original_len) : NULL;
 
     return cmd;
 }
@@ -110,15 +289,54 @@ edit_command *create_command(command_type type, uint64_t version, size_t pos1, s
  */
 void free_command(edit_command *cmd) {
     if (cmd) {
-        free(cmd->content);
-        free(cmd->username);
-        free(cmd->original_cmd);
-        free(cmd);
+        free(cmd->strings);
+        slab_free(&command_pool, cmd);
     }
 }
 
 /**
- * 添加待处理的编辑命令到文档
+ * 获取进程启动以来块、文本缓冲区和编辑命令（含其字符串）的分配次数
+ * @return 分配次数
+ */
+size_t document_allocation_count(void) {
+    return __atomic_load_n(&allocation_count, __ATOMIC_RELAXED);
+}
+
+/**
+ * 获取编辑命令占用的堆内存：命令头和共用的字符串块
+ * @param cmd 编辑命令
+ * @return 字节数
+ */
+size_t command_bytes(const edit_command *cmd) {
+    size_t bytes = sizeof(edit_command);
+
+    if (cmd->content) {
+        bytes += strlen(cmd->content) + 1;
+    }
+    if (cmd->username) {
+        bytes += strlen(cmd->username) + 1;
+    }
+    if (cmd->original_cmd) {
+        bytes += strlen(cmd->original_cmd) + 1;
+    }
+
+    return bytes;
+}
+
+/**
+ * 释放已经没有在用对象的对象池，归还其全部内存
+ */
+void trim_document_pools(void) {
+    if (chunk_pool.in_use == 0) {
+        slab_pool_destroy(&chunk_pool);
+    }
+    if (command_pool.in_use == 0) {
+        slab_pool_destroy(&command_pool);
+    }
+}
+
+/**
+ * 添加待处理的编辑命令到文档，通过尾指针 O(1) 追加
  * @param doc 文档
  * @param cmd 编辑命令
  */
@@ -127,19 +345,76 @@ void add_pending_edit(document *doc, edit_command *cmd) {
         return;
     }
 
+    cmd->next = NULL;
     if (!doc->pending_edits) {
         doc->pending_edits = cmd;
     } else {
-        edit_command *current = doc->pending_edits;
-        while (current->next) {
-            current = current->next;
+        doc->pending_tail->next = cmd;
+    }
+    doc->pending_tail = cmd;
+    doc->pending_count++;
+}
+
+/**
+ * 取得指定版本的历史段，版本比最后一段新时追加一个空段
+ * @param doc 文档
+ * @param version 提交版本
+ * @return 历史段，内存分配失败返回 NULL
+ */
+static history_segment *history_segment_for(document *doc, uint64_t version) {
+    if (doc->history_segment_count > 0) {
+        history_segment *last = &doc->history_segments[doc->history_segment_count - 1];
+        if (last->version >= version) {
+            return last;
+        }
+    }
+
+    if (doc->history_segment_count == doc->history_segment_capacity) {
+        size_t new_capacity = doc->history_segment_capacity ? doc->history_segment_capacity * 2 : 16;
+        history_segment *grown = realloc(doc->history_segments, new_capacity * sizeof(history_segment));
+        if (!grown) {
+            return NULL;
         }
-        current->next = cmd;
+        doc->history_segments = grown;
+        doc->history_segment_capacity = new_capacity;
     }
+
+    history_segment *segment = &doc->history_segments[doc->history_segment_count++];
+    segment->version = version;
+    segment->first = NULL;
+    segment->last = NULL;
+    segment->count = 0;
+    return segment;
 }
 
 /**
- * 添加编辑命令到文档历史
+ * 将一段命令链表接到编辑历史末尾，并记入当前版本的历史段
+ * @param doc 文档
+ * @param first 链表头
+ * @param last 链表尾
+ * @param count 命令数量
+ */
+static void append_history(document *doc, edit_command *first, edit_command *last, size_t count) {
+    // 段索引分配失败时历史仍然完整，只是该版本无法按版本查找
+    history_segment *segment = history_segment_for(doc, doc->version);
+    if (segment) {
+        if (!segment->first) {
+            segment->first = first;
+        }
+        segment->last = last;
+        segment->count += count;
+    }
+
+    if (!doc->edit_history) {
+        doc->edit_history = first;
+    } else {
+        doc->history_tail->next = first;
+    }
+    doc->history_tail = last;
+}
+
+/**
+ * 添加编辑命令到文档历史，记在当前版本的历史段中
  * @param doc 文档
  * @param cmd 编辑命令
  */
@@ -148,13 +423,732 @@ void add_edit_history(document *doc, edit_command *cmd) {
         return;
     }
 
+    cmd->next = NULL;
+    append_history(doc, cmd, cmd, 1);
+}
+
+/**
+ * 将全部待处理命令整体移入编辑历史，作为当前版本的历史段，O(1)
+ * @param doc 文档
+ */
+void commit_pending_edits(document *doc) {
+    if (!doc || !doc->pending_edits) {
+        return;
+    }
+
+    append_history(doc, doc->pending_edits, doc->pending_tail, doc->pending_count);
+    doc->pending_edits = NULL;
+    doc->pending_tail = NULL;
+    doc->pending_count = 0;
+
+    trim_edit_history(doc);
+}
+
+/**
+ * 把超出保留数量的最旧版本移出内存：有归档时先按版本追加到归档，再释放其命令
+ * 只处理有历史段索引的版本，段索引分配失败时留下的命令随文档一起释放
+ * @param doc 文档
+ */
+void trim_edit_history(document *doc) {
+    if (!doc || doc->history_limit == 0 || doc->history_segment_count <= doc->history_limit) {
+        return;
+    }
+
+    size_t excess = doc->history_segment_count - doc->history_limit;
+    for (size_t i = 0; i < excess; i++) {
+        history_segment *segment = &doc->history_segments[i];
+
+        // 段的版本是提交后的版本，归档中记录广播时的版本号
+        if (doc->archive) {
+            history_archive_append(doc->archive, segment->version - 1, segment->first, segment->last);
+        }
+
+        // 段之前可能有未编入段的命令，从链表头一直释放到段尾
+        edit_command *end = segment->last->next;
+        edit_command *cmd = doc->edit_history;
+        while (cmd != end) {
+            edit_command *next = cmd->next;
+            free_command(cmd);
+            cmd = next;
+        }
+        doc->edit_history = end;
+    }
+
     if (!doc->edit_history) {
-        doc->edit_history = cmd;
+        doc->history_tail = NULL;
+    }
+
+    doc->history_segment_count -= excess;
+    memmove(doc->history_segments, doc->history_segments + excess, doc->history_segment_count * sizeof(history_segment));
+}
+
+/**
+ * 二分查找指定版本提交的历史段
+ * @param doc 文档
+ * @param version 提交版本
+ * @return 历史段，该版本没有命令时返回 NULL
+ */
+const history_segment *find_history_segment(const document *doc, uint64_t version) {
+    if (!doc) {
+        return NULL;
+    }
+
+    size_t low = 0;
+    size_t high = doc->history_segment_count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (doc->history_segments[mid].version < version) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    if (low < doc->history_segment_count && doc->history_segments[low].version == version) {
+        return &doc->history_segments[low];
+    }
+    return NULL;
+}
+
+/**
+ * 获取子树内容总长度
+ * @param root 子树根
+ * @return 子树长度，空树为 0
+ */
+size_t rope_length(const chunk *root) {
+    return root ? root->subtree_length : 0;
+}
+
+/**
+ * 获取子树中的块数量
+ * @param root 子树根
+ * @return 块数量，空树为 0
+ */
+size_t rope_chunk_count(const chunk *root) {
+    return root ? root->subtree_chunks : 0;
+}
+
+/**
+ * 获取子树中换行符的数量
+ * @param root 子树根
+ * @return 换行符数量，空树为 0
+ */
+size_t rope_newline_count(const chunk *root) {
+    return root ? root->subtree_newlines : 0;
+}
+
+/**
+ * 根据子节点重新计算节点的聚合信息
+ * @param c 节点
+ */
+static void rope_update(chunk *c) {
+    c->subtree_length = rope_length(c->left) + c->length + rope_length(c->right);
+    c->subtree_chunks = rope_chunk_count(c->left) + 1 + rope_chunk_count(c->right);
+    c->subtree_newlines = rope_newline_count(c->left) + c->newlines + rope_newline_count(c->right);
+    c->hash_flags &= ~CHUNK_HASH_SUBTREE;
+}
+
+/**
+ * 统计 [0, pos) 范围内换行符的数量，即 pos 所在的行号（从 0 开始）
+ * @param root rope 根
+ * @param pos 位置
+ * @return 换行符数量
+ */
+size_t rope_newlines_before(const chunk *root, size_t pos) {
+    size_t count = 0;
+
+    while (root) {
+        size_t left_len = rope_length(root->left);
+
+        if (pos <= left_len) {
+            root = root->left;
+            continue;
+        }
+
+        count += rope_newline_count(root->left);
+        pos -= left_len;
+
+        if (pos <= root->length) {
+            return count + scan_count_newlines(root->content, pos);
+        }
+
+        count += root->newlines;
+        pos -= root->length;
+        root = root->right;
+    }
+
+    return count;
+}
+
+/**
+ * 获取第 line 行（从 0 开始）的起始位置，即第 line 个换行符之后的位置
+ * @param root rope 根
+ * @param line 行号
+ * @return 行起始位置，行号超出范围时返回文档长度
+ */
+size_t rope_line_start(const chunk *root, size_t line) {
+    size_t base = 0;
+
+    if (line == 0) {
+        return 0;
+    }
+
+    while (root) {
+        size_t left_newlines = rope_newline_count(root->left);
+
+        if (line <= left_newlines) {
+            root = root->left;
+            continue;
+        }
+
+        line -= left_newlines;
+        base += rope_length(root->left);
+
+        if (line <= root->newlines) {
+            return base + scan_find_nth_newline(root->content, root->length, line) + 1;
+        }
+
+        line -= root->newlines;
+        base += root->length;
+        root = root->right;
+    }
+
+    return base;
+}
+
+/**
+ * 查找包含指定位置的块
+ * 位置等于总长度时返回最后一个块，偏移量为该块长度
+ * @param root rope 根
+ * @param pos 位置
+ * @param offset 返回在块中的偏移量
+ * @return 找到的块，位置越界或树为空时返回 NULL
+ */
+chunk *rope_find(chunk *root, size_t pos, size_t *offset) {
+    if (!root || pos > root->subtree_length) {
+        return NULL;
+    }
+
+    chunk *current = root;
+    while (current) {
+        size_t left_len = rope_length(current->left);
+
+        if (pos < left_len) {
+            current = current->left;
+        } else if (pos < left_len + current->length ||
+                   (pos == left_len + current->length && !current->right)) {
+            // 命中本块；文档末尾落在最右侧块的结尾
+            *offset = pos - left_len;
+            return current;
+        } else {
+            pos -= left_len + current->length;
+            current = current->right;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * 借助定位缓存查找包含指定位置的块，语义与 rope_find 相同
+ * 从缓存路径的末端向上回退到包含该位置的最近子树，再从那里向下查找，
+ * 重复或相邻的查找只需要常数步。rope 结构变化后调用者必须把 depth 置 0。
+ * @param finger 定位缓存
+ * @param root rope 根
+ * @param pos 位置
+ * @param offset 返回在块中的偏移量
+ * @return 找到的块，位置越界或树为空时返回 NULL
+ */
+chunk *rope_finger_find(rope_finger *finger, chunk *root, size_t pos, size_t *offset) {
+    if (!root || pos > root->subtree_length) {
+        return NULL;
+    }
+
+    size_t depth = finger->depth;
+    if (depth == 0 || finger->path[0] != root) {
+        finger->path[0] = root;
+        finger->base[0] = 0;
+        depth = 1;
+    }
+
+    // 回退到子树范围包含 pos 的节点（根总是满足）
+    while (depth > 1 &&
+           (pos < finger->base[depth - 1] ||
+            pos >= finger->base[depth - 1] + finger->path[depth - 1]->subtree_length)) {
+        depth--;
+    }
+
+    chunk *current = finger->path[depth - 1];
+    size_t base = finger->base[depth - 1];
+
+    for (;;) {
+        size_t left_len = rope_length(current->left);
+        size_t local = pos - base;
+        chunk *next;
+
+        if (local < left_len) {
+            next = current->left;
+        } else if (local < left_len + current->length ||
+                   (local == left_len + current->length && !current->right)) {
+            finger->depth = depth;
+            *offset = local - left_len;
+            return current;
+        } else {
+            next = current->right;
+            base += left_len + current->length;
+        }
+
+        if (depth == FINGER_DEPTH) {
+            // 树异常地深，放弃缓存
+            finger->depth = 0;
+            return rope_find(root, pos, offset);
+        }
+
+        finger->path[depth] = next;
+        finger->base[depth] = base;
+        depth++;
+        current = next;
+    }
+}
+
+/**
+ * 按位置分割子树（递归部分），tail 为预先分配好的块尾部
+ */
+static void rope_split_at(chunk *root, size_t pos, chunk *tail, chunk **left, chunk **right) {
+    if (!root) {
+        *left = NULL;
+        *right = NULL;
+        return;
+    }
+
+    size_t left_len = rope_length(root->left);
+
+    if (pos <= left_len) {
+        rope_split_at(root->left, pos, tail, left, &root->left);
+        rope_update(root);
+        *right = root;
+    } else if (pos >= left_len + root->length) {
+        rope_split_at(root->right, pos - left_len - root->length, tail, &root->right, right);
+        rope_update(root);
+        *left = root;
     } else {
-        edit_command *current = doc->edit_history;
-        while (current->next) {
-            current = current->next;
+        // 分割点落在本块内部：本块保留前半部分，tail 接管后半部分和右子树
+        root->length = pos - left_len;
+        root->newlines -= tail->newlines;
+        root->hash_flags = 0;
+
+        tail->right = root->right;
+        tail->priority = root->priority; // 继承优先级以保持堆序
+        root->right = NULL;
+
+        rope_update(root);
+        rope_update(tail);
+        *left = root;
+        *right = tail;
+    }
+}
+
+/**
+ * 在指定位置把 rope 分割为两部分，必要时分割位置所在的块
+ * @param root rope 根
+ * @param pos 分割位置
+ * @param left 返回 [0, pos) 部分
+ * @param right 返回 [pos, 末尾) 部分
+ * @return 成功返回 0，内存分配失败返回 -1（此时树保持不变）
+ */
+int rope_split(chunk *root, size_t pos, chunk **left, chunk **right) {
+    chunk *tail = NULL;
+    size_t offset;
+    chunk *target = rope_find(root, pos, &offset);
+
+    // 先分配块尾部（与原块共享内容），保证分割过程中不会失败
+    if (target && offset > 0 && offset < target->length) {
+        // 只扫描较短的一半来统计换行符
+        size_t tail_newlines;
+        if (offset < target->length / 2) {
+            tail_newlines = target->newlines - scan_count_newlines(target->content, offset);
+        } else {
+            tail_newlines = scan_count_newlines(target->content + offset, target->length - offset);
+        }
+
+        tail = create_piece_counted(target->block, target->content + offset, target->length - offset, tail_newlines);
+        if (!tail) {
+            return -1;
+        }
+    }
+
+    rope_split_at(root, pos, tail, left, right);
+    return 0;
+}
+
+/**
+ * 按块数量分割 rope，不会分割任何块
+ * @param root rope 根
+ * @param count 左半部分包含的块数量
+ * @param left 返回前 count 个块
+ * @param right 返回其余的块
+ */
+void rope_split_chunks(chunk *root, size_t count, chunk **left, chunk **right) {
+    if (!root) {
+        *left = NULL;
+        *right = NULL;
+        return;
+    }
+
+    size_t left_count = rope_chunk_count(root->left);
+
+    if (count <= left_count) {
+        rope_split_chunks(root->left, count, left, &root->left);
+        rope_update(root);
+        *right = root;
+    } else {
+        rope_split_chunks(root->right, count - left_count - 1, &root->right, right);
+        rope_update(root);
+        *left = root;
+    }
+}
+
+/**
+ * 拼接两个 rope，left 的内容位于 right 之前
+ * @param left 前半部分
+ * @param right 后半部分
+ * @return 拼接后的根
+ */
+chunk *rope_merge(chunk *left, chunk *right) {
+    if (!left) {
+        return right;
+    }
+    if (!right) {
+        return left;
+    }
+
+    if (left->priority > right->priority) {
+        left->right = rope_merge(left->right, right);
+        rope_update(left);
+        return left;
+    }
+
+    right->left = rope_merge(left, right->left);
+    rope_update(right);
+    return right;
+}
+
+/**
+ * 把一个块（丢弃它原有的子树链接）追加到 rope 末尾
+ * @param root rope 根
+ * @param c 要追加的块
+ * @return 追加后的根
+ */
+chunk *rope_append(chunk *root, chunk *c) {
+    c->left = NULL;
+    c->right = NULL;
+    rope_update(c);
+    return rope_merge(root, c);
+}
+
+/**
+ * 尝试把内容追加到 rope 的最后一个块上，避免新建片段
+ * 仅当最后一个块位于 block 中且恰好结束在 block 的已写入末尾时生效
+ * @param root rope 根
+ * @param block 追加缓冲区
+ * @param content 要追加的内容
+ * @param length 内容长度
+ * @return 追加成功返回 1，否则返回 0
+ */
+int rope_extend_last(chunk *root, text_block *block, const char *content, size_t length) {
+    if (!root || !block || block->capacity - block->used < length) {
+        return 0;
+    }
+
+    chunk *last = root;
+    while (last->right) {
+        last = last->right;
+    }
+
+    if (last->block != block || last->content + last->length != block->data + block->used) {
+        return 0;
+    }
+
+    size_t newlines = scan_count_newlines(content, length);
+
+    memcpy(block->data + block->used, content, length);
+    block->used += length;
+    last->length += length;
+    last->newlines += newlines;
+
+    // 已缓存的块哈希直接向后延伸，不重新扫描整个块
+    if (last->hash_flags & CHUNK_HASH_OWN) {
+        last->hash = hash_concat(last->hash, hash_bytes(content, length), hash_power(length));
+    }
+
+    // 更新右侧链上所有祖先的子树长度和换行符数量，子树哈希失效
+    for (chunk *current = root; current; current = current->right) {
+        current->subtree_length += length;
+        current->subtree_newlines += newlines;
+        current->hash_flags &= ~CHUNK_HASH_SUBTREE;
+    }
+
+    return 1;
+}
+
+/**
+ * 按文档顺序遍历所有块
+ * @param root rope 根
+ * @param visit 访问回调
+ * @param ctx 回调上下文
+ */
+void rope_walk(const chunk *root, void (*visit)(const chunk *c, void *ctx), void *ctx) {
+    while (root) {
+        rope_walk(root->left, visit, ctx);
+        visit(root, ctx);
+        root = root->right;
+    }
+}
+
+/**
+ * 复制文档中 [pos, pos + length) 的内容，只访问与区间相交的块
+ * @param root rope 根
+ * @param pos 起始位置
+ * @param length 复制长度
+ * @param out 输出缓冲区，至少 length 字节
+ * @return 实际复制的字节数（区间超出文档时截断）
+ */
+size_t rope_copy(const chunk *root, size_t pos, size_t length, char *out) {
+    size_t copied = 0;
+
+    while (root && length > 0) {
+        size_t left_length = rope_length(root->left);
+
+        if (pos < left_length) {
+            size_t n = rope_copy(root->left, pos, length, out + copied);
+            copied += n;
+            length -= n;
+            pos = left_length;
+        }
+
+        pos -= left_length;
+        if (length > 0 && pos < root->length) {
+            size_t n = root->length - pos < length ? root->length - pos : length;
+            memcpy(out + copied, root->content + pos, n);
+            copied += n;
+            length -= n;
+            pos = root->length;
+        }
+
+        if (pos < root->length) {
+            break;
         }
-        current->next = cmd;
+        pos -= root->length;
+        root = root->right;
+    }
+
+    return copied;
+}
+
+/**
+ * 记录一个尚未输出的祖先，栈满时丢弃已记录的祖先，之后改为从根重新定位
+ */
+static void rope_iter_push(rope_iter *it, const chunk *node) {
+    if (it->depth == FINGER_DEPTH) {
+        it->depth = 0;
+        it->truncated = 1;
     }
+    it->stack[it->depth++] = node;
+}
+
+/**
+ * 从根定位 pos 所在的块，沿途记录目标位于其左子树的祖先
+ */
+static void rope_iter_seek(rope_iter *it, size_t pos) {
+    const chunk *node = it->root;
+
+    it->depth = 0;
+    it->truncated = 0;
+    it->current = NULL;
+
+    while (node) {
+        size_t left_length = rope_length(node->left);
+
+        if (pos < left_length) {
+            rope_iter_push(it, node);
+            node = node->left;
+        } else if (pos < left_length + node->length) {
+            it->current = node;
+            it->offset = pos - left_length;
+            return;
+        } else {
+            pos -= left_length + node->length;
+            node = node->right;
+        }
+    }
+}
+
+/**
+ * 初始化区间迭代器，只做一次从根开始的定位
+ * 迭代期间 rope 不能被修改
+ * @param it 迭代器
+ * @param root rope 根
+ * @param pos 区间起始位置
+ * @param length 区间长度，超出文档末尾的部分被截断
+ */
+void rope_iter_init(rope_iter *it, const chunk *root, size_t pos, size_t length) {
+    size_t total = rope_length(root);
+
+    it->root = root;
+    it->pos = pos;
+    it->remaining = pos < total ? (length < total - pos ? length : total - pos) : 0;
+    rope_iter_seek(it, pos);
+}
+
+/**
+ * 取出区间内的下一段内容（一个块与区间相交的部分），内容直接指向块，不复制
+ * @param it 迭代器
+ * @param data 返回内容起始地址
+ * @param length 返回内容长度
+ * @return 取到内容返回 1，区间结束返回 0
+ */
+int rope_iter_next(rope_iter *it, const char **data, size_t *length) {
+    if (it->remaining == 0) {
+        return 0;
+    }
+
+    if (!it->current) {
+        if (it->depth > 0) {
+            it->current = it->stack[--it->depth];
+            it->offset = 0;
+        } else if (it->truncated) {
+            rope_iter_seek(it, it->pos);
+        }
+
+        if (!it->current) {
+            it->remaining = 0;
+            return 0;
+        }
+    }
+
+    const chunk *node = it->current;
+    size_t n = node->length - it->offset;
+    if (n > it->remaining) {
+        n = it->remaining;
+    }
+
+    *data = node->content + it->offset;
+    *length = n;
+    it->pos += n;
+    it->remaining -= n;
+    it->current = NULL;
+
+    // node 之后的内容从其右子树最左侧的块开始
+    if (it->remaining > 0) {
+        for (const chunk *child = node->right; child; child = child->left) {
+            rope_iter_push(it, child);
+        }
+    }
+
+    return 1;
+}
+
+/**
+ * 计算整棵 rope 内容的哈希，与块的划分方式无关
+ * 每个节点缓存本块和子树的哈希，只重新计算结构变化后失效的节点，
+ * 一次编辑之后通常只需扫描被分割的块并沿路径重新组合
+ * @param root rope 根
+ * @return 内容哈希，空文档为 0
+ */
+uint64_t rope_hash(chunk *root) {
+    if (!root) {
+        return 0;
+    }
+
+    if (!(root->hash_flags & CHUNK_HASH_SUBTREE)) {
+        if (!(root->hash_flags & CHUNK_HASH_OWN)) {
+            root->hash = hash_bytes(root->content, root->length);
+            root->hash_flags |= CHUNK_HASH_OWN;
+        }
+
+        // 先递归计算子树，子树的 subtree_power 在递归返回后才有效
+        uint64_t own_power = hash_power(root->length);
+        uint64_t hash = rope_hash(root->left);
+        uint64_t power = root->left ? root->left->subtree_power : 1;
+
+        hash = hash_concat(hash, root->hash, own_power);
+        power = hash_mul(power, own_power);
+
+        if (root->right) {
+            uint64_t right_hash = rope_hash(root->right);
+            hash = hash_concat(hash, right_hash, root->right->subtree_power);
+            power = hash_mul(power, root->right->subtree_power);
+        }
+
+        root->subtree_hash = hash;
+        root->subtree_power = power;
+        root->hash_flags |= CHUNK_HASH_SUBTREE;
+    }
+
+    return root->subtree_hash;
+}
+
+// 批量释放块时的状态：待归还的块链表，以及当前连续使用同一缓冲区的块数
+typedef struct {
+    chunk *first;
+    chunk *last;
+    size_t count;
+    text_block *block;
+    size_t block_refs;
+} free_span;
+
+/**
+ * 一次释放缓冲区的多个引用
+ * @param block 缓冲区
+ * @param refs 引用数量
+ */
+static void release_text_block_refs(text_block *block, size_t refs) {
+    if (block && refs > 0 && __atomic_sub_fetch(&block->refs, refs, __ATOMIC_ACQ_REL) == 0) {
+        destroy_text_block(block);
+    }
+}
+
+/**
+ * 按顺序把子树中的块串入待归还链表，连续使用同一缓冲区的块合并释放引用
+ * @param root 子树根
+ * @param span 批量释放状态
+ */
+static void collect_free_span(chunk *root, free_span *span) {
+    while (root) {
+        // 块的首字会被用作空闲链表指针，先取出后面还要用到的字段
+        chunk *left = root->left;
+        chunk *right = root->right;
+        text_block *block = root->block;
+
+        collect_free_span(left, span);
+
+        if (block != span->block) {
+            release_text_block_refs(span->block, span->block_refs);
+            span->block = block;
+            span->block_refs = 0;
+        }
+        span->block_refs++;
+
+        *(void **)root = span->first;
+        span->first = root;
+        if (!span->last) {
+            span->last = root;
+        }
+        span->count++;
+
+        root = right;
+    }
+}
+
+/**
+ * 释放整棵 rope
+ * 整段块一次归还到对象池；片段表模式下同一追加缓冲区的连续块只做一次原子递减
+ * @param root rope 根
+ */
+void rope_free(chunk *root) {
+    free_span span = { NULL, NULL, 0, NULL, 0 };
+
+    collect_free_span(root, &span);
+    release_text_block_refs(span.block, span.block_refs);
+    slab_free_chain(&chunk_pool, span.first, span.last, span.count);
 }
@@ -0,0 +1,260 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "../libs/history.h"
+
+#define ARCHIVE_PERM 0644
+
+/**
+ * 获取命令状态在广播和日志中的文字
+ * @param status 命令状态
+ * @return 拒绝原因，成功时返回 "SUCCESS"
+ */
+const char *command_status_reason(int status) {
+    switch (status) {
+        case SUCCESS:
+            return "SUCCESS";
+        case INVALID_CURSOR_POS:
+            return "INVALID_POSITION";
+        case DELETED_POSITION:
+            return "DELETED_POSITION";
+        case OUTDATED_VERSION:
+            return "OUTDATED_VERSION";
+        case UNAUTHORIZED:
+            return "UNAUTHORISED";
+        default:
+            return "UNKNOWN";
+    }
+}
+
+/**
+ * 按广播格式输出一段命令：每条命令一行 EDIT <username> [<base_version>] <command> <status>
+ * 基于更早版本被接受的命令在用户名后附带它的基础版本，接收方按该版本的坐标执行
+ * @param stream 输出流
+ * @param version 这段命令执行时的已提交版本（广播的版本号）
+ * @param first 第一条命令
+ * @param last 最后一条命令（包含）
+ */
+void history_write_edits(FILE *stream, uint64_t version, const edit_command *first, const edit_command *last) {
+    for (const edit_command *cmd = first; cmd; cmd = cmd == last ? NULL : cmd->next) {
+        // original_cmd 去除换行
+        const char *original_cmd = cmd->original_cmd ? cmd->original_cmd : "";
+        int original_len = (int)strcspn(original_cmd, "\n");
+
+        fprintf(stream, "EDIT %s ", cmd->username ? cmd->username : "");
+        if (cmd->status == SUCCESS && cmd->version != version) {
+            fprintf(stream, "%lu ", cmd->version);
+        }
+        fprintf(stream, "%.*s", original_len, original_cmd);
+        if (cmd->status == SUCCESS) {
+            fprintf(stream, " SUCCESS\n");
+        } else {
+            fprintf(stream, " Reject %s\n", command_status_reason(cmd->status));
+        }
+    }
+}
+
+/**
+ * 把缓冲区完整写入文件描述符，处理部分写入
+ * @return 成功返回 0，写入失败返回 -1
+ */
+static int write_all(int fd, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(fd, data, length);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += written;
+        length -= (size_t)written;
+    }
+    return 0;
+}
+
+/**
+ * 从已有的索引文件恢复归档状态：丢弃写入中途崩溃留下的不完整索引项，
+ * 以及数据文件中最后一个已索引版本之后未被索引的尾部
+ * @param archive 已打开文件的归档
+ * @return 成功返回 0，读取或截断失败返回 -1
+ */
+static int history_archive_recover(history_archive *archive) {
+    struct stat st;
+    if (fstat(archive->index_fd, &st) == -1) {
+        return -1;
+    }
+
+    size_t count = (size_t)st.st_size / sizeof(history_index_entry);
+    history_index_entry last = { 0, 0, 0 };
+    if (count > 0 && pread(archive->index_fd, &last, sizeof(last),
+                           (off_t)((count - 1) * sizeof(history_index_entry))) != (ssize_t)sizeof(last)) {
+        return -1;
+    }
+
+    if (ftruncate(archive->index_fd, (off_t)(count * sizeof(history_index_entry))) != 0 ||
+        ftruncate(archive->data_fd, (off_t)(last.offset + last.length)) != 0) {
+        return -1;
+    }
+
+    archive->version_count = count;
+    archive->last_version = last.version;
+    archive->data_length = (size_t)(last.offset + last.length);
+    return 0;
+}
+
+/**
+ * 打开归档：数据文件为 path，索引文件为 path.idx
+ * 重新开始时清空已有的同名文件；否则在已有的归档之后继续追加
+ * @param archive 归档
+ * @param path 数据文件路径
+ * @param truncate 非 0 时清空已有的归档
+ * @return 成功返回 0，打开或恢复失败返回 -1
+ */
+int history_archive_open(history_archive *archive, const char *path, int truncate) {
+    if (!archive || !path) {
+        return -1;
+    }
+
+    char index_path[4096];
+    if (snprintf(index_path, sizeof(index_path), "%s.idx", path) >= (int)sizeof(index_path)) {
+        return -1;
+    }
+
+    int flags = O_RDWR | O_CREAT | O_APPEND | (truncate ? O_TRUNC : 0);
+    archive->data_fd = open(path, flags, ARCHIVE_PERM);
+    archive->index_fd = open(index_path, flags, ARCHIVE_PERM);
+    archive->data_length = 0;
+    archive->version_count = 0;
+    archive->last_version = 0;
+
+    if (archive->data_fd == -1 || archive->index_fd == -1 || history_archive_recover(archive) != 0) {
+        history_archive_close(archive);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * 关闭归档文件，文件内容保留在磁盘上
+ * @param archive 归档
+ */
+void history_archive_close(history_archive *archive) {
+    if (!archive) {
+        return;
+    }
+
+    if (archive->data_fd != -1) {
+        close(archive->data_fd);
+    }
+    if (archive->index_fd != -1) {
+        close(archive->index_fd);
+    }
+    archive->data_fd = -1;
+    archive->index_fd = -1;
+}
+
+/**
+ * 把一个版本的命令追加到归档，先写数据再写索引，索引中只出现完整写入的版本
+ * @param archive 归档
+ * @param version 广播时的版本号
+ * @param first 该版本第一条命令
+ * @param last 该版本最后一条命令（包含）
+ * @return 成功返回 0（已归档的版本被跳过），失败返回 -1（数据文件可能留下未被索引的尾部，之后的版本照常追加）
+ */
+int history_archive_append(history_archive *archive, uint64_t version, const edit_command *first, const edit_command *last) {
+    if (!archive || archive->data_fd == -1) {
+        return -1;
+    }
+
+    // 恢复时重放的版本可能在崩溃前已经归档
+    if (archive->version_count > 0 && version <= archive->last_version) {
+        return 0;
+    }
+
+    char *text = NULL;
+    size_t text_len = 0;
+    FILE *stream = open_memstream(&text, &text_len);
+    if (!stream) {
+        return -1;
+    }
+
+    fprintf(stream, "VERSION %lu\n", version);
+    history_write_edits(stream, version, first, last);
+    fprintf(stream, "END\n");
+    fclose(stream);
+
+    history_index_entry entry = { version, archive->data_length, text_len };
+    int result = write_all(archive->data_fd, text, text_len);
+    free(text);
+
+    if (result != 0) {
+        // 写入的字节数未知，按文件实际长度继续追加
+        off_t end = lseek(archive->data_fd, 0, SEEK_END);
+        archive->data_length = end < 0 ? archive->data_length : (size_t)end;
+        return -1;
+    }
+    archive->data_length += text_len;
+
+    if (write_all(archive->index_fd, (const char *)&entry, sizeof(entry)) != 0) {
+        return -1;
+    }
+    archive->version_count++;
+    archive->last_version = version;
+
+    return 0;
+}
+
+/**
+ * 通过只读映射读出从指定版本开始的所有已归档版本，写入文件描述符
+ * 在映射的索引中二分查找起始版本，数据直接从映射写出，不复制到堆上
+ * @param archive 归档
+ * @param from_version 起始版本号（包含）
+ * @param fd 输出的文件描述符
+ * @return 成功返回 0（没有符合的版本也算成功），映射或写入失败返回 -1
+ */
+int history_archive_write(const history_archive *archive, uint64_t from_version, int fd) {
+    if (!archive || archive->data_fd == -1 || archive->version_count == 0) {
+        return 0;
+    }
+
+    size_t index_length = archive->version_count * sizeof(history_index_entry);
+    const history_index_entry *index = mmap(NULL, index_length, PROT_READ, MAP_SHARED, archive->index_fd, 0);
+    if (index == MAP_FAILED) {
+        return -1;
+    }
+
+    size_t low = 0;
+    size_t high = archive->version_count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (index[mid].version < from_version) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    int result = 0;
+    if (low < archive->version_count) {
+        // 最后一个版本的结尾之后可能有写入失败留下的未索引字节，不输出
+        size_t start = index[low].offset;
+        size_t end = index[archive->version_count - 1].offset + index[archive->version_count - 1].length;
+
+        const char *data = mmap(NULL, end, PROT_READ, MAP_SHARED, archive->data_fd, 0);
+        if (data == MAP_FAILED) {
+            result = -1;
+        } else {
+            result = write_all(fd, data + start, end - start);
+            munmap((void *)data, end);
+        }
+    }
+
+    munmap((void *)index, index_length);
+    return result;
+}
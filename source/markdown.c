@@ -1,8 +1,46 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 #include "../libs/markdown.h"
 #include "../libs/document.h"
+#include "../libs/scan.h"
+
+// 块合并：每个版本最多检查的块数量，以及合并后块的目标大小
+#define COALESCE_CHUNK_BUDGET 512
+#define COALESCE_TARGET_SIZE 256
+
+// 加载整篇文档时每个块的最大长度：分割块时重新统计换行符和计算哈希的开销以此为上限
+#define LOAD_PIECE_SIZE (64 * 1024)
+
+// 检查点头部 "CHECKPOINT <version> <length>\n" 的最大长度
+#define CHECKPOINT_HEADER_MAX 64
+
+// 单次 writev 最多提交的 iovec 数量
+#ifdef IOV_MAX
+#define WRITEV_BATCH IOV_MAX
+#else
+#define WRITEV_BATCH 1024
+#endif
+
+static void discard_staged_edits(document *doc);
+static doc_snapshot *build_snapshot(const document *doc);
+static void publish_snapshot(document *doc, doc_snapshot *snapshot);
+
+/**
+ * 替换文档的 rope 根，并使定位缓存失效
+ * @param doc 文档指针
+ * @param root 新的根
+ */
+static void set_root(document *doc, chunk *root) {
+    doc->root = root;
+    doc->finger.depth = 0;
+}
 
 /**
  * 初始化文档
@@ -13,11 +51,74 @@ void markdown_init(document *doc) {
         return;
     }
 
-    doc->head = NULL;
+    set_root(doc, NULL);
     doc->total_length = 0;
     doc->version = 0;
     doc->pending_edits = NULL;
     doc->edit_history = NULL;
+    doc->pending_tail = NULL;
+    doc->history_tail = NULL;
+    doc->pending_count = 0;
+    doc->history_segments = NULL;
+    doc->history_segment_count = 0;
+    doc->history_segment_capacity = 0;
+    doc->history_limit = 0;
+    doc->archive = NULL;
+    doc->storage = STORAGE_CHUNKED;
+    doc->add_buffer = NULL;
+    doc->compact_cursor = 0;
+    doc->chunks_coalesced = 0;
+    doc->snapshot = NULL;
+    doc->reader_epoch = 0;
+    doc->active_readers[0] = 0;
+    doc->active_readers[1] = 0;
+    doc->staged_inserts = NULL;
+    doc->staged_insert_count = 0;
+    doc->staged_insert_capacity = 0;
+    doc->staged_run_count = 0;
+    doc->staged_scratch = NULL;
+    doc->staged_scratch_capacity = 0;
+    doc->deleted_ranges = NULL;
+    doc->deleted_range_count = 0;
+    doc->deleted_range_capacity = 0;
+    memset(&doc->previous, 0, sizeof(doc->previous));
+
+    // 发布空文档的初始版本，读者从一开始就能取得快照
+    publish_snapshot(doc, build_snapshot(doc));
+}
+
+/**
+ * 设置文档的文本存储模式，只影响之后插入的内容
+ * @param doc 文档指针
+ * @param mode 存储模式
+ */
+void markdown_set_storage_mode(document *doc, storage_mode mode) {
+    if (!doc) {
+        return;
+    }
+
+    if (mode != STORAGE_PIECE_TABLE) {
+        release_text_block(doc->add_buffer);
+        doc->add_buffer = NULL;
+    }
+
+    doc->storage = mode;
+}
+
+/**
+ * 限制内存中保留的编辑历史，超出的最旧版本在提交时写入归档（或直接丢弃）
+ * @param doc 文档指针
+ * @param versions 保留的最近版本数，0 表示不限制
+ * @param archive 旧版本写入的归档，NULL 时直接丢弃；由调用者打开和关闭
+ */
+void markdown_set_history_limit(document *doc, size_t versions, struct history_archive *archive) {
+    if (!doc) {
+        return;
+    }
+
+    doc->history_limit = versions;
+    doc->archive = archive;
+    trim_edit_history(doc);
 }
 
 /**
@@ -29,15 +130,18 @@ void markdown_free(document *doc) {
         return;
     }
 
-    // 释放文档块链表
-    chunk *current = doc->head;
-    chunk *next;
+    // 释放暂存的编辑
+    discard_staged_edits(doc);
+    free(doc->staged_inserts);
+    free(doc->staged_scratch);
+    free(doc->deleted_ranges);
+    free(doc->previous.inserts);
+    free(doc->previous.deletes);
 
-    while (current) {
-        next = current->next;
-        free_chunk(current);
-        current = next;
-    }
+    // 释放文档 rope、追加缓冲区和已发布的快照（仍被读者持有的快照由读者释放）
+    rope_free(doc->root);
+    release_text_block(doc->add_buffer);
+    markdown_release_snapshot(doc->snapshot);
 
     // 释放待处理的编辑命令
     edit_command *cmd = doc->pending_edits;
@@ -59,43 +163,82 @@ void markdown_free(document *doc) {
     }
 
     // 重置文档状态
-    doc->head = NULL;
+    set_root(doc, NULL);
+    doc->add_buffer = NULL;
+    doc->snapshot = NULL;
+    doc->compact_cursor = 0;
     doc->total_length = 0;
     doc->pending_edits = NULL;
     doc->edit_history = NULL;
+    doc->pending_tail = NULL;
+    doc->history_tail = NULL;
+    doc->pending_count = 0;
+    free(doc->history_segments);
+    doc->history_segments = NULL;
+    doc->history_segment_count = 0;
+    doc->history_segment_capacity = 0;
+    doc->history_limit = 0;
+    doc->archive = NULL;
+    doc->staged_inserts = NULL;
+    doc->staged_insert_capacity = 0;
+    doc->staged_scratch = NULL;
+    doc->staged_scratch_capacity = 0;
+    doc->deleted_ranges = NULL;
+    doc->deleted_range_capacity = 0;
+    memset(&doc->previous, 0, sizeof(doc->previous));
+
+    // 没有文档在用时归还对象池内存
+    trim_document_pools();
+}
+
+/**
+ * 获取命令针对的版本的文档长度
+ * @param doc 文档指针
+ * @param version 版本号（当前版本或上一版本）
+ * @return 该版本的文档长度
+ */
+static size_t version_length(const document *doc, uint64_t version) {
+    return version == doc->version ? doc->total_length : doc->previous.length;
 }
 
 /**
  * 检查位置是否有效
  * @param doc 文档指针
+ * @param version 命令针对的版本
  * @param pos 位置
  * @return 1 如果有效，0 如果无效
  */
-static int is_valid_position(const document *doc, size_t pos) {
-    return pos <= doc->total_length;
+static int is_valid_position(const document *doc, uint64_t version, size_t pos) {
+    return pos <= version_length(doc, version);
 }
 
 /**
  * 检查位置范围是否有效
  * @param doc 文档指针
+ * @param version 命令针对的版本
  * @param start 起始位置
  * @param end 结束位置
  * @return 1 如果有效，0 如果无效
  */
-static int is_valid_range(const document *doc, size_t start, size_t end) {
-    // 允许 start 等于 doc->total_length（空选择在文档末尾）
+static int is_valid_range(const document *doc, uint64_t version, size_t start, size_t end) {
+    // 允许 start 等于文档长度（空选择在文档末尾）
     // 但通常 start 应该小于 end，且 end 不能超过文档长度
-    return start < end && start <= doc->total_length && end <= doc->total_length;
+    size_t length = version_length(doc, version);
+    return start < end && start <= length && end <= length;
 }
 
 /**
- * 检查版本是否有效
+ * 检查版本是否有效：接受当前版本，以及记录了位置变换的上一版本
  * @param doc 文档指针
  * @param version 版本号
  * @return 1 如果有效，0 如果无效
  */
 static int is_valid_version(const document *doc, uint64_t version) {
-    return version == doc->version;
+    if (version == doc->version) {
+        return 1;
+    }
+
+    return doc->previous.valid && doc->version > 0 && version == doc->version - 1;
 }
 
 /**
@@ -106,582 +249,1009 @@ static int is_valid_version(const document *doc, uint64_t version) {
  * @param offset 返回在块中的偏移量
  * @return 1 如果找到，0 如果未找到
  */
-static int find_position(const document *doc, size_t pos, chunk **chunk_pos, size_t *offset) {
+static int find_position(document *doc, size_t pos, chunk **chunk_pos, size_t *offset) {
     if (!doc || !chunk_pos || !offset || pos > doc->total_length) {
         return 0;
     }
 
-    chunk *current = doc->head;
-    size_t current_pos = 0;
+    // 同一轮命令通常集中在相近位置，借助定位缓存从上次的路径继续查找
+    chunk *found = rope_finger_find(&doc->finger, doc->root, pos, offset);
+    if (!found) {
+        return 0;
+    }
+
+    *chunk_pos = found;
+    return 1;
+}
 
-    while (current) {
-        if (current_pos + current->length > pos) {
-            *chunk_pos = current;
-            *offset = pos - current_pos;
-            return 1;
-        }
+/**
+ * 读取指定位置的字符
+ * @param doc 文档指针
+ * @param pos 位置
+ * @return 字符，位置超出范围时返回 -1
+ */
+static int char_at(document *doc, size_t pos) {
+    chunk *c;
+    size_t offset;
 
-        current_pos += current->length;
-        current = current->next;
+    if (pos >= doc->total_length || !find_position(doc, pos, &c, &offset)) {
+        return -1;
     }
 
-    // 如果位置正好是文档末尾
-    if (pos == doc->total_length && doc->head) {
-        chunk *last = doc->head;
-        while (last->next) {
-            last = last->next;
+    return (unsigned char)c->content[offset];
+}
+
+/**
+ * 为新插入的内容创建块
+ * 片段表模式下内容追加到共享缓冲区，块只记录片段位置
+ * @param doc 文档指针
+ * @param content 内容
+ * @param content_len 内容长度
+ * @return 新创建的块，内存分配失败返回 NULL
+ */
+static chunk *create_text_chunk(document *doc, const char *content, size_t content_len) {
+    if (doc->storage != STORAGE_PIECE_TABLE) {
+        return create_chunk(content, content_len);
+    }
+
+    text_block *buffer = doc->add_buffer;
+    if (!buffer || buffer->capacity - buffer->used < content_len) {
+        // 当前缓冲区已满，换一个新的；旧缓冲区由引用它的块继续持有
+        size_t capacity = content_len > ADD_BUFFER_CAPACITY ? content_len : ADD_BUFFER_CAPACITY;
+        buffer = create_text_block(capacity);
+        if (!buffer) {
+            return NULL;
         }
-        *chunk_pos = last;
-        *offset = last->length;
-        return 1;
+        release_text_block(doc->add_buffer);
+        doc->add_buffer = buffer;
     }
 
-    return 0;
+    char *dest = buffer->data + buffer->used;
+    memcpy(dest, content, content_len);
+    buffer->used += content_len;
+
+    return create_piece(buffer, dest, content_len);
 }
 
 /**
- * 直接在指定位置插入内容，不创建编辑命令
+ * 在 rope 中拼接插入内容，不创建编辑命令，也不维护列表编号
  * @param doc 文档指针
  * @param pos 插入位置
  * @param content 要插入的内容
  * @param content_len 内容长度
  * @return 成功返回 SUCCESS，否则返回错误码
  */
-static int direct_insert(document *doc, size_t pos, const char *content, size_t content_len) {
-    if (!doc || !content || content_len == 0) {
+static int splice_insert(document *doc, size_t pos, const char *content, size_t content_len) {
+    if (!doc || !content || content_len == 0 || pos > doc->total_length) {
         return INVALID_CURSOR_POS;
     }
 
-    // 如果文档为空，直接创建一个新块
-    if (!doc->head) {
-        doc->head = create_chunk(content, content_len);
-        if (!doc->head) {
-            return INVALID_CURSOR_POS;
-        }
-        doc->total_length = content_len;
+    // 在插入位置分割 rope，再把新块拼接到两部分之间
+    chunk *left, *right;
+    if (rope_split(doc->root, pos, &left, &right) != 0) {
+        return INVALID_CURSOR_POS; // 内存分配失败
+    }
+
+    // 连续输入时新内容紧跟在前一个片段之后，直接延长该片段
+    if (doc->storage == STORAGE_PIECE_TABLE &&
+        rope_extend_last(left, doc->add_buffer, content, content_len)) {
+        set_root(doc, rope_merge(left, right));
+        doc->total_length += content_len;
         return SUCCESS;
     }
 
-    // 查找插入位置
-    chunk *target_chunk;
-    size_t offset;
+    chunk *new_chunk = create_text_chunk(doc, content, content_len);
+    if (!new_chunk) {
+        set_root(doc, rope_merge(left, right));
+        return INVALID_CURSOR_POS; // 内存分配失败
+    }
 
-    if (!find_position(doc, pos, &target_chunk, &offset)) {
-        return INVALID_CURSOR_POS;
+    set_root(doc, rope_merge(rope_merge(left, new_chunk), right));
+    doc->total_length += content_len;
+    return SUCCESS;
+}
+
+/**
+ * 从 rope 中删除 [pos, pos + len) 区间，不创建编辑命令，也不维护列表编号
+ * @param doc 文档指针
+ * @param pos 删除起始位置
+ * @param len 删除长度
+ * @return 成功返回 SUCCESS，否则返回错误码
+ */
+static int splice_delete(document *doc, size_t pos, size_t len) {
+    // 分割出 [pos, pos + len) 区间并整体释放
+    chunk *left, *middle, *right;
+    if (rope_split(doc->root, pos, &left, &right) != 0) {
+        return INVALID_CURSOR_POS; // 内存分配失败
+    }
+    if (rope_split(right, len, &middle, &right) != 0) {
+        set_root(doc, rope_merge(left, right));
+        return INVALID_CURSOR_POS; // 内存分配失败
     }
 
-    // 在块中间插入
-    if (offset > 0 && offset < target_chunk->length) {
-        // 分割当前块
-        chunk *new_chunk1 = create_chunk(target_chunk->content, offset);
-        chunk *new_chunk2 = create_chunk(content, content_len);
-        chunk *new_chunk3 = create_chunk(target_chunk->content + offset, target_chunk->length - offset);
+    rope_free(middle);
+    set_root(doc, rope_merge(left, right));
+    doc->total_length -= len;
+    return SUCCESS;
+}
 
-        if (!new_chunk1 || !new_chunk2 || !new_chunk3) {
-            free_chunk(new_chunk1);
-            free_chunk(new_chunk2);
-            free_chunk(new_chunk3);
-            return INVALID_CURSOR_POS;
-        }
+/**
+ * 有序列表的一段连续列表项
+ */
+typedef struct {
+    size_t start_line;  // 第一项所在行
+    size_t count;       // 列表项数量
+} list_run;
 
-        new_chunk2->next = new_chunk3;
-        new_chunk1->next = new_chunk2;
+/**
+ * 检查某一行是否为有序列表项（以 "d. " 开头）
+ * @param doc 文档指针
+ * @param line 行号
+ * @return 1 如果是，0 如果不是
+ */
+static int is_list_item(document *doc, size_t line) {
+    size_t start = rope_line_start(doc->root, line);
+    char head[3];
 
-        // 替换原块
-        if (doc->head == target_chunk) {
-            doc->head = new_chunk1;
-        } else {
-            chunk *prev = doc->head;
-            while (prev->next != target_chunk) {
-                prev = prev->next;
-            }
-            prev->next = new_chunk1;
-        }
+    // 行首三个字节一次读出，不逐字节定位
+    return rope_copy(doc->root, start, sizeof(head), head) == sizeof(head) &&
+           head[0] >= '1' && head[0] <= '9' && head[1] == '.' && head[2] == ' ';
+}
 
-        free_chunk(target_chunk);
-    }
-    // 在块开头插入
-    else if (offset == 0) {
-        chunk *new_chunk = create_chunk(content, content_len);
-        if (!new_chunk) {
-            return INVALID_CURSOR_POS;
-        }
+/**
+ * 从指定行开始，把一段连续列表项依次编号为 1、2、3...（限制为 1-9）
+ * 只改写编号不同的数字
+ * @param doc 文档指针
+ * @param start_line 列表第一项所在行
+ * @return 列表段信息
+ */
+static list_run renumber_run(document *doc, size_t start_line) {
+    list_run run = { start_line, 0 };
+    size_t lines = rope_newline_count(doc->root) + 1;
 
-        new_chunk->next = target_chunk;
+    while (run.start_line + run.count < lines && is_list_item(doc, run.start_line + run.count)) {
+        size_t pos = rope_line_start(doc->root, run.start_line + run.count);
+        char digit = (char)('1' + run.count % 9);
 
-        if (doc->head == target_chunk) {
-            doc->head = new_chunk;
-        } else {
-            chunk *prev = doc->head;
-            while (prev->next != target_chunk) {
-                prev = prev->next;
-            }
-            prev->next = new_chunk;
-        }
-    }
-    // 在块末尾插入 (offset == target_chunk->length)
-    else {
-        chunk *new_chunk = create_chunk(content, content_len);
-        if (!new_chunk) {
-            return INVALID_CURSOR_POS;
+        if (char_at(doc, pos) != digit &&
+            splice_delete(doc, pos, 1) == SUCCESS) {
+            splice_insert(doc, pos, &digit, 1);
         }
-
-        new_chunk->next = target_chunk->next;
-        target_chunk->next = new_chunk;
+        run.count++;
     }
 
-    doc->total_length += content_len;
-    return SUCCESS;
+    return run;
 }
 
 /**
- * 在文档中插入内容
+ * 重新编号受 [first_line, last_line] 行改动影响的有序列表
+ * 改动可能拆分或合并其后的列表，因此也检查 last_line 的下一行；
+ * 只沿受影响的列表逐行移动，不扫描整个文档
  * @param doc 文档指针
- * @param version 版本号
- * @param pos 插入位置
- * @param content 要插入的内容
- * @param username 用户名
- * @param original_cmd 原始命令字符串
- * @return 成功返回 SUCCESS，否则返回错误码
+ * @param first_line 第一条受影响的行
+ * @param last_line 最后一条受影响的行
  */
-int markdown_insert(document *doc, uint64_t version, size_t pos, const char *content, const char *username, const char *original_cmd) {
-    if (!doc || !content) {
-        return INVALID_CURSOR_POS;
-    }
+static void renumber_lines(document *doc, size_t first_line, size_t last_line) {
+    size_t lines = rope_newline_count(doc->root) + 1;
+    size_t line = first_line;
 
-    // 检查版本和位置是否有效
-    if (!is_valid_version(doc, version)) {
-        return OUTDATED_VERSION;
+    if (last_line + 1 < lines) {
+        last_line++;
     }
 
-    if (!is_valid_position(doc, pos)) {
-        return INVALID_CURSOR_POS;
+    // 若首行属于某段列表，回溯到该段的起始行
+    if (is_list_item(doc, line)) {
+        while (line > 0 && is_list_item(doc, line - 1)) {
+            line--;
+        }
     }
 
-    size_t content_len = strlen(content);
-    if (content_len == 0) {
-        return SUCCESS; // 空内容，无需插入
+    // 复制各行行首（含前一个换行符）后用列表标记内核直接跳到下一个列表项；
+    // 改写编号不改变长度，复制出的位置在重新编号后仍然有效
+    size_t start = rope_line_start(doc->root, line);
+    size_t end = rope_line_start(doc->root, last_line) + 3;
+    if (end > doc->total_length) {
+        end = doc->total_length;
     }
 
-    // 创建编辑命令并添加到待处理列表
-    edit_command *cmd = create_command(CMD_INSERT, version, pos, 0, content, 0, username, original_cmd);
-    if (!cmd) {
-        return INVALID_CURSOR_POS; // 内存分配失败
+    size_t length = end - start + 1;
+    char *text = (char *)malloc(length);
+    if (!text) {
+        while (line <= last_line && line < lines) {
+            if (is_list_item(doc, line)) {
+                list_run run = renumber_run(doc, line);
+                line += run.count;
+            } else {
+                line++;
+            }
+        }
+        return;
     }
 
-    add_pending_edit(doc, cmd);
+    // text[0] 是 start 前的换行符（首行时为虚拟换行符），text[k] 对应位置 start + k - 1
+    text[0] = '\n';
+    rope_copy(doc->root, start, length - 1, text + 1);
 
-    // 如果文档为空，直接创建一个新块
-    if (!doc->head) {
-        doc->head = create_chunk(content, content_len);
-        if (!doc->head) {
-            return INVALID_CURSOR_POS; // 内存分配失败
+    size_t offset = 0;
+    while (offset < length) {
+        offset += scan_find_list_marker(text + offset, length - offset);
+        if (offset == length) {
+            break;
         }
-        doc->total_length = content_len;
-        return SUCCESS;
-    }
 
-    // 查找插入位置
-    chunk *target_chunk;
-    size_t offset;
+        line = rope_newlines_before(doc->root, start + offset);
+        if (line > last_line) {
+            break;
+        }
 
-    if (!find_position(doc, pos, &target_chunk, &offset)) {
-        return INVALID_CURSOR_POS;
+        list_run run = renumber_run(doc, line);
+        offset = rope_line_start(doc->root, line + run.count) - start;
     }
 
-    // 在块中间插入
-    if (offset > 0 && offset < target_chunk->length) {
-        // 分割当前块
-        chunk *new_chunk1 = create_chunk(target_chunk->content, offset);
-        chunk *new_chunk2 = create_chunk(content, content_len);
-        chunk *new_chunk3 = create_chunk(target_chunk->content + offset, target_chunk->length - offset);
+    free(text);
+}
 
-        if (!new_chunk1 || !new_chunk2 || !new_chunk3) {
-            free_chunk(new_chunk1);
-            free_chunk(new_chunk2);
-            free_chunk(new_chunk3);
-            return INVALID_CURSOR_POS; // 内存分配失败
-        }
+/**
+ * 按需扩容数组（容量翻倍）
+ * @param array 数组指针的地址
+ * @param capacity 当前容量的地址
+ * @param count 已使用的元素数量
+ * @param size 元素大小
+ * @return 成功返回 1，内存分配失败返回 0
+ */
+static int reserve_array(void **array, size_t *capacity, size_t count, size_t size) {
+    if (count < *capacity) {
+        return 1;
+    }
 
-        // 更新链表
-        new_chunk2->next = new_chunk3;
-        new_chunk1->next = new_chunk2;
+    size_t new_capacity = *capacity ? *capacity * 2 : 8;
+    void *grown = realloc(*array, new_capacity * size);
+    if (!grown) {
+        return 0;
+    }
+
+    *array = grown;
+    *capacity = new_capacity;
+    return 1;
+}
 
-        // 替换原块
-        if (doc->head == target_chunk) {
-            doc->head = new_chunk1;
+/**
+ * 归并两段按位置有序的暂存插入
+ * @param left 左段
+ * @param left_count 左段长度
+ * @param right 右段
+ * @param right_count 右段长度
+ * @param out 输出数组
+ * @param right_first 位置相同时是否右段在前
+ */
+static void merge_staged(const staged_insert *left, size_t left_count,
+                         const staged_insert *right, size_t right_count,
+                         staged_insert *out, int right_first) {
+    size_t i = 0;
+    size_t j = 0;
+
+    while (i < left_count && j < right_count) {
+        if (right[j].pos < left[i].pos || (right_first && right[j].pos == left[i].pos)) {
+            *out++ = right[j++];
         } else {
-            chunk *prev = doc->head;
-            while (prev->next != target_chunk) {
-                prev = prev->next;
-            }
-            prev->next = new_chunk1;
+            *out++ = left[i++];
         }
+    }
 
-        free_chunk(target_chunk);
+    memcpy(out, left + i, (left_count - i) * sizeof(staged_insert));
+    memcpy(out + (left_count - i), right + j, (right_count - j) * sizeof(staged_insert));
+}
+
+/**
+ * 合并最后两个有序段，位置相同时后暂存的段在前
+ * @param doc 文档指针
+ */
+static void merge_last_runs(document *doc) {
+    size_t right_count = doc->staged_runs[--doc->staged_run_count];
+    size_t left_count = doc->staged_runs[doc->staged_run_count - 1];
+    staged_insert *left = doc->staged_inserts + doc->staged_insert_count - right_count - left_count;
+
+    merge_staged(left, left_count, left + left_count, right_count, doc->staged_scratch, 1);
+    memcpy(left, doc->staged_scratch, (left_count + right_count) * sizeof(staged_insert));
+    doc->staged_runs[doc->staged_run_count - 1] = left_count + right_count;
+}
+
+/**
+ * 把刚追加的一个插入作为新的有序段，按二进制计数器的方式合并等长的段：
+ * 每个插入平均参与 O(log k) 次归并，段数保持在 O(log k)
+ * @param doc 文档指针
+ */
+static void push_staged_run(document *doc) {
+    doc->staged_runs[doc->staged_run_count++] = 1;
+
+    while (doc->staged_run_count > 1 &&
+           doc->staged_runs[doc->staged_run_count - 2] <= doc->staged_runs[doc->staged_run_count - 1]) {
+        merge_last_runs(doc);
     }
-    // 在块开头插入
-    else if (offset == 0) {
-        chunk *new_chunk = create_chunk(content, content_len);
-        if (!new_chunk) {
-            return INVALID_CURSOR_POS; // 内存分配失败
-        }
+}
 
-        new_chunk->next = target_chunk;
+/**
+ * 把所有有序段合并为一段，提交版本时调用
+ * 同一位置上后暂存的插入排在前面
+ * @param doc 文档指针
+ */
+static void sort_staged_inserts(document *doc) {
+    while (doc->staged_run_count > 1) {
+        merge_last_runs(doc);
+    }
+}
 
-        if (doc->head == target_chunk) {
-            doc->head = new_chunk;
+/**
+ * 在一个有序段中查找第一个位置不小于 pos 的暂存插入
+ * @param run 有序段
+ * @param count 段长度
+ * @param pos 已提交版本中的位置
+ * @return 段内下标
+ */
+static size_t staged_lower_bound(const staged_insert *run, size_t count, size_t pos) {
+    size_t low = 0;
+    size_t high = count;
+
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (run[mid].pos < pos) {
+            low = mid + 1;
         } else {
-            chunk *prev = doc->head;
-            while (prev->next != target_chunk) {
-                prev = prev->next;
-            }
-            prev->next = new_chunk;
+            high = mid;
         }
     }
-    // 在块末尾插入
-    else {
-        chunk *new_chunk = create_chunk(content, content_len);
-        if (!new_chunk) {
-            return INVALID_CURSOR_POS; // 内存分配失败
+
+    return low;
+}
+
+/**
+ * 查找删除了已提交版本中 pos 处字符的区间
+ * @param doc 文档指针
+ * @param pos 字符位置
+ * @return 删除区间，字符未被删除时返回 NULL
+ */
+static const deleted_range *find_deleted(const document *doc, size_t pos) {
+    size_t low = 0;
+    size_t high = doc->deleted_range_count;
+
+    // 找到最后一个起点不大于 pos 的区间
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (doc->deleted_ranges[mid].start <= pos) {
+            low = mid + 1;
+        } else {
+            high = mid;
         }
+    }
 
-        new_chunk->next = target_chunk->next;
-        target_chunk->next = new_chunk;
+    if (low > 0 && pos < doc->deleted_ranges[low - 1].end) {
+        return &doc->deleted_ranges[low - 1];
     }
 
-    doc->total_length += content_len;
-    return SUCCESS;
+    return NULL;
 }
 
 /**
- * 在文档中删除内容
+ * 查找严格包含光标位置的删除区间（光标两侧的字符都已被删除）
  * @param doc 文档指针
- * @param version 版本号
- * @param pos 删除起始位置
- * @param len 删除长度
- * @param username 用户名
- * @param original_cmd 原始命令字符串
- * @return 成功返回 SUCCESS，否则返回错误码
+ * @param pos 光标位置
+ * @return 删除区间，光标不在删除区间内部时返回 NULL
  */
-int markdown_delete(document *doc, uint64_t version, size_t pos, size_t len, const char *username, const char *original_cmd) {
-    if (!doc) {
-        return INVALID_CURSOR_POS;
-    }
+static const deleted_range *deleted_around(const document *doc, size_t pos) {
+    const deleted_range *range = find_deleted(doc, pos);
+    return (range && range->start < pos) ? range : NULL;
+}
 
-    // 检查版本和位置是否有效
-    if (!is_valid_version(doc, version)) {
-        return OUTDATED_VERSION;
-    }
+/**
+ * 按删除区间规则调整单个光标位置：位于删除区间内部时移到删除开始的位置
+ * @param doc 文档指针
+ * @param pos 光标位置
+ * @return 调整后的位置
+ */
+static size_t map_position(const document *doc, size_t pos) {
+    const deleted_range *range = deleted_around(doc, pos);
+    return range ? range->start : pos;
+}
 
-    if (!is_valid_position(doc, pos) || pos + len > doc->total_length) {
-        return INVALID_CURSOR_POS;
+/**
+ * 按删除区间规则调整光标范围
+ * 两端都在同一删除区间内部时报告 DELETED_POSITION；
+ * 只有一端在删除区间内部时，把它移到靠近另一端的区间边缘
+ * @param doc 文档指针
+ * @param start 起始位置的地址
+ * @param end 结束位置的地址
+ * @return 成功返回 SUCCESS，否则返回 DELETED_POSITION
+ */
+static int map_range(const document *doc, size_t *start, size_t *end) {
+    const deleted_range *start_range = deleted_around(doc, *start);
+    const deleted_range *end_range = deleted_around(doc, *end);
+
+    if (start_range && start_range == end_range) {
+        return DELETED_POSITION;
     }
 
-    if (len == 0) {
-        return SUCCESS; // 无需删除
+    if (start_range) {
+        *start = start_range->end;
+    }
+    if (end_range) {
+        *end = end_range->start;
     }
 
-    // 创建编辑命令并添加到待处理列表
-    edit_command *cmd = create_command(CMD_DELETE, version, pos, pos + len, NULL, 0, username, original_cmd);
-    if (!cmd) {
-        return INVALID_CURSOR_POS; // 内存分配失败
+    return SUCCESS;
+}
+
+/**
+ * 查找上次提交中严格包含光标位置的删除区间
+ * @param doc 文档指针
+ * @param pos 上一版本中的光标位置
+ * @return 删除区间，光标不在删除区间内部时返回 NULL
+ */
+static const version_shift *previous_deleted_around(const document *doc, size_t pos) {
+    const version_transform *transform = &doc->previous;
+    size_t low = 0;
+    size_t high = transform->delete_count;
+
+    // 找到最后一个起点小于 pos 的区间
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (transform->deletes[mid].start < pos) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
     }
 
-    add_pending_edit(doc, cmd);
+    if (low > 0 && pos < transform->deletes[low - 1].end) {
+        return &transform->deletes[low - 1];
+    }
 
-    // 查找删除起始位置
-    chunk *start_chunk;
-    size_t start_offset;
+    return NULL;
+}
 
-    if (!find_position(doc, pos, &start_chunk, &start_offset)) {
-        return INVALID_CURSOR_POS;
+/**
+ * 把命令针对的版本中的光标位置变换到当前已提交的版本
+ * after 为 0 时光标视为插入点或范围终点：位于上次删除区间内部时移到区间开始，
+ * 同一位置上次插入的内容留在光标之后（新内容排在前面，与同一版本内的规则一致）；
+ * after 为 1 时光标视为范围起点：移到删除区间结束，同一位置的插入留在光标之前
+ * @param doc 文档指针
+ * @param version 命令针对的版本
+ * @param pos 光标位置
+ * @param after 是否把光标视为范围起点
+ * @return 当前版本中的位置
+ */
+static size_t rebase_position(const document *doc, uint64_t version, size_t pos, int after) {
+    if (version == doc->version) {
+        return pos;
     }
 
-    // 查找删除结束位置
-    chunk *end_chunk;
-    size_t end_offset;
+    const version_transform *transform = &doc->previous;
+    const version_shift *range = previous_deleted_around(doc, pos);
+    if (range) {
+        pos = after ? range->end : range->start;
+    }
 
-    if (!find_position(doc, pos + len, &end_chunk, &end_offset)) {
-        return INVALID_CURSOR_POS;
+    // 减去光标之前被删除的长度
+    size_t low = 0;
+    size_t high = transform->delete_count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (transform->deletes[mid].end <= pos) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
     }
+    size_t deleted = low > 0 ? transform->deletes[low - 1].total : 0;
 
-    // 如果删除范围在同一个块内
-    if (start_chunk == end_chunk) {
-        // 创建新块，排除要删除的部分
-        char *new_content = (char *)malloc(start_chunk->length - len + 1);
-        if (!new_content) {
-            return INVALID_CURSOR_POS; // 内存分配失败
+    // 加上光标之前插入的长度
+    low = 0;
+    high = transform->insert_count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        size_t at = transform->inserts[mid].start;
+        if (at < pos || (after && at == pos)) {
+            low = mid + 1;
+        } else {
+            high = mid;
         }
+    }
+    size_t inserted = low > 0 ? transform->inserts[low - 1].total : 0;
 
-        // 复制前半部分
-        memcpy(new_content, start_chunk->content, start_offset);
+    return pos - deleted + inserted;
+}
 
-        // 复制后半部分
-        memcpy(new_content + start_offset,
-               start_chunk->content + start_offset + len,
-               start_chunk->length - start_offset - len);
+/**
+ * 把命令针对的版本中的光标范围变换到当前已提交的版本
+ * 上次提交的删除区间按 map_range 的规则处理；范围只包含客户端看到的内容，
+ * 不包含上次提交在两端插入的内容
+ * @param doc 文档指针
+ * @param version 命令针对的版本
+ * @param start 起始位置的地址
+ * @param end 结束位置的地址
+ * @return 成功返回 SUCCESS，否则返回 DELETED_POSITION
+ */
+static int rebase_range(const document *doc, uint64_t version, size_t *start, size_t *end) {
+    if (version == doc->version) {
+        return SUCCESS;
+    }
 
-        new_content[start_chunk->length - len] = '\0';
+    const version_shift *start_range = previous_deleted_around(doc, *start);
+    const version_shift *end_range = previous_deleted_around(doc, *end);
 
-        // 更新块内容
-        free(start_chunk->content);
-        start_chunk->content = new_content;
-        start_chunk->length -= len;
+    if (start_range && start_range == end_range) {
+        return DELETED_POSITION;
+    }
 
-        // 如果块变为空，则删除它
-        if (start_chunk->length == 0) {
-            if (doc->head == start_chunk) {
-                doc->head = start_chunk->next;
-            } else {
-                chunk *prev = doc->head;
-                while (prev->next != start_chunk) {
-                    prev = prev->next;
-                }
-                prev->next = start_chunk->next;
-            }
-            free_chunk(start_chunk);
-        }
-    } else {
-        // 删除跨越多个块
-
-        // 处理起始块
-        if (start_offset == 0) {
-            // 整个起始块都要删除
-            if (doc->head == start_chunk) {
-                doc->head = start_chunk->next;
-            } else {
-                chunk *prev = doc->head;
-                while (prev->next != start_chunk) {
-                    prev = prev->next;
-                }
-                prev->next = start_chunk->next;
-            }
-            free_chunk(start_chunk);
-        } else {
-            // 只删除起始块的一部分
-            char *new_content = (char *)malloc(start_offset + 1);
-            if (!new_content) {
-                return INVALID_CURSOR_POS; // 内存分配失败
-            }
+    *start = rebase_position(doc, version, *start, 1);
+    *end = rebase_position(doc, version, *end, 0);
+    return SUCCESS;
+}
 
-            memcpy(new_content, start_chunk->content, start_offset);
-            new_content[start_offset] = '\0';
+/**
+ * 把命令中的光标位置解析为暂存使用的已提交位置
+ * @param doc 文档指针
+ * @param version 命令针对的版本
+ * @param pos 光标位置
+ * @return 已提交版本中的位置
+ */
+static size_t resolve_position(const document *doc, uint64_t version, size_t pos) {
+    return map_position(doc, rebase_position(doc, version, pos, 0));
+}
 
-            free(start_chunk->content);
-            start_chunk->content = new_content;
-            start_chunk->length = start_offset;
-        }
+/**
+ * 把命令中的光标范围解析为暂存使用的已提交范围
+ * @param doc 文档指针
+ * @param version 命令针对的版本
+ * @param start 起始位置的地址
+ * @param end 结束位置的地址
+ * @return 成功返回 SUCCESS，否则返回 DELETED_POSITION
+ */
+static int resolve_range(const document *doc, uint64_t version, size_t *start, size_t *end) {
+    int result = rebase_range(doc, version, start, end);
+    return result == SUCCESS ? map_range(doc, start, end) : result;
+}
 
-        // 处理中间块（全部删除）
-        chunk *current = start_chunk->next;
-        while (current != end_chunk) {
-            chunk *next = current->next;
+/**
+ * 暂存一次插入，提交版本时才写入文档
+ * 同一位置上后暂存的插入排在先前插入之前
+ * @param doc 文档指针
+ * @param pos 已提交版本中的位置
+ * @param content 要插入的内容
+ * @param content_len 内容长度
+ * @return 成功返回 SUCCESS，否则返回错误码
+ */
+static int stage_insert(document *doc, size_t pos, const char *content, size_t content_len) {
+    if (!reserve_array((void **)&doc->staged_inserts, &doc->staged_insert_capacity,
+                       doc->staged_insert_count, sizeof(staged_insert)) ||
+        !reserve_array((void **)&doc->staged_scratch, &doc->staged_scratch_capacity,
+                       doc->staged_insert_count, sizeof(staged_insert))) {
+        return INVALID_CURSOR_POS; // 内存分配失败
+    }
 
-            if (doc->head == current) {
-                doc->head = next;
-            } else {
-                chunk *prev = doc->head;
-                while (prev->next != current) {
-                    prev = prev->next;
-                }
-                prev->next = next;
-            }
+    chunk *piece = create_text_chunk(doc, content, content_len);
+    if (!piece) {
+        return INVALID_CURSOR_POS; // 内存分配失败
+    }
 
-            free_chunk(current);
-            current = next;
-        }
+    // 按暂存顺序追加为新的有序段，与之前的段按长度合并；提交时再合并为一段
+    doc->staged_inserts[doc->staged_insert_count].pos = pos;
+    doc->staged_inserts[doc->staged_insert_count].piece = piece;
+    doc->staged_insert_count++;
+    push_staged_run(doc);
+    return SUCCESS;
+}
 
-        // 处理结束块
-        if (end_offset == 0) {
-            // 不需要删除结束块
-        } else if (end_offset == end_chunk->length) {
-            // 整个结束块都要删除
-            if (doc->head == end_chunk) {
-                doc->head = end_chunk->next;
-            } else {
-                chunk *prev = doc->head;
-                while (prev->next != end_chunk) {
-                    prev = prev->next;
-                }
-                prev->next = end_chunk->next;
-            }
-            free_chunk(end_chunk);
-        } else {
-            // 只删除结束块的一部分
-            char *new_content = (char *)malloc(end_chunk->length - end_offset + 1);
-            if (!new_content) {
-                return INVALID_CURSOR_POS; // 内存分配失败
-            }
+/**
+ * 暂存一次删除，与相邻或重叠的删除区间合并
+ * 只删除已提交版本中的内容，本版本暂存的插入不受影响
+ * @param doc 文档指针
+ * @param start 起始位置
+ * @param end 结束位置（不含）
+ * @return 成功返回 SUCCESS，否则返回错误码
+ */
+static int stage_delete(document *doc, size_t start, size_t end) {
+    if (!reserve_array((void **)&doc->deleted_ranges, &doc->deleted_range_capacity,
+                       doc->deleted_range_count, sizeof(deleted_range))) {
+        return INVALID_CURSOR_POS; // 内存分配失败
+    }
 
-            memcpy(new_content, end_chunk->content + end_offset, end_chunk->length - end_offset);
-            new_content[end_chunk->length - end_offset] = '\0';
+    deleted_range *ranges = doc->deleted_ranges;
+    size_t count = doc->deleted_range_count;
 
-            free(end_chunk->content);
-            end_chunk->content = new_content;
-            end_chunk->length = end_chunk->length - end_offset;
+    // [first, last) 为与新区间重叠或相邻的区间
+    size_t first = 0;
+    while (first < count && ranges[first].end < start) {
+        first++;
+    }
+    size_t last = first;
+    while (last < count && ranges[last].start <= end) {
+        if (ranges[last].start < start) {
+            start = ranges[last].start;
+        }
+        if (ranges[last].end > end) {
+            end = ranges[last].end;
         }
+        last++;
     }
 
-    doc->total_length -= len;
+    // 用合并后的区间替换 [first, last)
+    memmove(&ranges[first + 1], &ranges[last], (count - last) * sizeof(deleted_range));
+    ranges[first].start = start;
+    ranges[first].end = end;
+    doc->deleted_range_count = count - (last - first) + 1;
     return SUCCESS;
 }
 
 /**
- * 在文档中插入换行符
+ * 暂存针对指定版本的删除
+ * 上一版本中的删除范围被上次提交插入的内容分成几段，只删除客户端看到的内容
  * @param doc 文档指针
- * @param version 版本号
- * @param pos 插入位置
- * @param username 用户名
- * @param original_cmd 原始命令字符串
+ * @param version 命令针对的版本
+ * @param start 起始位置
+ * @param end 结束位置（不含）
  * @return 成功返回 SUCCESS，否则返回错误码
  */
-int markdown_newline(document *doc, uint64_t version, size_t pos, const char *username, const char *original_cmd) {
-    if (!doc) {
-        return INVALID_CURSOR_POS;
+static int stage_version_delete(document *doc, uint64_t version, size_t start, size_t end) {
+    if (version == doc->version) {
+        return stage_delete(doc, start, end);
     }
 
-    // 检查版本和位置是否有效
-    if (!is_valid_version(doc, version)) {
-        return OUTDATED_VERSION;
-    }
+    const version_shift *inserts = doc->previous.inserts;
+    size_t count = doc->previous.insert_count;
 
-    if (!is_valid_position(doc, pos)) {
-        return INVALID_CURSOR_POS;
+    // 跳过位于 start 及之前的插入
+    size_t index = 0;
+    while (index < count && inserts[index].start <= start) {
+        index++;
     }
 
-    // 创建编辑命令并添加到待处理列表
-    edit_command *cmd = create_command(CMD_NEWLINE, version, pos, 0, NULL, 0, username, original_cmd);
-    if (!cmd) {
-        return INVALID_CURSOR_POS; // 内存分配失败
+    int result = SUCCESS;
+    size_t from = start;
+    while (result == SUCCESS && from < end) {
+        size_t to = (index < count && inserts[index].start < end) ? inserts[index].start : end;
+        size_t rebased_from = rebase_position(doc, version, from, 1);
+        size_t rebased_to = rebase_position(doc, version, to, 0);
+
+        if (rebased_from < rebased_to) {
+            result = stage_delete(doc, rebased_from, rebased_to);
+        }
+
+        from = to;
+        index++;
     }
 
-    add_pending_edit(doc, cmd);
+    return result;
+}
+
+/**
+ * 丢弃所有暂存的编辑
+ * @param doc 文档指针
+ */
+static void discard_staged_edits(document *doc) {
+    for (size_t i = 0; i < doc->staged_insert_count; i++) {
+        free_chunk(doc->staged_inserts[i].piece);
+    }
 
-    // 执行实际的换行符插入
-    return direct_insert(doc, pos, "\n", 1);
+    doc->staged_insert_count = 0;
+    doc->staged_run_count = 0;
+    doc->deleted_range_count = 0;
 }
 
 /**
- * 在文档中添加标题格式
+ * 获取暂存视图中插入点之前的最后一个字符
+ * 新插入排在同一位置已有插入之前，因此只需考虑更靠前的内容；
+ * 删除区间内暂存的插入仍然可见
  * @param doc 文档指针
- * @param version 版本号
- * @param level 标题级别（1-3）
- * @param pos 插入位置
- * @param username 用户名
- * @param original_cmd 原始命令字符串
- * @return 成功返回 SUCCESS，否则返回错误码
+ * @param pos 已提交版本中的插入位置（已调整）
+ * @return 字符，插入点之前没有内容时返回 -1
  */
-int markdown_heading(document *doc, uint64_t version, int level, size_t pos, const char *username, const char *original_cmd) {
-    if (!doc) {
-        return INVALID_CURSOR_POS;
+static int staged_char_before(document *doc, size_t pos) {
+    if (pos == 0) {
+        return -1;
+    }
+
+    // prev 之前的已提交字符是插入点前最后一个未被删除的字符
+    const deleted_range *range = find_deleted(doc, pos - 1);
+    size_t prev = range ? range->start : pos;
+
+    // 各有序段中位置小于 pos 的最后一个插入里取位置最大的；位置相同时先暂存的更靠后，取更早的段
+    const staged_insert *before = NULL;
+    const staged_insert *run = doc->staged_inserts;
+    for (size_t i = 0; i < doc->staged_run_count; run += doc->staged_runs[i++]) {
+        size_t index = staged_lower_bound(run, doc->staged_runs[i], pos);
+        if (index > 0 && (!before || run[index - 1].pos > before->pos)) {
+            before = &run[index - 1];
+        }
     }
 
-    // 检查版本和位置是否有效
-    if (!is_valid_version(doc, version)) {
-        return OUTDATED_VERSION;
+    if (before && before->pos >= prev) {
+        return (unsigned char)before->piece->content[before->piece->length - 1];
     }
 
-    if (!is_valid_position(doc, pos)) {
-        return INVALID_CURSOR_POS;
+    return prev > 0 ? char_at(doc, prev - 1) : -1;
+}
+
+/**
+ * 获取暂存视图中插入点之后的第一个字符
+ * @param doc 文档指针
+ * @param pos 已提交版本中的插入位置（已调整）
+ * @return 字符，插入点之后没有内容时返回 -1
+ */
+static int staged_char_after(document *doc, size_t pos) {
+    // next 处的已提交字符是插入点后第一个未被删除的字符
+    const deleted_range *range = find_deleted(doc, pos);
+    size_t next = range ? range->end : pos;
+
+    // 各有序段中第一个位置不小于 pos 的插入里取位置最小的；位置相同时后暂存的在前，取更晚的段
+    const staged_insert *after = NULL;
+    const staged_insert *run = doc->staged_inserts;
+    for (size_t i = 0; i < doc->staged_run_count; run += doc->staged_runs[i++]) {
+        size_t index = staged_lower_bound(run, doc->staged_runs[i], pos);
+        if (index < doc->staged_runs[i] && (!after || run[index].pos <= after->pos)) {
+            after = &run[index];
+        }
     }
 
-    // 检查标题级别是否有效
-    if (level < 1 || level > 3) {
-        return INVALID_CURSOR_POS;
+    if (after && after->pos <= next) {
+        return (unsigned char)after->piece->content[0];
     }
 
-    // 确保在行首插入标题
-    char *prefix = NULL;
+    return char_at(doc, next);
+}
+
+/**
+ * 暂存块级元素的前缀：插入点不在行首时先补一个换行符
+ * @param doc 文档指针
+ * @param pos 插入位置（已调整）
+ * @param prefix 块级元素前缀
+ * @return 成功返回 SUCCESS，否则返回错误码
+ */
+static int stage_block_prefix(document *doc, size_t pos, const char *prefix) {
+    char text[16];
+    int prev = staged_char_before(doc, pos);
 
-    // 如果不在文档开头，检查前一个字符是否为换行符
-    if (pos > 0) {
-        chunk *prev_chunk;
-        size_t prev_offset;
+    snprintf(text, sizeof(text), "%s%s", (prev == -1 || prev == '\n') ? "" : "\n", prefix);
+    return stage_insert(doc, pos, text, strlen(text));
+}
 
-        if (find_position(doc, pos - 1, &prev_chunk, &prev_offset)) {
-            if (prev_chunk->content[prev_offset] != '\n') {
-                // 需要先插入换行符
-                int result = markdown_insert(doc, version, pos, "\n", username, original_cmd);
-                if (result != SUCCESS) {
-                    return result;
-                }
-                pos++; // 调整插入位置
+/**
+ * 已提交文档中被本次提交改动的区间，用于提交后重新编号有序列表
+ */
+typedef struct {
+    size_t pos;
+    size_t length;
+} touched_range;
+
+/**
+ * 一次提交的拼接状态：从旧 rope 中按顺序取出保留的内容，与暂存的插入拼接成新 rope
+ */
+typedef struct {
+    chunk *rest;            // 旧 rope 中尚未处理的部分
+    size_t consumed;        // rest 在旧版本中的起始位置
+    chunk *out;             // 已拼接完成的新 rope
+    size_t out_length;
+    size_t next_range;      // 下一个待处理的删除区间
+    touched_range *touched;
+    size_t touched_count;
+} commit_state;
+
+/**
+ * 把旧版本中 [consumed, upto) 的内容移入新 rope，跳过被删除的部分
+ * @param doc 文档指针
+ * @param state 拼接状态
+ * @param upto 旧版本中的结束位置
+ * @return 成功返回 SUCCESS，内存分配失败返回 INVALID_CURSOR_POS
+ */
+static int commit_base(document *doc, commit_state *state, size_t upto) {
+    while (state->consumed < upto) {
+        const deleted_range *range = NULL;
+
+        while (state->next_range < doc->deleted_range_count &&
+               doc->deleted_ranges[state->next_range].end <= state->consumed) {
+            state->next_range++;
+        }
+        if (state->next_range < doc->deleted_range_count &&
+            doc->deleted_ranges[state->next_range].start < upto) {
+            range = &doc->deleted_ranges[state->next_range];
+        }
+
+        // 保留删除区间之前的内容
+        size_t keep_end = range ? (range->start > state->consumed ? range->start : state->consumed) : upto;
+        if (keep_end > state->consumed) {
+            chunk *kept;
+            if (rope_split(state->rest, keep_end - state->consumed, &kept, &state->rest) != 0) {
+                return INVALID_CURSOR_POS;
+            }
+            state->out = rope_merge(state->out, kept);
+            state->out_length += keep_end - state->consumed;
+            state->consumed = keep_end;
+        }
+
+        // 释放删除区间内的内容（区间可能被其中的暂存插入分成几段）
+        if (range && state->consumed < upto) {
+            size_t drop_end = range->end < upto ? range->end : upto;
+            chunk *dropped;
+            if (rope_split(state->rest, drop_end - state->consumed, &dropped, &state->rest) != 0) {
+                return INVALID_CURSOR_POS;
             }
+            rope_free(dropped);
+            state->touched[state->touched_count].pos = state->out_length;
+            state->touched[state->touched_count].length = 0;
+            state->touched_count++;
+            state->consumed = drop_end;
         }
     }
 
-    // 根据级别生成标题前缀
-    switch (level) {
-        case 1:
-            prefix = "# ";
-            break;
-        case 2:
-            prefix = "## ";
-            break;
-        case 3:
-            prefix = "### ";
-            break;
+    return SUCCESS;
+}
+
+/**
+ * 确保位置变化数组能容纳 count 项
+ * @param array 数组指针的地址
+ * @param capacity 容量的地址
+ * @param count 需要的项数
+ * @return 成功返回 1，内存分配失败返回 0
+ */
+static int reserve_shifts(version_shift **array, size_t *capacity, size_t count) {
+    if (count <= *capacity) {
+        return 1;
+    }
+
+    version_shift *grown = (version_shift *)realloc(*array, count * sizeof(version_shift));
+    if (!grown) {
+        return 0;
     }
 
-    // 插入标题前缀
-    return markdown_insert(doc, version, pos, prefix, username, original_cmd);
+    *array = grown;
+    *capacity = count;
+    return 1;
 }
 
 /**
- * 在文档中添加粗体格式
+ * 记录即将提交的位置变化，作为新版本的上一版本变换
+ * 必须在暂存的编辑应用并清空之前调用
  * @param doc 文档指针
- * @param version 版本号
- * @param start 起始位置
- * @param end 结束位置
- * @param username 用户名
- * @param original_cmd 原始命令字符串
- * @return 成功返回 SUCCESS，否则返回错误码
  */
-int markdown_bold(document *doc, uint64_t version, size_t start, size_t end, const char *username, const char *original_cmd) {
-    if (!doc) {
-        return INVALID_CURSOR_POS;
+static void record_version_transform(document *doc) {
+    version_transform *transform = &doc->previous;
+
+    transform->valid = 0;
+    transform->length = doc->total_length;
+    transform->insert_count = 0;
+    transform->delete_count = 0;
+
+    // 内存分配失败时不再接受基于上一版本的编辑
+    if (!reserve_shifts(&transform->inserts, &transform->insert_capacity, doc->staged_insert_count) ||
+        !reserve_shifts(&transform->deletes, &transform->delete_capacity, doc->deleted_range_count)) {
+        return;
     }
 
-    // 检查版本和位置是否有效
-    if (!is_valid_version(doc, version)) {
-        return OUTDATED_VERSION;
+    size_t total = 0;
+    for (size_t i = 0; i < doc->staged_insert_count; i++) {
+        const staged_insert *insert = &doc->staged_inserts[i];
+        total += insert->piece->length;
+
+        if (transform->insert_count > 0 && transform->inserts[transform->insert_count - 1].start == insert->pos) {
+            transform->inserts[transform->insert_count - 1].total = total;
+        } else {
+            version_shift *shift = &transform->inserts[transform->insert_count++];
+            shift->start = insert->pos;
+            shift->end = insert->pos;
+            shift->total = total;
+        }
     }
 
-    if (!is_valid_range(doc, start, end)) {
-        return INVALID_CURSOR_POS;
+    total = 0;
+    for (size_t i = 0; i < doc->deleted_range_count; i++) {
+        const deleted_range *range = &doc->deleted_ranges[i];
+        total += range->end - range->start;
+
+        version_shift *shift = &transform->deletes[transform->delete_count++];
+        shift->start = range->start;
+        shift->end = range->end;
+        shift->total = total;
     }
 
-    // 创建编辑命令并添加到待处理列表
-    edit_command *cmd = create_command(CMD_BOLD, version, start, end, NULL, 0, username, original_cmd);
-    if (!cmd) {
-        return INVALID_CURSOR_POS; // 内存分配失败
+    transform->valid = 1;
+}
+
+/**
+ * 提交本版本暂存的编辑：按位置顺序一次遍历旧 rope，
+ * 保留未删除的内容并在对应位置拼入暂存的插入，最后重新编号受影响的有序列表
+ * @param doc 文档指针
+ */
+static void commit_staged_edits(document *doc) {
+    sort_staged_inserts(doc);
+    record_version_transform(doc);
+
+    if (doc->staged_insert_count == 0 && doc->deleted_range_count == 0) {
+        return;
     }
 
-    add_pending_edit(doc, cmd);
+    // 每个插入和每段被删除的内容各对应一条改动记录
+    size_t max_touched = 2 * doc->staged_insert_count + doc->deleted_range_count;
+    commit_state state = { doc->root, 0, NULL, 0, 0, NULL, 0 };
+    state.touched = (touched_range *)malloc(max_touched * sizeof(touched_range));
 
-    // 先在结束位置插入 "**"
-    int result = direct_insert(doc, end, "**", 2);
+    size_t base_length = doc->total_length;
+    size_t applied = 0;
+    int result = state.touched ? SUCCESS : INVALID_CURSOR_POS;
+
+    while (result == SUCCESS && applied < doc->staged_insert_count) {
+        staged_insert *insert = &doc->staged_inserts[applied];
+
+        result = commit_base(doc, &state, insert->pos);
+        if (result == SUCCESS) {
+            state.touched[state.touched_count].pos = state.out_length;
+            state.touched[state.touched_count].length = insert->piece->length;
+            state.touched_count++;
+            state.out = rope_merge(state.out, insert->piece);
+            state.out_length += insert->piece->length;
+            applied++;
+        }
+    }
+
+    if (result == SUCCESS) {
+        result = commit_base(doc, &state, base_length);
+    }
+
+    // 内存分配失败时保留剩余的旧内容，放弃未拼入的插入，上一版本的位置变换随之失效
     if (result != SUCCESS) {
-        return result;
+        doc->previous.valid = 0;
     }
+    state.out = rope_merge(state.out, state.rest);
+    set_root(doc, state.out);
+    doc->total_length = rope_length(state.out);
 
-    // 在起始位置插入 "**"
-    return direct_insert(doc, start, "**", 2);
+    for (size_t i = applied; i < doc->staged_insert_count; i++) {
+        free_chunk(doc->staged_inserts[i].piece);
+    }
+    doc->staged_insert_count = 0;
+    doc->staged_run_count = 0;
+    doc->deleted_range_count = 0;
+
+    // 重新编号受影响的有序列表；不含换行符且位于列表标记之后的改动不会影响编号
+    for (size_t i = 0; i < state.touched_count; i++) {
+        size_t pos = state.touched[i].pos;
+        size_t first_line = rope_newlines_before(doc->root, pos);
+        size_t last_line = rope_newlines_before(doc->root, pos + state.touched[i].length);
+
+        if (first_line == last_line && state.touched[i].length > 0 &&
+            pos - rope_line_start(doc->root, first_line) >= 3) {
+            continue;
+        }
+
+        renumber_lines(doc, first_line, last_line);
+    }
+
+    free(state.touched);
 }
 
 /**
- * 在文档中添加斜体格式
+ * 记录命令的执行结果：编辑记录在暂存之前加入待处理列表，暂存失败时把记录的状态改为错误码，
+ * 使日志和广播与实际结果一致
+ * @param cmd 已加入待处理列表的编辑命令
+ * @param result 执行结果
+ * @return 执行结果
+ */
+static int record_result(edit_command *cmd, int result) {
+    cmd->status = result;
+    return result;
+}
+
+/**
+ * 在文档中插入内容
+ * 编辑在提交版本（markdown_increment_version）后才可见，位置均指向已提交的版本
  * @param doc 文档指针
  * @param version 版本号
- * @param start 起始位置
- * @param end 结束位置
+ * @param pos 插入位置
+ * @param content 要插入的内容
  * @param username 用户名
  * @param original_cmd 原始命令字符串
  * @return 成功返回 SUCCESS，否则返回错误码
  */
-int markdown_italic(document *doc, uint64_t version, size_t start, size_t end, const char *username, const char *original_cmd) {
-    if (!doc) {
+int markdown_insert(document *doc, uint64_t version, size_t pos, const char *content, const char *username, const char *original_cmd) {
+    if (!doc || !content) {
         return INVALID_CURSOR_POS;
     }
 
@@ -690,38 +1260,37 @@ int markdown_italic(document *doc, uint64_t version, size_t start, size_t end, c
         return OUTDATED_VERSION;
     }
 
-    if (!is_valid_range(doc, start, end)) {
+    if (!is_valid_position(doc, version, pos)) {
         return INVALID_CURSOR_POS;
     }
 
+    size_t content_len = strlen(content);
+    if (content_len == 0) {
+        return SUCCESS; // 空内容，无需插入
+    }
+
     // 创建编辑命令并添加到待处理列表
-    edit_command *cmd = create_command(CMD_ITALIC, version, start, end, NULL, 0, username, original_cmd);
+    edit_command *cmd = create_command(CMD_INSERT, version, pos, 0, content, 0, username, original_cmd);
     if (!cmd) {
         return INVALID_CURSOR_POS; // 内存分配失败
     }
 
     add_pending_edit(doc, cmd);
 
-    // 先在结束位置插入 "*"
-    int result = direct_insert(doc, end, "*", 1);
-    if (result != SUCCESS) {
-        return result;
-    }
-
-    // 在起始位置插入 "*"
-    return direct_insert(doc, start, "*", 1);
+    return record_result(cmd, stage_insert(doc, resolve_position(doc, version, pos), content, content_len));
 }
 
 /**
- * 在文档中添加引用块格式
+ * 在文档中删除内容
  * @param doc 文档指针
  * @param version 版本号
- * @param pos 插入位置
+ * @param pos 删除起始位置
+ * @param len 删除长度，超出文档末尾的部分被截断
  * @param username 用户名
  * @param original_cmd 原始命令字符串
  * @return 成功返回 SUCCESS，否则返回错误码
  */
-int markdown_blockquote(document *doc, uint64_t version, size_t pos, const char *username, const char *original_cmd) {
+int markdown_delete(document *doc, uint64_t version, size_t pos, size_t len, const char *username, const char *original_cmd) {
     if (!doc) {
         return INVALID_CURSOR_POS;
     }
@@ -731,34 +1300,33 @@ int markdown_blockquote(document *doc, uint64_t version, size_t pos, const char
         return OUTDATED_VERSION;
     }
 
-    if (!is_valid_position(doc, pos)) {
+    if (!is_valid_position(doc, version, pos)) {
         return INVALID_CURSOR_POS;
     }
 
-    // 确保在行首插入引用块
-    // 如果不在文档开头，检查前一个字符是否为换行符
-    if (pos > 0) {
-        chunk *prev_chunk;
-        size_t prev_offset;
+    // 删除超出文档末尾时截断
+    size_t length = version_length(doc, version);
+    if (len > length - pos) {
+        len = length - pos;
+    }
 
-        if (find_position(doc, pos - 1, &prev_chunk, &prev_offset)) {
-            if (prev_chunk->content[prev_offset] != '\n') {
-                // 需要先插入换行符
-                int result = markdown_insert(doc, version, pos, "\n", username, original_cmd);
-                if (result != SUCCESS) {
-                    return result;
-                }
-                pos++; // 调整插入位置
-            }
-        }
+    if (len == 0) {
+        return SUCCESS; // 无需删除
+    }
+
+    // 创建编辑命令并添加到待处理列表
+    edit_command *cmd = create_command(CMD_DELETE, version, pos, pos + len, NULL, 0, username, original_cmd);
+    if (!cmd) {
+        return INVALID_CURSOR_POS; // 内存分配失败
     }
 
-    // 插入引用块前缀
-    return markdown_insert(doc, version, pos, "> ", username, original_cmd);
+    add_pending_edit(doc, cmd);
+
+    return record_result(cmd, stage_version_delete(doc, version, pos, pos + len));
 }
 
 /**
- * 在文档中添加有序列表格式
+ * 在文档中插入换行符
  * @param doc 文档指针
  * @param version 版本号
  * @param pos 插入位置
@@ -766,7 +1334,7 @@ int markdown_blockquote(document *doc, uint64_t version, size_t pos, const char
  * @param original_cmd 原始命令字符串
  * @return 成功返回 SUCCESS，否则返回错误码
  */
-int markdown_ordered_list(document *doc, uint64_t version, size_t pos, const char *username, const char *original_cmd) {
+int markdown_newline(document *doc, uint64_t version, size_t pos, const char *username, const char *original_cmd) {
     if (!doc) {
         return INVALID_CURSOR_POS;
     }
@@ -776,83 +1344,32 @@ int markdown_ordered_list(document *doc, uint64_t version, size_t pos, const cha
         return OUTDATED_VERSION;
     }
 
-    if (!is_valid_position(doc, pos)) {
+    if (!is_valid_position(doc, version, pos)) {
         return INVALID_CURSOR_POS;
     }
 
-    // 确保在行首插入列表
-    // 如果不在文档开头，检查前一个字符是否为换行符
-    if (pos > 0) {
-        chunk *prev_chunk;
-        size_t prev_offset;
+    // 创建编辑命令并添加到待处理列表
+    edit_command *cmd = create_command(CMD_NEWLINE, version, pos, 0, NULL, 0, username, original_cmd);
+    if (!cmd) {
+        return INVALID_CURSOR_POS; // 内存分配失败
+    }
 
-        if (find_position(doc, pos - 1, &prev_chunk, &prev_offset)) {
-            if (prev_chunk->content[prev_offset] != '\n') {
-                // 需要先插入换行符
-                int result = markdown_insert(doc, version, pos, "\n", username, original_cmd);
-                if (result != SUCCESS) {
-                    return result;
-                }
-                pos++; // 调整插入位置
-            }
-        }
-    }
-
-    // 查找前一个列表项，确定编号
-    int number = 1;
-
-    // 从插入位置向前查找最近的换行符
-    size_t search_pos = pos;
-    while (search_pos > 0) {
-        search_pos--;
-
-        chunk *chunk_pos;
-        size_t offset;
-
-        if (find_position(doc, search_pos, &chunk_pos, &offset)) {
-            if (chunk_pos->content[offset] == '\n') {
-                // 找到换行符，检查下一行是否为有序列表
-                if (search_pos + 1 < doc->total_length) {
-                    chunk *next_chunk;
-                    size_t next_offset;
-
-                    if (find_position(doc, search_pos + 1, &next_chunk, &next_offset)) {
-                        // 检查是否为数字后跟点和空格
-                        if (next_offset + 2 < next_chunk->length &&
-                            next_chunk->content[next_offset] >= '1' &&
-                            next_chunk->content[next_offset] <= '9' &&
-                            next_chunk->content[next_offset + 1] == '.' &&
-                            next_chunk->content[next_offset + 2] == ' ') {
-
-                            number = next_chunk->content[next_offset] - '0' + 1;
-                            if (number > 9) number = 1; // 限制为1-9
-                            break;
-                        }
-                    }
-                }
-                break;
-            }
-        }
-    }
-
-    // 生成列表项前缀
-    char prefix[5];
-    snprintf(prefix, sizeof(prefix), "%d. ", number);
+    add_pending_edit(doc, cmd);
 
-    // 插入列表项前缀
-    return markdown_insert(doc, version, pos, prefix, username, original_cmd);
+    return record_result(cmd, stage_insert(doc, resolve_position(doc, version, pos), "\n", 1));
 }
 
 /**
- * 在文档中添加无序列表格式
+ * 在文档中添加标题格式
  * @param doc 文档指针
  * @param version 版本号
+ * @param level 标题级别（1-3）
  * @param pos 插入位置
  * @param username 用户名
  * @param original_cmd 原始命令字符串
  * @return 成功返回 SUCCESS，否则返回错误码
  */
-int markdown_unordered_list(document *doc, uint64_t version, size_t pos, const char *username, const char *original_cmd) {
+int markdown_heading(document *doc, uint64_t version, int level, size_t pos, const char *username, const char *original_cmd) {
     if (!doc) {
         return INVALID_CURSOR_POS;
     }
@@ -862,34 +1379,43 @@ int markdown_unordered_list(document *doc, uint64_t version, size_t pos, const c
         return OUTDATED_VERSION;
     }
 
-    if (!is_valid_position(doc, pos)) {
+    if (!is_valid_position(doc, version, pos)) {
+        return INVALID_CURSOR_POS;
+    }
+
+    // 检查标题级别是否有效
+    if (level < 1 || level > 3) {
         return INVALID_CURSOR_POS;
     }
 
-    // 确保在行首插入列表
-    // 如果不在文档开头，检查前一个字符是否为换行符
-    if (pos > 0) {
-        chunk *prev_chunk;
-        size_t prev_offset;
+    // 创建编辑命令并添加到待处理列表
+    edit_command *cmd = create_command(CMD_HEADING, version, pos, 0, NULL, level, username, original_cmd);
+    if (!cmd) {
+        return INVALID_CURSOR_POS; // 内存分配失败
+    }
+
+    add_pending_edit(doc, cmd);
 
-        if (find_position(doc, pos - 1, &prev_chunk, &prev_offset)) {
-            if (prev_chunk->content[prev_offset] != '\n') {
-                // 需要先插入换行符
-                int result = markdown_insert(doc, version, pos, "\n", username, original_cmd);
-                if (result != SUCCESS) {
-                    return result;
-                }
-                pos++; // 调整插入位置
-            }
-        }
+    // 根据级别生成标题前缀
+    const char *prefix = NULL;
+    switch (level) {
+        case 1:
+            prefix = "# ";
+            break;
+        case 2:
+            prefix = "## ";
+            break;
+        case 3:
+            prefix = "### ";
+            break;
     }
 
-    // 插入无序列表前缀
-    return markdown_insert(doc, version, pos, "- ", username, original_cmd);
+    // 在行首插入标题前缀
+    return record_result(cmd, stage_block_prefix(doc, resolve_position(doc, version, pos), prefix));
 }
 
 /**
- * 在文档中添加代码格式
+ * 在文档中添加粗体格式
  * @param doc 文档指针
  * @param version 版本号
  * @param start 起始位置
@@ -898,7 +1424,7 @@ int markdown_unordered_list(document *doc, uint64_t version, size_t pos, const c
  * @param original_cmd 原始命令字符串
  * @return 成功返回 SUCCESS，否则返回错误码
  */
-int markdown_code(document *doc, uint64_t version, size_t start, size_t end, const char *username, const char *original_cmd) {
+int markdown_bold(document *doc, uint64_t version, size_t start, size_t end, const char *username, const char *original_cmd) {
     if (!doc) {
         return INVALID_CURSOR_POS;
     }
@@ -908,38 +1434,44 @@ int markdown_code(document *doc, uint64_t version, size_t start, size_t end, con
         return OUTDATED_VERSION;
     }
 
-    if (!is_valid_range(doc, start, end)) {
+    if (!is_valid_range(doc, version, start, end)) {
         return INVALID_CURSOR_POS;
     }
 
     // 创建编辑命令并添加到待处理列表
-    edit_command *cmd = create_command(CMD_CODE, version, start, end, NULL, 0, username, original_cmd);
+    edit_command *cmd = create_command(CMD_BOLD, version, start, end, NULL, 0, username, original_cmd);
     if (!cmd) {
         return INVALID_CURSOR_POS; // 内存分配失败
     }
 
     add_pending_edit(doc, cmd);
 
-    // 先在结束位置插入 "`"
-    int result = direct_insert(doc, end, "`", 1);
+    int result = resolve_range(doc, version, &start, &end);
     if (result != SUCCESS) {
-        return result;
+        return record_result(cmd, result);
     }
 
-    // 在起始位置插入 "`"
-    return direct_insert(doc, start, "`", 1);
+    // 先在结束位置插入 "**"
+    result = stage_insert(doc, end, "**", 2);
+    if (result != SUCCESS) {
+        return record_result(cmd, result);
+    }
+
+    // 在起始位置插入 "**"
+    return record_result(cmd, stage_insert(doc, start, "**", 2));
 }
 
 /**
- * 在文档中添加水平线
+ * 在文档中添加斜体格式
  * @param doc 文档指针
  * @param version 版本号
- * @param pos 插入位置
+ * @param start 起始位置
+ * @param end 结束位置
  * @param username 用户名
  * @param original_cmd 原始命令字符串
  * @return 成功返回 SUCCESS，否则返回错误码
  */
-int markdown_horizontal_rule(document *doc, uint64_t version, size_t pos, const char *username, const char *original_cmd) {
+int markdown_italic(document *doc, uint64_t version, size_t start, size_t end, const char *username, const char *original_cmd) {
     if (!doc) {
         return INVALID_CURSOR_POS;
     }
@@ -949,66 +1481,44 @@ int markdown_horizontal_rule(document *doc, uint64_t version, size_t pos, const
         return OUTDATED_VERSION;
     }
 
-    if (!is_valid_position(doc, pos)) {
+    if (!is_valid_range(doc, version, start, end)) {
         return INVALID_CURSOR_POS;
     }
 
-    // 确保在行首插入水平线
-    // 如果不在文档开头，检查前一个字符是否为换行符
-    if (pos > 0) {
-        chunk *prev_chunk;
-        size_t prev_offset;
-
-        if (find_position(doc, pos - 1, &prev_chunk, &prev_offset)) {
-            if (prev_chunk->content[prev_offset] != '\n') {
-                // 需要先插入换行符
-                int result = markdown_insert(doc, version, pos, "\n", username, original_cmd);
-                if (result != SUCCESS) {
-                    return result;
-                }
-                pos++; // 调整插入位置
-            }
-        }
+    // 创建编辑命令并添加到待处理列表
+    edit_command *cmd = create_command(CMD_ITALIC, version, start, end, NULL, 0, username, original_cmd);
+    if (!cmd) {
+        return INVALID_CURSOR_POS; // 内存分配失败
     }
 
-    // 插入水平线并确保后面有换行符
-    int result = markdown_insert(doc, version, pos, "---", username, original_cmd);
+    add_pending_edit(doc, cmd);
+
+    int result = resolve_range(doc, version, &start, &end);
     if (result != SUCCESS) {
-        return result;
+        return record_result(cmd, result);
     }
 
-    // 检查水平线后是否需要添加换行符
-    if (pos + 3 < doc->total_length) {
-        chunk *next_chunk;
-        size_t next_offset;
-
-        if (find_position(doc, pos + 3, &next_chunk, &next_offset)) {
-            if (next_chunk->content[next_offset] != '\n') {
-                // 需要在水平线后插入换行符
-                return markdown_insert(doc, version, pos + 3, "\n", username, original_cmd);
-            }
-        }
-    } else {
-        // 水平线在文档末尾，添加换行符
-        return markdown_insert(doc, version, pos + 3, "\n", username, original_cmd);
+    // 先在结束位置插入 "*"
+    result = stage_insert(doc, end, "*", 1);
+    if (result != SUCCESS) {
+        return record_result(cmd, result);
     }
 
-    return SUCCESS;
+    // 在起始位置插入 "*"
+    return record_result(cmd, stage_insert(doc, start, "*", 1));
 }
 
 /**
- * 在文档中添加链接格式
+ * 在文档中添加引用块格式
  * @param doc 文档指针
  * @param version 版本号
- * @param start 起始位置
- * @param end 结束位置
- * @param url 链接URL
+ * @param pos 插入位置
  * @param username 用户名
  * @param original_cmd 原始命令字符串
  * @return 成功返回 SUCCESS，否则返回错误码
  */
-int markdown_link(document *doc, uint64_t version, size_t start, size_t end, const char *url, const char *username, const char *original_cmd) {
-    if (!doc || !url) {
+int markdown_blockquote(document *doc, uint64_t version, size_t pos, const char *username, const char *original_cmd) {
+    if (!doc) {
         return INVALID_CURSOR_POS;
     }
 
@@ -1017,128 +1527,1296 @@ int markdown_link(document *doc, uint64_t version, size_t start, size_t end, con
         return OUTDATED_VERSION;
     }
 
-    if (!is_valid_range(doc, start, end)) {
+    if (!is_valid_position(doc, version, pos)) {
         return INVALID_CURSOR_POS;
     }
 
     // 创建编辑命令并添加到待处理列表
-    edit_command *cmd = create_command(CMD_LINK, version, start, end, url, 0, username, original_cmd);
+    edit_command *cmd = create_command(CMD_BLOCKQUOTE, version, pos, 0, NULL, 0, username, original_cmd);
     if (!cmd) {
         return INVALID_CURSOR_POS; // 内存分配失败
     }
 
     add_pending_edit(doc, cmd);
 
-    // 构造链接格式：[文本](URL)
-    // 先在结束位置插入 "](URL)"
-    char *suffix = (char *)malloc(strlen(url) + 4); // "](" + url + ")"
-    if (!suffix) {
-        return INVALID_CURSOR_POS; // 内存分配失败
+    // 在行首插入引用块前缀
+    return record_result(cmd, stage_block_prefix(doc, resolve_position(doc, version, pos), "> "));
+}
+
+/**
+ * 在文档中添加有序列表格式
+ * 暂存时先插入 "1. "，提交版本时整段列表重新编号
+ * @param doc 文档指针
+ * @param version 版本号
+ * @param pos 插入位置
+ * @param username 用户名
+ * @param original_cmd 原始命令字符串
+ * @return 成功返回 SUCCESS，否则返回错误码
+ */
+int markdown_ordered_list(document *doc, uint64_t version, size_t pos, const char *username, const char *original_cmd) {
+    if (!doc) {
+        return INVALID_CURSOR_POS;
     }
 
-    sprintf(suffix, "](%s)", url);
-    int result = direct_insert(doc, end, suffix, strlen(suffix));
-    free(suffix);
+    // 检查版本和位置是否有效
+    if (!is_valid_version(doc, version)) {
+        return OUTDATED_VERSION;
+    }
 
-    if (result != SUCCESS) {
-        return result;
+    if (!is_valid_position(doc, version, pos)) {
+        return INVALID_CURSOR_POS;
     }
 
-    // 在起始位置插入 "["
-    return direct_insert(doc, start, "[", 1);
+    // 创建编辑命令并添加到待处理列表
+    edit_command *cmd = create_command(CMD_ORDERED_LIST, version, pos, 0, NULL, 0, username, original_cmd);
+    if (!cmd) {
+        return INVALID_CURSOR_POS; // 内存分配失败
+    }
+
+    add_pending_edit(doc, cmd);
+
+    // 在行首插入列表项前缀
+    return record_result(cmd, stage_block_prefix(doc, resolve_position(doc, version, pos), "1. "));
 }
 
 /**
- * 打印文档内容到指定流
+ * 在文档中添加无序列表格式
  * @param doc 文档指针
- * @param stream 输出流
+ * @param version 版本号
+ * @param pos 插入位置
+ * @param username 用户名
+ * @param original_cmd 原始命令字符串
+ * @return 成功返回 SUCCESS，否则返回错误码
  */
-void markdown_print(const document *doc, FILE *stream) {
-    if (!doc || !stream) {
-        return;
+int markdown_unordered_list(document *doc, uint64_t version, size_t pos, const char *username, const char *original_cmd) {
+    if (!doc) {
+        return INVALID_CURSOR_POS;
+    }
+
+    // 检查版本和位置是否有效
+    if (!is_valid_version(doc, version)) {
+        return OUTDATED_VERSION;
     }
 
-    chunk *current = doc->head;
+    if (!is_valid_position(doc, version, pos)) {
+        return INVALID_CURSOR_POS;
+    }
 
-    while (current) {
-        fprintf(stream, "%s", current->content);
-        current = current->next;
+    // 创建编辑命令并添加到待处理列表
+    edit_command *cmd = create_command(CMD_UNORDERED_LIST, version, pos, 0, NULL, 0, username, original_cmd);
+    if (!cmd) {
+        return INVALID_CURSOR_POS; // 内存分配失败
     }
+
+    add_pending_edit(doc, cmd);
+
+    // 在行首插入无序列表前缀
+    return record_result(cmd, stage_block_prefix(doc, resolve_position(doc, version, pos), "- "));
 }
 
 /**
- * 将文档内容扁平化为单个字符串
+ * 在文档中添加代码格式
  * @param doc 文档指针
- * @return 扁平化后的字符串，调用者负责释放
+ * @param version 版本号
+ * @param start 起始位置
+ * @param end 结束位置
+ * @param username 用户名
+ * @param original_cmd 原始命令字符串
+ * @return 成功返回 SUCCESS，否则返回错误码
  */
-char *markdown_flatten(const document *doc) {
+int markdown_code(document *doc, uint64_t version, size_t start, size_t end, const char *username, const char *original_cmd) {
     if (!doc) {
-        return NULL;
+        return INVALID_CURSOR_POS;
     }
 
-    // 如果文档为空，返回空字符串
-    if (doc->total_length == 0) {
-        char *result = (char *)malloc(1);
-        if (result) {
-            result[0] = '\0';
-        }
-        return result;
+    // 检查版本和位置是否有效
+    if (!is_valid_version(doc, version)) {
+        return OUTDATED_VERSION;
     }
 
-    // 分配足够的内存
-    char *result = (char *)malloc(doc->total_length + 1);
-    if (!result) {
-        return NULL;
+    if (!is_valid_range(doc, version, start, end)) {
+        return INVALID_CURSOR_POS;
     }
 
-    // 复制所有块的内容
-    size_t offset = 0;
-    chunk *current = doc->head;
+    // 创建编辑命令并添加到待处理列表
+    edit_command *cmd = create_command(CMD_CODE, version, start, end, NULL, 0, username, original_cmd);
+    if (!cmd) {
+        return INVALID_CURSOR_POS; // 内存分配失败
+    }
 
-    while (current) {
-        memcpy(result + offset, current->content, current->length);
-        offset += current->length;
-        current = current->next;
+    add_pending_edit(doc, cmd);
+
+    int result = resolve_range(doc, version, &start, &end);
+    if (result != SUCCESS) {
+        return record_result(cmd, result);
     }
 
-    // 添加终止符
-    result[doc->total_length] = '\0';
+    // 先在结束位置插入 "`"
+    result = stage_insert(doc, end, "`", 1);
+    if (result != SUCCESS) {
+        return record_result(cmd, result);
+    }
 
-    return result;
+    // 在起始位置插入 "`"
+    return record_result(cmd, stage_insert(doc, start, "`", 1));
 }
 
 /**
- * 增加文档版本号
+ * 在文档中添加水平线
  * @param doc 文档指针
+ * @param version 版本号
+ * @param pos 插入位置
+ * @param username 用户名
+ * @param original_cmd 原始命令字符串
+ * @return 成功返回 SUCCESS，否则返回错误码
  */
-void markdown_increment_version(document *doc) {
+int markdown_horizontal_rule(document *doc, uint64_t version, size_t pos, const char *username, const char *original_cmd) {
     if (!doc) {
-        return;
+        return INVALID_CURSOR_POS;
     }
 
-    doc->version++;
+    // 检查版本和位置是否有效
+    if (!is_valid_version(doc, version)) {
+        return OUTDATED_VERSION;
+    }
 
-    // 将待处理的编辑命令移动到历史记录中
-    if (doc->pending_edits) {
-        edit_command *current = doc->pending_edits;
+    if (!is_valid_position(doc, version, pos)) {
+        return INVALID_CURSOR_POS;
+    }
 
-        // 找到待处理列表的最后一个节点
-        while (current->next) {
-            current = current->next;
-        }
+    // 创建编辑命令并添加到待处理列表
+    edit_command *cmd = create_command(CMD_HORIZONTAL_RULE, version, pos, 0, NULL, 0, username, original_cmd);
+    if (!cmd) {
+        return INVALID_CURSOR_POS; // 内存分配失败
+    }
 
-        // 将整个待处理列表添加到历史记录中
-        if (!doc->edit_history) {
-            doc->edit_history = doc->pending_edits;
-        } else {
-            edit_command *history_last = doc->edit_history;
-            while (history_last->next) {
-                history_last = history_last->next;
-            }
-            history_last->next = doc->pending_edits;
-        }
+    add_pending_edit(doc, cmd);
+
+    // 水平线前后都需要换行符：不在行首时先补一个，后面不是换行符时再补一个
+    pos = resolve_position(doc, version, pos);
+    int next = staged_char_after(doc, pos);
+    return record_result(cmd, stage_block_prefix(doc, pos, next == '\n' ? "---" : "---\n"));
+}
+
+/**
+ * 在文档中添加链接格式
+ * @param doc 文档指针
+ * @param version 版本号
+ * @param start 起始位置
+ * @param end 结束位置
+ * @param url 链接URL
+ * @param username 用户名
+ * @param original_cmd 原始命令字符串
+ * @return 成功返回 SUCCESS，否则返回错误码
+ */
+int markdown_link(document *doc, uint64_t version, size_t start, size_t end, const char *url, const char *username, const char *original_cmd) {
+    if (!doc || !url) {
+        return INVALID_CURSOR_POS;
+    }
+
+    // 检查版本和位置是否有效
+    if (!is_valid_version(doc, version)) {
+        return OUTDATED_VERSION;
+    }
 
-        // 清空待处理列表
-        doc->pending_edits = NULL;
+    if (!is_valid_range(doc, version, start, end)) {
+        return INVALID_CURSOR_POS;
+    }
+
+    // 创建编辑命令并添加到待处理列表
+    edit_command *cmd = create_command(CMD_LINK, version, start, end, url, 0, username, original_cmd);
+    if (!cmd) {
+        return INVALID_CURSOR_POS; // 内存分配失败
     }
-}
\ No newline at end of file
+
+    add_pending_edit(doc, cmd);
+
+    int result = resolve_range(doc, version, &start, &end);
+    if (result != SUCCESS) {
+        return record_result(cmd, result);
+    }
+
+    // 构造链接格式：[文本](URL)
+    // 先在结束位置插入 "](URL)"
+    char *suffix = (char *)malloc(strlen(url) + 4); // "](" + url + ")"
+    if (!suffix) {
+        return record_result(cmd, INVALID_CURSOR_POS); // 内存分配失败
+    }
+
+    sprintf(suffix, "](%s)", url);
+    result = stage_insert(doc, end, suffix, strlen(suffix));
+    free(suffix);
+
+    if (result != SUCCESS) {
+        return record_result(cmd, result);
+    }
+
+    // 在起始位置插入 "["
+    return record_result(cmd, stage_insert(doc, start, "[", 1));
+}
+
+/**
+ * 执行单条已解析的命令
+ * @param doc 文档指针
+ * @param cmd 命令
+ * @return 成功返回 SUCCESS，否则返回错误码
+ */
+static int apply_parsed_command(document *doc, const parsed_cmd *cmd) {
+    switch (cmd->type) {
+        case CMD_INSERT:
+            return markdown_insert(doc, cmd->version, cmd->pos1, cmd->content, cmd->username, cmd->original_cmd);
+        case CMD_DELETE:
+            return markdown_delete(doc, cmd->version, cmd->pos1, cmd->pos2, cmd->username, cmd->original_cmd);
+        case CMD_NEWLINE:
+            return markdown_newline(doc, cmd->version, cmd->pos1, cmd->username, cmd->original_cmd);
+        case CMD_HEADING:
+            return markdown_heading(doc, cmd->version, cmd->level, cmd->pos1, cmd->username, cmd->original_cmd);
+        case CMD_BOLD:
+            return markdown_bold(doc, cmd->version, cmd->pos1, cmd->pos2, cmd->username, cmd->original_cmd);
+        case CMD_ITALIC:
+            return markdown_italic(doc, cmd->version, cmd->pos1, cmd->pos2, cmd->username, cmd->original_cmd);
+        case CMD_BLOCKQUOTE:
+            return markdown_blockquote(doc, cmd->version, cmd->pos1, cmd->username, cmd->original_cmd);
+        case CMD_ORDERED_LIST:
+            return markdown_ordered_list(doc, cmd->version, cmd->pos1, cmd->username, cmd->original_cmd);
+        case CMD_UNORDERED_LIST:
+            return markdown_unordered_list(doc, cmd->version, cmd->pos1, cmd->username, cmd->original_cmd);
+        case CMD_CODE:
+            return markdown_code(doc, cmd->version, cmd->pos1, cmd->pos2, cmd->username, cmd->original_cmd);
+        case CMD_HORIZONTAL_RULE:
+            return markdown_horizontal_rule(doc, cmd->version, cmd->pos1, cmd->username, cmd->original_cmd);
+        case CMD_LINK:
+            return markdown_link(doc, cmd->version, cmd->pos1, cmd->pos2, cmd->content, cmd->username, cmd->original_cmd);
+    }
+
+    return INVALID_CURSOR_POS;
+}
+
+/**
+ * 按顺序执行一批已解析的命令，效果与逐条调用对应的 markdown_* 函数相同
+ * 命令按类型直接分派；本批暂存的插入以有序段的形式维护，按位置查找时不重新排序，
+ * 文档内容在提交时一次遍历完成拼接。
+ * 每条命令在待处理列表中恰好留下一条记录，状态为执行结果，被拒绝的命令也会记录
+ * @param doc 文档指针
+ * @param cmds 命令数组
+ * @param count 命令数量
+ * @return 成功执行的命令数量
+ */
+size_t markdown_apply_batch(document *doc, const parsed_cmd *cmds, size_t count) {
+    if (!doc || !cmds) {
+        return 0;
+    }
+
+    size_t applied = 0;
+    for (size_t i = 0; i < count; i++) {
+        const parsed_cmd *cmd = &cmds[i];
+        size_t logged = doc->pending_count;
+        int result = cmd->status != SUCCESS ? cmd->status : apply_parsed_command(doc, cmd);
+
+        if (result == SUCCESS) {
+            applied++;
+        }
+
+        // 校验阶段被拒绝或无需修改（如删除长度为 0）的命令尚未记录，补一条记录
+        if (doc->pending_count == logged) {
+            edit_command *record = create_command(cmd->type, cmd->version, cmd->pos1, cmd->pos2, cmd->content,
+                                                  cmd->level, cmd->username, cmd->original_cmd);
+            if (!record) {
+                continue; // 内存分配失败，只能放弃记录
+            }
+            add_pending_edit(doc, record);
+        }
+        doc->pending_tail->status = result;
+    }
+
+    return applied;
+}
+
+/**
+ * 收集块内容位置的遍历上下文
+ */
+typedef struct {
+    struct iovec *iov;
+    text_block **blocks;    // 非空时同时记录并引用内容所在的缓冲区
+    size_t capacity;
+    size_t count;
+    size_t block_count;
+} iovec_ctx;
+
+/**
+ * rope_walk 回调：记录块内容位置
+ */
+static void collect_iovec(const chunk *c, void *ctx) {
+    iovec_ctx *out = (iovec_ctx *)ctx;
+
+    if (out->count >= out->capacity) {
+        return;
+    }
+
+    out->iov[out->count].iov_base = c->content;
+    out->iov[out->count].iov_len = c->length;
+    out->count++;
+
+    // 相邻块通常位于同一缓冲区，只引用一次
+    if (out->blocks && (out->block_count == 0 || out->blocks[out->block_count - 1] != c->block)) {
+        __atomic_add_fetch(&c->block->refs, 1, __ATOMIC_RELAXED);
+        out->blocks[out->block_count++] = c->block;
+    }
+}
+
+/**
+ * 按顺序导出文档各块内容的位置，用于 writev 等分散/聚集输出
+ * 导出的指针在文档下一次修改前有效
+ * @param doc 文档指针
+ * @param iov 输出数组
+ * @param n 数组容量
+ * @return 完整导出所需的 iovec 数量（即块数量），可能大于 n
+ */
+size_t markdown_iovec(const document *doc, struct iovec *iov, size_t n) {
+    if (!doc) {
+        return 0;
+    }
+
+    if (iov && n > 0) {
+        iovec_ctx ctx = { iov, NULL, n, 0, 0 };
+        rope_walk(doc->root, collect_iovec, &ctx);
+    }
+
+    return rope_chunk_count(doc->root);
+}
+
+/**
+ * 把 iovec 数组完整写入文件描述符，处理部分写入和单次调用的数量上限
+ * 不修改传入的数组（快照中的数组由多个读者共享）
+ * @param fd 文件描述符
+ * @param iov iovec 数组
+ * @param count 数组长度
+ * @return 成功返回 0，写入失败返回 -1
+ */
+static int writev_all(int fd, const struct iovec *iov, size_t count) {
+    struct iovec batch[WRITEV_BATCH];
+    size_t next = 0;
+
+    while (next < count) {
+        size_t n = count - next < WRITEV_BATCH ? count - next : WRITEV_BATCH;
+        memcpy(batch, iov + next, n * sizeof(struct iovec));
+        next += n;
+
+        struct iovec *current = batch;
+        while (n > 0) {
+            ssize_t written = writev(fd, current, (int)n);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return -1;
+            }
+
+            // 跳过已完整写出的项，调整写出一部分的项
+            while (n > 0 && (size_t)written >= current->iov_len) {
+                written -= current->iov_len;
+                current++;
+                n--;
+            }
+            if (n > 0) {
+                current->iov_base = (char *)current->iov_base + written;
+                current->iov_len -= written;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * 输出单个块的内容
+ * @param c 文档块
+ * @param ctx 输出流
+ */
+static void print_chunk(const chunk *c, void *ctx) {
+    fwrite(c->content, 1, c->length, (FILE *)ctx);
+}
+
+/**
+ * 打印文档内容到指定流
+ * @param doc 文档指针
+ * @param stream 输出流
+ */
+void markdown_print(const document *doc, FILE *stream) {
+    if (!doc || !stream) {
+        return;
+    }
+
+    // 对应文件描述符的流直接从块内存 writev，不经过 stdio 缓冲区复制
+    int fd = fileno(stream);
+    size_t count = rope_chunk_count(doc->root);
+    struct iovec *iov = (fd >= 0 && count > 0) ? (struct iovec *)malloc(count * sizeof(struct iovec)) : NULL;
+
+    if (iov && fflush(stream) == 0) {
+        markdown_iovec(doc, iov, count);
+        writev_all(fd, iov, count);
+        free(iov);
+        return;
+    }
+
+    free(iov);
+    rope_walk(doc->root, print_chunk, stream);
+}
+
+/**
+ * 把单个块的内容追加到扁平化缓冲区
+ * @param c 文档块
+ * @param ctx 指向写入游标的指针
+ */
+static void flatten_chunk(const chunk *c, void *ctx) {
+    char **cursor = (char **)ctx;
+    memcpy(*cursor, c->content, c->length);
+    *cursor += c->length;
+}
+
+/**
+ * 将文档内容扁平化为单个字符串
+ * @param doc 文档指针
+ * @return 扁平化后的字符串，调用者负责释放
+ */
+char *markdown_flatten(const document *doc) {
+    if (!doc) {
+        return NULL;
+    }
+
+    // 如果文档为空，返回空字符串
+    if (doc->total_length == 0) {
+        char *result = (char *)malloc(1);
+        if (result) {
+            result[0] = '\0';
+        }
+        return result;
+    }
+
+    // 分配足够的内存
+    char *result = (char *)malloc(doc->total_length + 1);
+    if (!result) {
+        return NULL;
+    }
+
+    // 按顺序复制所有块的内容
+    char *cursor = result;
+    rope_walk(doc->root, flatten_chunk, &cursor);
+
+    // 添加终止符
+    result[doc->total_length] = '\0';
+
+    return result;
+}
+
+/**
+ * 复制已提交内容中 [start, start + length) 的部分，只定位一次并只访问与区间相交的块
+ * @param doc 文档指针
+ * @param start 起始位置
+ * @param length 要读取的长度，超出文档末尾的部分被截断
+ * @param buf 输出缓冲区，至少 length 字节（不添加终止符）
+ * @return 实际复制的字节数
+ */
+size_t markdown_read_range(const document *doc, size_t start, size_t length, char *buf) {
+    if (!doc || !buf || start >= doc->total_length) {
+        return 0;
+    }
+
+    return rope_copy(doc->root, start, length, buf);
+}
+
+/**
+ * 开始按块遍历已提交内容中 [start, start + length) 的部分，用 markdown_range_next() 逐段取出
+ * 给出的内容直接指向文档块，在文档下一次修改前有效
+ * @param doc 文档指针
+ * @param start 起始位置
+ * @param length 区间长度，超出文档末尾的部分被截断
+ * @param it 迭代器
+ */
+void markdown_range_begin(const document *doc, size_t start, size_t length, rope_iter *it) {
+    if (!it) {
+        return;
+    }
+
+    rope_iter_init(it, doc ? doc->root : NULL, start, length);
+}
+
+/**
+ * 取出区间内的下一段内容
+ * @param it 迭代器
+ * @param data 返回内容起始地址
+ * @param length 返回内容长度
+ * @return 取到内容返回 1，区间结束返回 0
+ */
+int markdown_range_next(rope_iter *it, const char **data, size_t *length) {
+    if (!it || !data || !length) {
+        return 0;
+    }
+
+    return rope_iter_next(it, data, length);
+}
+
+/**
+ * 块收集上下文
+ */
+typedef struct {
+    chunk **items;
+    size_t count;
+} chunk_list;
+
+/**
+ * 按顺序收集块指针
+ * @param c 文档块
+ * @param ctx 块收集上下文
+ */
+static void collect_chunk(const chunk *c, void *ctx) {
+    chunk_list *list = (chunk_list *)ctx;
+    list->items[list->count++] = (chunk *)c;
+}
+
+/**
+ * 把一组相邻的块合并成一个新块
+ * 如果它们在同一缓冲区中首尾相接，新块直接引用原内容，否则复制内容
+ * @param doc 文档指针
+ * @param run 相邻的块
+ * @param count 块数量
+ * @param run_length 内容总长度，不超过 COALESCE_TARGET_SIZE
+ * @return 合并后的块，内存分配失败返回 NULL
+ */
+static chunk *coalesce_run(document *doc, chunk **run, size_t count, size_t run_length) {
+    int contiguous = 1;
+    for (size_t i = 1; i < count; i++) {
+        if (run[i]->block != run[0]->block ||
+            run[i - 1]->content + run[i - 1]->length != run[i]->content) {
+            contiguous = 0;
+            break;
+        }
+    }
+
+    if (contiguous) {
+        return create_piece(run[0]->block, run[0]->content, run_length);
+    }
+
+    char buffer[COALESCE_TARGET_SIZE];
+    size_t offset = 0;
+    for (size_t i = 0; i < count; i++) {
+        memcpy(buffer + offset, run[i]->content, run[i]->length);
+        offset += run[i]->length;
+    }
+
+    return create_text_chunk(doc, buffer, run_length);
+}
+
+/**
+ * 增量合并相邻的小块
+ * 每次从上次停下的位置开始，最多检查 COALESCE_CHUNK_BUDGET 个块，
+ * 把相邻且合计不超过 COALESCE_TARGET_SIZE 的块合并为一个，到达文档末尾后从头开始
+ * @param doc 文档指针
+ */
+static void coalesce_chunks(document *doc) {
+    if (!doc->root) {
+        return;
+    }
+
+    if (doc->compact_cursor >= doc->total_length) {
+        doc->compact_cursor = 0;
+    }
+
+    // 把游标对齐到所在块的起始位置，这样分割时不会切开任何块
+    size_t offset = 0;
+    rope_find(doc->root, doc->compact_cursor, &offset);
+    size_t start = doc->compact_cursor - offset;
+
+    chunk *left, *window, *right;
+    rope_split(doc->root, start, &left, &right);
+    rope_split_chunks(right, COALESCE_CHUNK_BUDGET, &window, &right);
+
+    chunk *items[COALESCE_CHUNK_BUDGET];
+    chunk_list list = {items, 0};
+    size_t window_length = rope_length(window);
+    rope_walk(window, collect_chunk, &list);
+
+    // 贪心地把相邻小块分组，逐个重新拼接成新的窗口
+    chunk *rebuilt = NULL;
+    size_t i = 0;
+    while (i < list.count) {
+        size_t run_end = i + 1;
+        size_t run_length = items[i]->length;
+
+        while (run_end < list.count && run_length + items[run_end]->length <= COALESCE_TARGET_SIZE) {
+            run_length += items[run_end]->length;
+            run_end++;
+        }
+
+        chunk *merged = NULL;
+        if (run_end - i > 1) {
+            merged = coalesce_run(doc, items + i, run_end - i, run_length);
+        }
+
+        if (merged) {
+            for (size_t j = i; j < run_end; j++) {
+                free_chunk(items[j]);
+            }
+            doc->chunks_coalesced += run_end - i - 1;
+            rebuilt = rope_append(rebuilt, merged);
+        } else {
+            for (size_t j = i; j < run_end; j++) {
+                rebuilt = rope_append(rebuilt, items[j]);
+            }
+        }
+
+        i = run_end;
+    }
+
+    doc->compact_cursor = right ? start + window_length : 0;
+    set_root(doc, rope_merge(rope_merge(left, rebuilt), right));
+}
+
+/**
+ * 获取文档当前的块数量
+ * @param doc 文档指针
+ * @return 块数量
+ */
+size_t markdown_chunk_count(const document *doc) {
+    return doc ? rope_chunk_count(doc->root) : 0;
+}
+
+/**
+ * 获取文档块的平均大小
+ * @param doc 文档指针
+ * @return 平均每块的字节数，空文档为 0
+ */
+size_t markdown_average_chunk_size(const document *doc) {
+    size_t count = markdown_chunk_count(doc);
+    return count ? doc->total_length / count : 0;
+}
+
+// 统计时收集文档引用的缓冲区
+typedef struct {
+    doc_stats *stats;
+    text_block **blocks;
+    size_t count;
+} stats_ctx;
+
+/**
+ * rope_walk 回调：统计块大小，记录块所在的缓冲区
+ */
+static void collect_stats(const chunk *c, void *ctx) {
+    stats_ctx *out = (stats_ctx *)ctx;
+
+    size_t bucket = 0;
+    for (size_t limit = 16; bucket < STATS_SIZE_BUCKETS - 1 && c->length >= limit; limit *= 4) {
+        bucket++;
+    }
+    out->stats->chunk_sizes[bucket]++;
+
+    // 相邻块通常位于同一缓冲区，其余重复在排序后去除
+    if (out->blocks && (out->count == 0 || out->blocks[out->count - 1] != c->block)) {
+        out->blocks[out->count++] = c->block;
+    }
+}
+
+/**
+ * qsort 比较函数：按地址排序缓冲区指针
+ */
+static int compare_blocks(const void *a, const void *b) {
+    const text_block *x = *(text_block *const *)a;
+    const text_block *y = *(text_block *const *)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * 统计缓冲区占用的内存，映射的缓冲区只计入映射长度
+ */
+static void add_block_bytes(doc_stats *stats, const text_block *block) {
+    if (block->mapped) {
+        stats->content_bytes += sizeof(text_block);
+        stats->mapped_bytes += block->mapped;
+    } else {
+        stats->content_bytes += sizeof(text_block) + block->capacity;
+    }
+}
+
+/**
+ * 统计文档的内存占用和碎片情况：块数量、块大小直方图，以及按类别的堆内存字节数
+ * 需要遍历所有块和命令，用于监控而不是热路径
+ * @param doc 文档指针
+ * @param stats 输出的统计结果
+ */
+void markdown_stats(const document *doc, doc_stats *stats) {
+    if (!stats) {
+        return;
+    }
+
+    memset(stats, 0, sizeof(*stats));
+    stats->allocations = document_allocation_count();
+    if (!doc) {
+        return;
+    }
+
+    stats->chunk_count = rope_chunk_count(doc->root);
+    stats->content_length = doc->total_length;
+    stats->chunk_bytes = stats->chunk_count * sizeof(chunk);
+
+    // 内存不足时只缺少缓冲区统计
+    stats_ctx ctx = { stats, NULL, 0 };
+    if (stats->chunk_count > 0) {
+        ctx.blocks = (text_block **)malloc(stats->chunk_count * sizeof(text_block *));
+    }
+    rope_walk(doc->root, collect_stats, &ctx);
+
+    // 每个缓冲区只统计一次；追加缓冲区即使暂时没有块引用也属于文档
+    if (ctx.blocks) {
+        qsort(ctx.blocks, ctx.count, sizeof(text_block *), compare_blocks);
+        for (size_t i = 0; i < ctx.count; i++) {
+            if (i == 0 || ctx.blocks[i] != ctx.blocks[i - 1]) {
+                add_block_bytes(stats, ctx.blocks[i]);
+            }
+        }
+        if (doc->add_buffer && !bsearch(&doc->add_buffer, ctx.blocks, ctx.count, sizeof(text_block *), compare_blocks)) {
+            add_block_bytes(stats, doc->add_buffer);
+        }
+        free(ctx.blocks);
+    } else if (doc->add_buffer) {
+        add_block_bytes(stats, doc->add_buffer);
+    }
+
+    for (const edit_command *cmd = doc->pending_edits; cmd; cmd = cmd->next) {
+        stats->pending_count++;
+        stats->pending_bytes += command_bytes(cmd);
+    }
+    stats->pending_bytes += doc->staged_insert_capacity * sizeof(staged_insert) +
+                            doc->staged_scratch_capacity * sizeof(staged_insert) +
+                            doc->deleted_range_capacity * sizeof(deleted_range);
+
+    for (const edit_command *cmd = doc->edit_history; cmd; cmd = cmd->next) {
+        stats->history_count++;
+        stats->history_bytes += command_bytes(cmd);
+    }
+    stats->history_bytes += doc->history_segment_capacity * sizeof(history_segment);
+}
+
+/**
+ * 释放一个快照引用，最后一个引用释放时归还缓冲区引用并回收内存
+ * 引用计数使用原子操作，读者可以在不持有文档锁的情况下释放
+ * @param snapshot 快照指针
+ */
+void markdown_release_snapshot(doc_snapshot *snapshot) {
+    if (snapshot && __atomic_sub_fetch(&snapshot->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        for (size_t i = 0; i < snapshot->block_count; i++) {
+            release_text_block(snapshot->blocks[i]);
+        }
+        free(snapshot);
+    }
+}
+
+/**
+ * 把快照内容写入文件描述符
+ * @param snapshot 快照指针
+ * @param fd 文件描述符
+ * @return 成功返回 0，写入失败返回 -1
+ */
+int markdown_write_snapshot(const doc_snapshot *snapshot, int fd) {
+    if (!snapshot) {
+        return -1;
+    }
+
+    return writev_all(fd, snapshot->iov, snapshot->iov_count);
+}
+
+/**
+ * 把快照写成检查点：一行 "CHECKPOINT <version> <length>"，随后是内容，可由 markdown_load_checkpoint() 恢复
+ * 快照记录了上一版本的位置变换时，内容之后再写一行 "PREVIOUS <length> <inserts> <deletes>"，
+ * 随后每项变换一行 "<start> <end> <total>"（先插入后删除）
+ * 只负责写入，fsync 和 rename 由调用者决定
+ * @param snapshot 快照指针
+ * @param fd 文件描述符
+ * @return 成功返回 0，写入失败返回 -1
+ */
+int markdown_write_checkpoint(const doc_snapshot *snapshot, int fd) {
+    if (!snapshot) {
+        return -1;
+    }
+
+    char header[CHECKPOINT_HEADER_MAX];
+    int header_len = snprintf(header, sizeof(header), "CHECKPOINT %lu %zu\n", snapshot->version, snapshot->length);
+    struct iovec iov = { header, (size_t)header_len };
+
+    if (writev_all(fd, &iov, 1) != 0 || markdown_write_snapshot(snapshot, fd) != 0) {
+        return -1;
+    }
+
+    const version_transform *previous = &snapshot->previous;
+    if (!previous->valid) {
+        return 0;
+    }
+
+    char *trailer = NULL;
+    size_t trailer_len = 0;
+    FILE *stream = open_memstream(&trailer, &trailer_len);
+    if (!stream) {
+        return -1;
+    }
+
+    fprintf(stream, "PREVIOUS %zu %zu %zu\n", previous->length, previous->insert_count, previous->delete_count);
+    for (size_t i = 0; i < previous->insert_count; i++) {
+        fprintf(stream, "%zu %zu %zu\n", previous->inserts[i].start, previous->inserts[i].end, previous->inserts[i].total);
+    }
+    for (size_t i = 0; i < previous->delete_count; i++) {
+        fprintf(stream, "%zu %zu %zu\n", previous->deletes[i].start, previous->deletes[i].end, previous->deletes[i].total);
+    }
+    fclose(stream);
+
+    iov.iov_base = trailer;
+    iov.iov_len = trailer_len;
+    int result = writev_all(fd, &iov, 1);
+    free(trailer);
+    return result;
+}
+
+/**
+ * 把快照内容中 [start, start + length) 的部分写入文件描述符
+ * 按块偏移二分查找起始块，首尾两块只写与区间相交的部分，中间的块整块 writev
+ * @param snapshot 快照指针
+ * @param start 起始位置
+ * @param length 长度，调用者保证区间不超出快照内容
+ * @return 成功返回 0，写入失败返回 -1
+ */
+int markdown_write_snapshot_range(const doc_snapshot *snapshot, size_t start, size_t length, int fd) {
+    if (!snapshot || start > snapshot->length || length > snapshot->length - start) {
+        return -1;
+    }
+    if (length == 0) {
+        return 0;
+    }
+
+    // 第一个起始位置大于 start 的块之前的一块包含 start
+    size_t low = 0;
+    size_t high = snapshot->iov_count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (snapshot->offsets[mid] <= start) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    size_t first = low - 1;
+    size_t end = start + length;
+    high = snapshot->iov_count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (snapshot->offsets[mid] < end) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    size_t last = low - 1;
+
+    const char *base = (const char *)snapshot->iov[first].iov_base;
+    size_t skip = start - snapshot->offsets[first];
+    if (first == last) {
+        struct iovec head = { (void *)(base + skip), length };
+        return writev_all(fd, &head, 1);
+    }
+
+    struct iovec head = { (void *)(base + skip), snapshot->iov[first].iov_len - skip };
+    struct iovec tail = { snapshot->iov[last].iov_base, end - snapshot->offsets[last] };
+    if (writev_all(fd, &head, 1) != 0 ||
+        writev_all(fd, snapshot->iov + first + 1, last - first - 1) != 0 ||
+        writev_all(fd, &tail, 1) != 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * 为当前已提交的内容构建快照（只记录各块的位置，不复制内容）
+ * @param doc 文档指针
+ * @return 引用计数为 1 的快照，内存分配失败返回 NULL
+ */
+static doc_snapshot *build_snapshot(const document *doc) {
+    size_t count = rope_chunk_count(doc->root);
+    const version_transform *previous = &doc->previous;
+    size_t shift_count = previous->valid ? previous->insert_count + previous->delete_count : 0;
+
+    // 快照头、iovec 数组、偏移数组、缓冲区数组和位置变换在同一次分配中
+    doc_snapshot *snapshot = (doc_snapshot *)malloc(sizeof(doc_snapshot) +
+                                                    count * (sizeof(struct iovec) + sizeof(size_t) + sizeof(text_block *)) +
+                                                    shift_count * sizeof(version_shift));
+    if (!snapshot) {
+        return NULL;
+    }
+
+    iovec_ctx ctx = { (struct iovec *)(snapshot + 1), NULL, count, 0, 0 };
+    size_t *offsets = (size_t *)(ctx.iov + count);
+    ctx.blocks = (text_block **)(offsets + count);
+    rope_walk(doc->root, collect_iovec, &ctx);
+
+    size_t offset = 0;
+    for (size_t i = 0; i < ctx.count; i++) {
+        offsets[i] = offset;
+        offset += ctx.iov[i].iov_len;
+    }
+
+    snapshot->version = doc->version;
+    snapshot->length = doc->total_length;
+    snapshot->refs = 1; // 文档持有的发布引用
+    snapshot->iov = ctx.iov;
+    snapshot->offsets = offsets;
+    snapshot->iov_count = ctx.count;
+    snapshot->blocks = ctx.blocks;
+    snapshot->block_count = ctx.block_count;
+
+    // 检查点需要上一版本的位置变换，恢复后才能重放基于上一版本的命令
+    memset(&snapshot->previous, 0, sizeof(snapshot->previous));
+    if (previous->valid) {
+        version_shift *shifts = (version_shift *)(ctx.blocks + count);
+        if (previous->insert_count > 0) {
+            memcpy(shifts, previous->inserts, previous->insert_count * sizeof(version_shift));
+        }
+        if (previous->delete_count > 0) {
+            memcpy(shifts + previous->insert_count, previous->deletes, previous->delete_count * sizeof(version_shift));
+        }
+        snapshot->previous.valid = 1;
+        snapshot->previous.length = previous->length;
+        snapshot->previous.inserts = shifts;
+        snapshot->previous.insert_count = previous->insert_count;
+        snapshot->previous.deletes = shifts + previous->insert_count;
+        snapshot->previous.delete_count = previous->delete_count;
+    }
+    return snapshot;
+}
+
+/**
+ * 原子地发布新版本的快照，替换之前发布的快照
+ * 换下的快照要等正在取得它的读者都增加了引用计数后，才释放文档持有的引用。
+ * 读者取得引用只需几条指令，写者只等待这段窗口，不会等待读者使用快照
+ * @param doc 文档指针
+ * @param snapshot 新快照，为 NULL（内存分配失败）时读者继续看到上一版本
+ */
+static void publish_snapshot(document *doc, doc_snapshot *snapshot) {
+    if (!snapshot) {
+        return;
+    }
+
+    doc_snapshot *old = __atomic_exchange_n(&doc->snapshot, snapshot, __ATOMIC_SEQ_CST);
+    if (!old) {
+        return;
+    }
+
+    // 切换读者纪元，等待在旧纪元登记的读者离开；之后登记的读者只能看到新快照
+    unsigned int epoch = __atomic_fetch_add(&doc->reader_epoch, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&doc->active_readers[epoch & 1], __ATOMIC_SEQ_CST) != 0) {
+        sched_yield();
+    }
+
+    markdown_release_snapshot(old);
+}
+
+/**
+ * 获取最近提交版本的只读快照，不加锁，可与更新线程的编辑和提交并发
+ * 每个版本只在提交时生成一次，之后的读者共享同一份快照；
+ * 调用者用完后调用 markdown_release_snapshot()
+ * @param doc 文档指针
+ * @return 快照指针，尚无已发布的快照时返回 NULL
+ */
+doc_snapshot *markdown_snapshot(document *doc) {
+    if (!doc) {
+        return NULL;
+    }
+
+    // 在当前纪元登记；登记期间纪元被切换则重试，保证写者等待时能看到本次登记
+    unsigned int epoch;
+    for (;;) {
+        epoch = __atomic_load_n(&doc->reader_epoch, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&doc->active_readers[epoch & 1], 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&doc->reader_epoch, __ATOMIC_SEQ_CST) == epoch) {
+            break;
+        }
+        __atomic_sub_fetch(&doc->active_readers[epoch & 1], 1, __ATOMIC_SEQ_CST);
+    }
+
+    doc_snapshot *snapshot = __atomic_load_n(&doc->snapshot, __ATOMIC_SEQ_CST);
+    if (snapshot) {
+        __atomic_add_fetch(&snapshot->refs, 1, __ATOMIC_RELAXED);
+    }
+
+    __atomic_sub_fetch(&doc->active_readers[epoch & 1], 1, __ATOMIC_SEQ_CST);
+    return snapshot;
+}
+
+/**
+ * 增加文档版本号
+ * @param doc 文档指针
+ */
+void markdown_increment_version(document *doc) {
+    if (!doc) {
+        return;
+    }
+
+    // 一次遍历应用本版本暂存的所有编辑
+    commit_staged_edits(doc);
+
+    doc->version++;
+
+    // 在版本边界上增量合并碎片化的小块
+    coalesce_chunks(doc);
+
+    // 为新版本生成一次快照并原子地发布，之后的读者共享这份快照直到下一个版本
+    publish_snapshot(doc, build_snapshot(doc));
+
+    // 将待处理的编辑命令整体移动到历史记录中，记为刚提交版本的历史段
+    commit_pending_edits(doc);
+}
+
+/**
+ * 计算已提交内容的校验和（多项式哈希），内容相同则校验和相同，与块的划分方式无关
+ * rope 节点缓存各自的哈希，每个版本只需重新计算被编辑改动的部分
+ * 暂存而未提交的编辑不计入
+ * @param doc 文档指针
+ * @return 校验和
+ */
+uint64_t markdown_checksum(document *doc) {
+    return doc ? rope_hash(doc->root) : 0;
+}
+
+/**
+ * 用已经放入块中的内容替换文档内容，丢弃本版本尚未提交的编辑，并发布新快照
+ * @param doc 文档指针
+ * @param version 内容对应的版本号
+ * @param loaded 内容所在的块，空文档为 NULL
+ * @param length 内容长度
+ * @return SUCCESS
+ */
+static int replace_content(document *doc, uint64_t version, chunk *loaded, size_t length) {
+    discard_staged_edits(doc);
+    rope_free(doc->root);
+    set_root(doc, loaded);
+    doc->total_length = length;
+    doc->version = version;
+    doc->compact_cursor = 0;
+    doc->previous.valid = 0; // 上一版本未知，只接受当前版本的编辑
+    publish_snapshot(doc, build_snapshot(doc));
+    return SUCCESS;
+}
+
+/**
+ * 把一段连续内容按 LOAD_PIECE_SIZE 切成多个引用它的片段，组成一棵 rope
+ * @param block 内容所在的缓冲区
+ * @param content 内容起始地址（位于 block 内）
+ * @param length 内容长度
+ * @return rope 根，内存分配失败返回 NULL
+ */
+static chunk *load_pieces(text_block *block, const char *content, size_t length) {
+    chunk *root = NULL;
+
+    for (size_t offset = 0; offset < length; offset += LOAD_PIECE_SIZE) {
+        size_t piece_length = length - offset < LOAD_PIECE_SIZE ? length - offset : LOAD_PIECE_SIZE;
+        chunk *piece = create_piece(block, content + offset, piece_length);
+        if (!piece) {
+            rope_free(root);
+            return NULL;
+        }
+        root = rope_append(root, piece);
+    }
+
+    return root;
+}
+
+/**
+ * 用已提交的内容替换文档内容，不经过暂存（用于客户端加载服务器发送的完整文档）
+ * 本版本尚未提交的编辑被丢弃
+ * @param doc 文档指针
+ * @param version 内容对应的版本号
+ * @param content 文档内容
+ * @param length 内容长度
+ * @return 成功返回 SUCCESS，内存分配失败返回 INVALID_CURSOR_POS
+ */
+int markdown_load(document *doc, uint64_t version, const char *content, size_t length) {
+    if (!doc || (!content && length > 0)) {
+        return INVALID_CURSOR_POS;
+    }
+
+    chunk *loaded = NULL;
+    if (length > 0) {
+        text_block *block = create_text_block(length);
+        if (!block) {
+            return INVALID_CURSOR_POS; // 内存分配失败
+        }
+
+        memcpy(block->data, content, length);
+        block->used = length;
+        loaded = load_pieces(block, block->data, length);
+        release_text_block(block); // 缓冲区只由各片段持有
+        if (!loaded) {
+            return INVALID_CURSOR_POS;
+        }
+    }
+
+    return replace_content(doc, version, loaded, length);
+}
+
+/**
+ * 把整个文件只读映射为一个文本缓冲区
+ * @param path 文件路径
+ * @param block 返回映射的缓冲区，空文件返回 NULL
+ * @return 成功返回 0，文件无法打开或映射时返回 -1
+ */
+static int map_file(const char *path, text_block **block) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return -1;
+    }
+
+    *block = NULL;
+    if (st.st_size > 0) {
+        *block = map_text_block(fd, (size_t)st.st_size);
+    }
+    close(fd); // 映射不依赖文件描述符
+
+    return st.st_size > 0 && !*block ? -1 : 0;
+}
+
+/**
+ * 用映射缓冲区中的一段内容替换文档内容，缓冲区的引用转交给各片段
+ */
+static int replace_with_mapped(document *doc, uint64_t version, text_block *block, const char *content, size_t length) {
+    if (length == 0) {
+        release_text_block(block);
+        return replace_content(doc, version, NULL, 0);
+    }
+
+    chunk *loaded = load_pieces(block, content, length);
+    release_text_block(block); // 映射只由各片段持有
+    if (!loaded) {
+        return INVALID_CURSOR_POS;
+    }
+
+    return replace_content(doc, version, loaded, length);
+}
+
+/**
+ * 用文件内容替换文档内容：文件只读映射为一个基础缓冲区，内容不复制，
+ * 文档由引用映射的片段组成，新内容写入其他缓冲区
+ * 文档持有映射期间文件不能被截断或原地改写（保存时应写入新文件后 rename）
+ * @param doc 文档指针
+ * @param version 内容对应的版本号
+ * @param path 文件路径
+ * @return 成功返回 SUCCESS，文件无法打开或映射时返回 INVALID_CURSOR_POS
+ */
+int markdown_load_file(document *doc, uint64_t version, const char *path) {
+    if (!doc || !path) {
+        return INVALID_CURSOR_POS;
+    }
+
+    text_block *block;
+    if (map_file(path, &block) != 0) {
+        return INVALID_CURSOR_POS;
+    }
+
+    return replace_with_mapped(doc, version, block, block ? block->data : NULL, block ? block->used : 0);
+}
+
+/**
+ * 解析检查点内容之后的上一版本位置变换，写入文档的变换数组（尚不标记为有效）
+ * @param doc 文档指针
+ * @param data 内容之后的部分（不以 '\0' 结尾）
+ * @param length 长度
+ * @return 成功返回 1，没有变换或格式不正确返回 0
+ */
+static int load_previous_transform(document *doc, const char *data, size_t length) {
+    char *text = (char *)malloc(length + 1);
+    if (!text) {
+        return 0;
+    }
+    memcpy(text, data, length);
+    text[length] = '\0';
+
+    version_transform *transform = &doc->previous;
+    size_t previous_length, insert_count, delete_count;
+    int consumed = 0;
+    int ok = sscanf(text, "PREVIOUS %zu %zu %zu\n%n", &previous_length, &insert_count, &delete_count, &consumed) == 3 &&
+             consumed > 0 &&
+             reserve_shifts(&transform->inserts, &transform->insert_capacity, insert_count) &&
+             reserve_shifts(&transform->deletes, &transform->delete_capacity, delete_count);
+
+    const char *cursor = text + consumed;
+    for (size_t i = 0; ok && i < insert_count + delete_count; i++) {
+        version_shift *shift = i < insert_count ? &transform->inserts[i] : &transform->deletes[i - insert_count];
+        int line = 0;
+        ok = sscanf(cursor, "%zu %zu %zu\n%n", &shift->start, &shift->end, &shift->total, &line) == 3 && line > 0;
+        cursor += line;
+    }
+
+    if (ok) {
+        transform->length = previous_length;
+        transform->insert_count = insert_count;
+        transform->delete_count = delete_count;
+    }
+
+    free(text);
+    return ok;
+}
+
+/**
+ * 从检查点文件恢复文档内容和版本号，内容与 markdown_load_file 一样只读映射而不复制
+ * 检查点由 markdown_write_checkpoint() 写出：一行 "CHECKPOINT <version> <length>"，随后是内容，
+ * 可能还有上一版本的位置变换；有变换时恢复后仍接受基于上一版本的命令
+ * @param doc 文档指针
+ * @param path 检查点文件路径
+ * @return 成功返回 SUCCESS，文件无法打开、映射或格式不正确时返回 INVALID_CURSOR_POS
+ */
+int markdown_load_checkpoint(document *doc, const char *path) {
+    if (!doc || !path) {
+        return INVALID_CURSOR_POS;
+    }
+
+    text_block *block;
+    if (map_file(path, &block) != 0 || !block) {
+        return INVALID_CURSOR_POS;
+    }
+
+    // 头部在映射中不以 '\0' 结尾，先复制出来再解析
+    char header[CHECKPOINT_HEADER_MAX];
+    const char *newline = memchr(block->data, '\n', block->used < sizeof(header) ? block->used : sizeof(header));
+    unsigned long version;
+    size_t length;
+    int consumed = 0;
+
+    if (newline) {
+        size_t header_len = (size_t)(newline - block->data);
+        memcpy(header, block->data, header_len);
+        header[header_len] = '\0';
+        if (sscanf(header, "CHECKPOINT %lu %zu%n", &version, &length, &consumed) != 2 ||
+            (size_t)consumed != header_len || block->used - header_len - 1 < length) {
+            consumed = 0;
+        }
+    }
+
+    if (consumed == 0) {
+        release_text_block(block);
+        return INVALID_CURSOR_POS;
+    }
+
+    // 变换在替换内容之前解析：空文档时映射在替换时即被释放
+    const char *trailer = newline + 1 + length;
+    size_t trailer_len = block->used - (size_t)(trailer - block->data);
+    int has_previous = trailer_len > 0 && load_previous_transform(doc, trailer, trailer_len);
+
+    int result = replace_with_mapped(doc, version, block, newline + 1, length);
+    if (result == SUCCESS && has_previous) {
+        doc->previous.valid = 1;
+        publish_snapshot(doc, build_snapshot(doc));
+    }
+    return result;
+}
@@ -0,0 +1,187 @@
+#include <stdlib.h>
+#include <string.h>
+#include "../libs/pool.h"
+
+// 对齐到指针大小（也满足 size_t / uint64_t 的对齐要求）
+#define POOL_ALIGN(size) (((size) + sizeof(void *) - 1) & ~(sizeof(void *) - 1))
+
+/**
+ * 从对象池分配一个对象，空闲链表为空时分配一个新的 slab
+ * @param pool 对象池
+ * @return 对象指针，内存分配失败返回 NULL
+ */
+void *slab_alloc(slab_pool *pool) {
+    if (!pool->free_list) {
+        size_t object_size = POOL_ALIGN(pool->object_size < sizeof(void *) ? sizeof(void *) : pool->object_size);
+        size_t header = POOL_ALIGN(sizeof(void *));
+
+        char *slab = (char *)malloc(header + object_size * pool->objects_per_slab);
+        if (!slab) {
+            return NULL;
+        }
+
+        // slab 头部记录下一个 slab，用于整体释放
+        *(void **)slab = pool->slabs;
+        pool->slabs = slab;
+        pool->slab_count++;
+
+        // 把新 slab 中的对象串入空闲链表
+        for (size_t i = pool->objects_per_slab; i > 0; i--) {
+            void *object = slab + header + (i - 1) * object_size;
+            *(void **)object = pool->free_list;
+            pool->free_list = object;
+        }
+    }
+
+    void *object = pool->free_list;
+    pool->free_list = *(void **)object;
+    pool->in_use++;
+    return object;
+}
+
+/**
+ * 把对象归还到对象池
+ * @param pool 对象池
+ * @param object 对象指针
+ */
+void slab_free(slab_pool *pool, void *object) {
+    if (!object) {
+        return;
+    }
+
+    *(void **)object = pool->free_list;
+    pool->free_list = object;
+    pool->in_use--;
+}
+
+/**
+ * 把一串已通过首字链接好的对象一次归还到对象池
+ * @param pool 对象池
+ * @param first 链表第一个对象
+ * @param last 链表最后一个对象
+ * @param count 对象数量
+ */
+void slab_free_chain(slab_pool *pool, void *first, void *last, size_t count) {
+    if (!first) {
+        return;
+    }
+
+    *(void **)last = pool->free_list;
+    pool->free_list = first;
+    pool->in_use -= count;
+}
+
+/**
+ * 释放对象池的所有 slab，池中的对象全部失效
+ * @param pool 对象池
+ */
+void slab_pool_destroy(slab_pool *pool) {
+    void *slab = pool->slabs;
+
+    while (slab) {
+        void *next = *(void **)slab;
+        free(slab);
+        slab = next;
+    }
+
+    pool->slabs = NULL;
+    pool->free_list = NULL;
+    pool->in_use = 0;
+    pool->slab_count = 0;
+}
+
+/**
+ * 初始化线性分配器
+ * @param a 分配器
+ * @param block_size 默认内存块大小
+ */
+void arena_init(arena *a, size_t block_size) {
+    a->head = NULL;
+    a->current = NULL;
+    a->block_size = block_size;
+}
+
+/**
+ * 从线性分配器分配内存
+ * @param a 分配器
+ * @param size 字节数
+ * @return 内存指针，内存分配失败返回 NULL
+ */
+void *arena_alloc(arena *a, size_t size) {
+    size = POOL_ALIGN(size);
+
+    // 在当前块及其后保留的块中寻找足够的空间
+    while (a->current && a->current->capacity - a->current->used < size) {
+        if (!a->current->next) {
+            break;
+        }
+        a->current = a->current->next;
+        a->current->used = 0;
+    }
+
+    if (!a->current || a->current->capacity - a->current->used < size) {
+        size_t capacity = size > a->block_size ? size : a->block_size;
+        arena_block *block = (arena_block *)malloc(sizeof(arena_block) + capacity);
+        if (!block) {
+            return NULL;
+        }
+
+        block->next = NULL;
+        block->capacity = capacity;
+        block->used = 0;
+
+        if (a->current) {
+            a->current->next = block;
+        } else {
+            a->head = block;
+        }
+        a->current = block;
+    }
+
+    void *ptr = a->current->data + a->current->used;
+    a->current->used += size;
+    return ptr;
+}
+
+/**
+ * 在线性分配器中复制字符串
+ * @param a 分配器
+ * @param str 字符串
+ * @return 复制后的字符串，内存分配失败返回 NULL
+ */
+char *arena_strdup(arena *a, const char *str) {
+    size_t len = strlen(str) + 1;
+    char *copy = (char *)arena_alloc(a, len);
+    if (copy) {
+        memcpy(copy, str, len);
+    }
+    return copy;
+}
+
+/**
+ * 重置线性分配器，一次性作废所有分配；内存块保留以便复用
+ * @param a 分配器
+ */
+void arena_reset(arena *a) {
+    a->current = a->head;
+    if (a->head) {
+        a->head->used = 0;
+    }
+}
+
+/**
+ * 释放线性分配器的所有内存块
+ * @param a 分配器
+ */
+void arena_destroy(arena *a) {
+    arena_block *block = a->head;
+
+    while (block) {
+        arena_block *next = block->next;
+        free(block);
+        block = next;
+    }
+
+    a->head = NULL;
+    a->current = NULL;
+}
@@ -0,0 +1,497 @@
+#include <string.h>
+#include "../libs/scan.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+// 一组扫描内核，按 CPU 支持整体选择
+typedef struct scan_kernels {
+    const char *name;
+    size_t (*count_newlines)(const char *data, size_t length);
+    size_t (*find_newline)(const char *data, size_t length);
+    size_t (*find_nth_newline)(const char *data, size_t length, size_t n);
+    size_t (*find_list_marker)(const char *data, size_t length);
+    int (*is_printable)(const char *data, size_t length);
+} scan_kernels;
+
+/**
+ * 统计换行符数量（标量实现）
+ * @param data 数据
+ * @param length 数据长度
+ * @return 换行符数量
+ */
+static size_t count_newlines_scalar(const char *data, size_t length) {
+    size_t count = 0;
+    const char *end = data + length;
+
+    while (data < end && (data = memchr(data, '\n', end - data))) {
+        count++;
+        data++;
+    }
+
+    return count;
+}
+
+/**
+ * 查找第一个换行符（标量实现）
+ * @param data 数据
+ * @param length 数据长度
+ * @return 换行符的偏移量，不存在时返回 length
+ */
+static size_t find_newline_scalar(const char *data, size_t length) {
+    const char *found = memchr(data, '\n', length);
+    return found ? (size_t)(found - data) : length;
+}
+
+/**
+ * 查找第 n 个换行符，从 1 开始计数（标量实现）
+ * @param data 数据
+ * @param length 数据长度
+ * @param n 序号
+ * @return 换行符的偏移量，不存在时返回 length
+ */
+static size_t find_nth_newline_scalar(const char *data, size_t length, size_t n) {
+    const char *cursor = data;
+    const char *end = data + length;
+
+    while (cursor < end && (cursor = memchr(cursor, '\n', end - cursor))) {
+        if (--n == 0) {
+            return cursor - data;
+        }
+        cursor++;
+    }
+
+    return length;
+}
+
+/**
+ * 查找第一个有序列表标记 "\nd. "（d 为 1-9）（标量实现）
+ * @param data 数据
+ * @param length 数据长度
+ * @return 标记中换行符的偏移量，不存在时返回 length
+ */
+static size_t find_list_marker_scalar(const char *data, size_t length) {
+    const char *cursor = data;
+    const char *end = data + length;
+
+    while (end - cursor >= 4 && (cursor = memchr(cursor, '\n', end - cursor - 3))) {
+        if (cursor[1] >= '1' && cursor[1] <= '9' && cursor[2] == '.' && cursor[3] == ' ') {
+            return cursor - data;
+        }
+        cursor++;
+    }
+
+    return length;
+}
+
+/**
+ * 检查数据是否全部为可打印 ASCII 字符（32-126）（标量实现）
+ * @param data 数据
+ * @param length 数据长度
+ * @return 1 如果是，0 如果不是
+ */
+static int is_printable_scalar(const char *data, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        unsigned char c = (unsigned char)data[i];
+        if (c < 32 || c > 126) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static const scan_kernels scalar_kernels = {
+    "scalar",
+    count_newlines_scalar,
+    find_newline_scalar,
+    find_nth_newline_scalar,
+    find_list_marker_scalar,
+    is_printable_scalar,
+};
+
+#ifdef SCAN_X86
+
+/**
+ * 统计换行符数量（SSE2 实现）
+ * 每个字节位置用 8 位计数器累加比较结果，最多 255 轮后用 psadbw 汇总一次
+ */
+__attribute__((target("sse2")))
+static size_t count_newlines_sse2(const char *data, size_t length) {
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i zero = _mm_setzero_si128();
+    size_t count = 0;
+    size_t i = 0;
+
+    while (length - i >= 16) {
+        size_t blocks = (length - i) / 16;
+        __m128i counters = zero;
+
+        if (blocks > 255) {
+            blocks = 255;
+        }
+
+        for (size_t b = 0; b < blocks; b++, i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+            counters = _mm_sub_epi8(counters, _mm_cmpeq_epi8(v, newline));
+        }
+
+        __m128i sums = _mm_sad_epu8(counters, zero);
+        count += (size_t)_mm_cvtsi128_si32(sums) + (size_t)_mm_extract_epi16(sums, 4);
+    }
+
+    return count + count_newlines_scalar(data + i, length - i);
+}
+
+/**
+ * 查找第一个换行符（SSE2 实现）
+ */
+__attribute__((target("sse2")))
+static size_t find_newline_sse2(const char *data, size_t length) {
+    const __m128i newline = _mm_set1_epi8('\n');
+    size_t i = 0;
+
+    for (; length - i >= 16; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, newline));
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+
+    return i + find_newline_scalar(data + i, length - i);
+}
+
+/**
+ * 查找第 n 个换行符（SSE2 实现）
+ */
+__attribute__((target("sse2")))
+static size_t find_nth_newline_sse2(const char *data, size_t length, size_t n) {
+    const __m128i newline = _mm_set1_epi8('\n');
+    size_t i = 0;
+
+    for (; length - i >= 16; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, newline));
+        while (mask) {
+            if (--n == 0) {
+                return i + __builtin_ctz(mask);
+            }
+            mask &= mask - 1;
+        }
+    }
+
+    return i + find_nth_newline_scalar(data + i, length - i, n);
+}
+
+/**
+ * 查找第一个有序列表标记 "\nd. "（SSE2 实现）
+ * 在偏移 0-3 处各加载一次，逐字节判断四个位置的条件
+ */
+__attribute__((target("sse2")))
+static size_t find_list_marker_sse2(const char *data, size_t length) {
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i dot = _mm_set1_epi8('.');
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i one = _mm_set1_epi8('1');
+    const __m128i eight = _mm_set1_epi8(8);
+    size_t i = 0;
+
+    for (; length - i >= 16 + 3; i += 16) {
+        __m128i v0 = _mm_loadu_si128((const __m128i *)(data + i));
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v0, newline));
+        if (!mask) {
+            continue;
+        }
+
+        __m128i v1 = _mm_loadu_si128((const __m128i *)(data + i + 1));
+        __m128i v2 = _mm_loadu_si128((const __m128i *)(data + i + 2));
+        __m128i v3 = _mm_loadu_si128((const __m128i *)(data + i + 3));
+
+        // 无符号比较 c - '1' <= 8 判断数字 1-9
+        __m128i digit = _mm_sub_epi8(v1, one);
+        __m128i is_digit = _mm_cmpeq_epi8(_mm_min_epu8(digit, eight), digit);
+        __m128i tail = _mm_and_si128(_mm_cmpeq_epi8(v2, dot), _mm_cmpeq_epi8(v3, space));
+
+        mask &= (unsigned)_mm_movemask_epi8(_mm_and_si128(is_digit, tail));
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+
+    return i + find_list_marker_scalar(data + i, length - i);
+}
+
+/**
+ * 检查数据是否全部为可打印 ASCII 字符（SSE2 实现）
+ * 有符号比较下 128-255 为负数，同样落在 32 以下
+ */
+__attribute__((target("sse2")))
+static int is_printable_sse2(const char *data, size_t length) {
+    const __m128i low = _mm_set1_epi8(32);
+    const __m128i high = _mm_set1_epi8(126);
+    size_t i = 0;
+
+    for (; length - i >= 16; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+        __m128i bad = _mm_or_si128(_mm_cmplt_epi8(v, low), _mm_cmpgt_epi8(v, high));
+        if (_mm_movemask_epi8(bad)) {
+            return 0;
+        }
+    }
+
+    return is_printable_scalar(data + i, length - i);
+}
+
+static const scan_kernels sse2_kernels = {
+    "sse2",
+    count_newlines_sse2,
+    find_newline_sse2,
+    find_nth_newline_sse2,
+    find_list_marker_sse2,
+    is_printable_sse2,
+};
+
+/**
+ * 统计换行符数量（AVX2 实现）
+ */
+__attribute__((target("avx2")))
+static size_t count_newlines_avx2(const char *data, size_t length) {
+    const __m256i newline = _mm256_set1_epi8('\n');
+    const __m256i zero = _mm256_setzero_si256();
+    size_t count = 0;
+    size_t i = 0;
+
+    while (length - i >= 32) {
+        size_t blocks = (length - i) / 32;
+        __m256i counters = zero;
+
+        if (blocks > 255) {
+            blocks = 255;
+        }
+
+        for (size_t b = 0; b < blocks; b++, i += 32) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(data + i));
+            counters = _mm256_sub_epi8(counters, _mm256_cmpeq_epi8(v, newline));
+        }
+
+        __m256i sums = _mm256_sad_epu8(counters, zero);
+        __m128i folded = _mm_add_epi64(_mm256_castsi256_si128(sums), _mm256_extracti128_si256(sums, 1));
+        count += (size_t)_mm_cvtsi128_si32(folded) + (size_t)_mm_extract_epi16(folded, 4);
+    }
+
+    return count + count_newlines_sse2(data + i, length - i);
+}
+
+/**
+ * 查找第一个换行符（AVX2 实现）
+ */
+__attribute__((target("avx2")))
+static size_t find_newline_avx2(const char *data, size_t length) {
+    const __m256i newline = _mm256_set1_epi8('\n');
+    size_t i = 0;
+
+    for (; length - i >= 32; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(data + i));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, newline));
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+
+    return i + find_newline_sse2(data + i, length - i);
+}
+
+/**
+ * 查找第 n 个换行符（AVX2 实现），整块跳过换行符不足 n 个的 32 字节
+ */
+__attribute__((target("avx2,popcnt")))
+static size_t find_nth_newline_avx2(const char *data, size_t length, size_t n) {
+    const __m256i newline = _mm256_set1_epi8('\n');
+    size_t i = 0;
+
+    for (; length - i >= 32; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(data + i));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, newline));
+        size_t found = (size_t)__builtin_popcount(mask);
+
+        if (found < n) {
+            n -= found;
+            continue;
+        }
+
+        while (--n > 0) {
+            mask &= mask - 1;
+        }
+        return i + __builtin_ctz(mask);
+    }
+
+    return i + find_nth_newline_sse2(data + i, length - i, n);
+}
+
+/**
+ * 查找第一个有序列表标记 "\nd. "（AVX2 实现）
+ */
+__attribute__((target("avx2")))
+static size_t find_list_marker_avx2(const char *data, size_t length) {
+    const __m256i newline = _mm256_set1_epi8('\n');
+    const __m256i dot = _mm256_set1_epi8('.');
+    const __m256i space = _mm256_set1_epi8(' ');
+    const __m256i one = _mm256_set1_epi8('1');
+    const __m256i eight = _mm256_set1_epi8(8);
+    size_t i = 0;
+
+    for (; length - i >= 32 + 3; i += 32) {
+        __m256i v0 = _mm256_loadu_si256((const __m256i *)(data + i));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v0, newline));
+        if (!mask) {
+            continue;
+        }
+
+        __m256i v1 = _mm256_loadu_si256((const __m256i *)(data + i + 1));
+        __m256i v2 = _mm256_loadu_si256((const __m256i *)(data + i + 2));
+        __m256i v3 = _mm256_loadu_si256((const __m256i *)(data + i + 3));
+
+        __m256i digit = _mm256_sub_epi8(v1, one);
+        __m256i is_digit = _mm256_cmpeq_epi8(_mm256_min_epu8(digit, eight), digit);
+        __m256i tail = _mm256_and_si256(_mm256_cmpeq_epi8(v2, dot), _mm256_cmpeq_epi8(v3, space));
+
+        mask &= (unsigned)_mm256_movemask_epi8(_mm256_and_si256(is_digit, tail));
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+
+    return i + find_list_marker_sse2(data + i, length - i);
+}
+
+/**
+ * 检查数据是否全部为可打印 ASCII 字符（AVX2 实现）
+ */
+__attribute__((target("avx2")))
+static int is_printable_avx2(const char *data, size_t length) {
+    const __m256i low = _mm256_set1_epi8(32);
+    const __m256i high = _mm256_set1_epi8(126);
+    size_t i = 0;
+
+    for (; length - i >= 32; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(data + i));
+        __m256i bad = _mm256_or_si256(_mm256_cmpgt_epi8(low, v), _mm256_cmpgt_epi8(v, high));
+        if (_mm256_movemask_epi8(bad)) {
+            return 0;
+        }
+    }
+
+    return is_printable_sse2(data + i, length - i);
+}
+
+static const scan_kernels avx2_kernels = {
+    "avx2",
+    count_newlines_avx2,
+    find_newline_avx2,
+    find_nth_newline_avx2,
+    find_list_marker_avx2,
+    is_printable_avx2,
+};
+
+#endif
+
+// 当前使用的内核，首次调用时选择（多个线程同时选择时结果相同）
+static const scan_kernels *active_kernels = NULL;
+
+/**
+ * 按 CPU 支持选择内核
+ * @return 内核
+ */
+static const scan_kernels *select_kernels(void) {
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")) {
+        return &avx2_kernels;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return &sse2_kernels;
+    }
+#endif
+    return &scalar_kernels;
+}
+
+/**
+ * 获取当前使用的内核
+ * @return 内核
+ */
+static const scan_kernels *kernels(void) {
+    const scan_kernels *current = __atomic_load_n(&active_kernels, __ATOMIC_ACQUIRE);
+
+    if (!current) {
+        current = select_kernels();
+        __atomic_store_n(&active_kernels, current, __ATOMIC_RELEASE);
+    }
+
+    return current;
+}
+
+/**
+ * 统计数据中换行符的数量
+ * @param data 数据
+ * @param length 数据长度
+ * @return 换行符数量
+ */
+size_t scan_count_newlines(const char *data, size_t length) {
+    return kernels()->count_newlines(data, length);
+}
+
+/**
+ * 查找数据中第一个换行符
+ * @param data 数据
+ * @param length 数据长度
+ * @return 换行符的偏移量，不存在时返回 length
+ */
+size_t scan_find_newline(const char *data, size_t length) {
+    return kernels()->find_newline(data, length);
+}
+
+/**
+ * 查找数据中第 n 个换行符（从 1 开始计数）
+ * @param data 数据
+ * @param length 数据长度
+ * @param n 序号
+ * @return 换行符的偏移量，不存在时返回 length
+ */
+size_t scan_find_nth_newline(const char *data, size_t length, size_t n) {
+    if (n == 0) {
+        return length;
+    }
+
+    return kernels()->find_nth_newline(data, length, n);
+}
+
+/**
+ * 查找数据中第一个有序列表标记 "\nd. "（d 为 1-9），标记必须完整位于数据内
+ * @param data 数据
+ * @param length 数据长度
+ * @return 标记中换行符的偏移量，不存在时返回 length
+ */
+size_t scan_find_list_marker(const char *data, size_t length) {
+    return kernels()->find_list_marker(data, length);
+}
+
+/**
+ * 检查数据是否全部为可打印 ASCII 字符（32-126），用于校验命令
+ * @param data 数据
+ * @param length 数据长度
+ * @return 1 如果是，0 如果不是
+ */
+int scan_is_printable(const char *data, size_t length) {
+    return kernels()->is_printable(data, length);
+}
+
+/**
+ * 获取当前使用的内核名称
+ * @return "avx2"、"sse2" 或 "scalar"
+ */
+const char *scan_kernel_name(void) {
+    return kernels()->name;
+}
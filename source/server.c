@@ -11,11 +11,23 @@
 #include <errno.h>
 #include "../libs/document.h"
 #include "../libs/markdown.h"
+#include "../libs/pool.h"
+#include "../libs/scan.h"
+#include "../libs/command.h"
+#include "../libs/history.h"
+#include "../libs/wal.h"
 
 #define MAX_USERNAME_LEN 64
 #define MAX_COMMAND_LEN 256
 #define MAX_CLIENTS 10
 #define FIFO_PERM 0666
+#define COMMAND_ARENA_BLOCK (64 * 1024)
+#define HISTORY_ARCHIVE "doc.history"
+#define DEFAULT_HISTORY_VERSIONS 64
+#define WAL_FILE "doc.wal"
+#define CHECKPOINT_FILE "doc.checkpoint"
+#define WAL_OLD_FILE "doc.wal.old"
+#define DEFAULT_CHECKPOINT_VERSIONS 1000
 
 // 客户端角色
 typedef enum {
@@ -43,46 +55,67 @@ typedef struct command_node {
     struct command_node *next;
 } command_node;
 
-// 命令日志条目
-typedef struct {
-    uint64_t version;
-    char **entries;
-    size_t count;
-    size_t capacity;
-} version_log;
-
-// 命令日志
-typedef struct {
-    version_log *versions;
-    size_t count;
-    size_t capacity;
-} command_log;
-
 // 全局变量
 static document doc;
 static client_info clients[MAX_CLIENTS];
 static int client_count = 0;
 static pthread_mutex_t client_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_mutex_t doc_mutex = PTHREAD_MUTEX_INITIALIZER;
 static command_node *command_queue = NULL;
+static command_node *command_queue_tail = NULL;
 static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+// 命令节点的双缓冲 arena：一个接收新命令，另一个属于正在处理的一轮，处理完后整体重置
+static arena command_arenas[2];
+static int active_arena = 0;
 static int update_interval_ms;
 static int server_running = 1;
-static command_log log = {NULL, 0, 0};
-static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int terminal_request = COMMAND_COUNT; // 终端请求的 STATS 或 LOG?，由更新线程在下一轮输出（原子操作）
+static int broadcast_checksum = 0; // VERSION 行是否附带提交后文档的校验和（-c）
+static history_archive archive = {-1, -1, 0, 0, 0};
+static wal wal_log = {-1, 0, 0, 0};
+static int persistent = 0; // 是否启用预写日志、检查点和崩溃恢复（-w）
+static uint64_t checkpoint_versions = DEFAULT_CHECKPOINT_VERSIONS; // 每隔多少个版本写一次检查点
+static uint64_t checkpoint_version = 0; // 最近一次请求检查点时的版本号
+
+// 后台检查点线程：更新线程交给它一个快照引用，写文件、fsync 和 rename 都在更新线程之外进行
+static pthread_mutex_t checkpoint_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t checkpoint_cond = PTHREAD_COND_INITIALIZER;
+static doc_snapshot *checkpoint_request = NULL; // 等待写出的快照
+static int checkpoint_busy = 0;                 // 有检查点请求尚未完成（旧日志仍存在）
+static int checkpoint_retry = 0;                // 上一个检查点失败，下次请求不再轮换日志
+static int checkpoint_stop = 0;
+
+// 更新线程在两轮之间的间隔中等待停止请求，退出时当前一轮（追加日志、轮换日志、写归档）总是完整结束
+static pthread_mutex_t update_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t update_cond = PTHREAD_COND_INITIALIZER;
+static int update_stop = 0;
+
+// 检查点指标，受 checkpoint_mutex 保护
+typedef struct {
+    size_t written;        // 成功写出的检查点数
+    size_t failed;         // 失败的检查点数
+    uint64_t last_version; // 最近一次成功的检查点版本
+    size_t last_bytes;     // 最近一次检查点文件大小
+    double last_ms;        // 最近一次检查点耗时（毫秒）
+    double max_ms;         // 最长耗时（毫秒）
+} checkpoint_metrics;
+static checkpoint_metrics checkpoint_stats = {0, 0, 0, 0, 0, 0};
 
 // 函数声明
 void handle_signal(int sig, siginfo_t *info, void *ucontext);
 void *client_handler(void *arg);
 void *update_thread(void *arg);
+int wait_update_interval();
 client_role get_user_role(const char *username);
-void process_command(const char *username, const char *command);
-void broadcast_update(int version_changed);
-void save_document();
+int prepare_command(const char *username, const char *command, parsed_cmd *parsed);
+void broadcast_update(uint64_t version);
+void print_stats();
+int save_document();
+int write_checkpoint(const doc_snapshot *snapshot, size_t *bytes);
+int checkpoint_document();
+void request_checkpoint();
+void *checkpoint_thread(void *arg);
 void cleanup_resources();
 void handle_client_disconnect(int client_index);
-int parse_command(const char *command, char *cmd_type, size_t *pos1, size_t *pos2, char *content, int *level, uint64_t *version);
-void add_log_entry(uint64_t version, const char *entry);
 void print_command_log();
 
 /**
@@ -150,20 +183,95 @@ void handle_signal(int sig, siginfo_t *info, void *ucontext) {
  */
 int main(int argc, char *argv[]) {
     // 检查命令行参数
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <update_interval_ms>\n", argv[0]);
+    // -k 为内存中保留的编辑历史版本数，更早的版本写入归档，0 表示全部保留在内存中
+    // -w 启用预写日志（doc.wal）、检查点（doc.checkpoint）和崩溃后的恢复，默认不在工作目录留下恢复用的状态；
+    // 启用时 -s 为每轮追加预写日志后 fdatasync，-p 为检查点之间的版本数
+    int option;
+    long history_versions = DEFAULT_HISTORY_VERSIONS;
+    int wal_sync = 0;
+    while ((option = getopt(argc, argv, "ck:wsp:")) != -1) {
+        if (option == 'c') {
+            broadcast_checksum = 1;
+        } else if (option == 'w') {
+            persistent = 1;
+        } else if (option == 's') {
+            wal_sync = 1;
+        } else if (option == 'k' && (history_versions = atol(optarg)) >= 0) {
+            continue;
+        } else if (option == 'p' && atol(optarg) > 0) {
+            checkpoint_versions = (uint64_t)atol(optarg);
+        } else {
+            fprintf(stderr, "Usage: %s [-c] [-k history_versions] [-w [-s] [-p checkpoint_versions]] <update_interval_ms> [document_file]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    int remaining = argc - optind;
+    if (remaining != 1 && remaining != 2) {
+        fprintf(stderr, "Usage: %s [-c] [-k history_versions] [-w [-s] [-p checkpoint_versions]] <update_interval_ms> [document_file]\n", argv[0]);
         return 1;
     }
+    const char *document_file = remaining == 2 ? argv[optind + 1] : NULL;
 
     // 解析更新间隔
-    update_interval_ms = atoi(argv[1]);
+    update_interval_ms = atoi(argv[optind]);
     if (update_interval_ms <= 0) {
         fprintf(stderr, "Error: update interval must be a positive integer\n");
         return 1;
     }
 
-    // 初始化文档
+    // 初始化文档，服务器使用片段表存储以减少更新线程中的内存分配
     markdown_init(&doc);
+    markdown_set_storage_mode(&doc, STORAGE_PIECE_TABLE);
+
+    // 指定了文档文件时（如上次保存的 doc.md），把它只读映射为初始文档，内容不复制，丢弃之前的检查点和日志；
+    // 否则启用 -w 时从崩溃留下的检查点恢复，之后再重放预写日志
+    if (document_file && markdown_load_file(&doc, 0, document_file) != SUCCESS) {
+        fprintf(stderr, "Error: cannot load document file %s\n", document_file);
+        return 1;
+    }
+    int recovering = persistent && !document_file && access(CHECKPOINT_FILE, F_OK) == 0;
+    if (recovering && markdown_load_checkpoint(&doc, CHECKPOINT_FILE) != SUCCESS) {
+        fprintf(stderr, "Error: cannot load checkpoint %s\n", CHECKPOINT_FILE);
+        return 1;
+    }
+
+    // 旧版本的编辑历史移到只追加的归档中，服务器的内存不随运行时间增长；
+    // 从检查点恢复时保留上次运行的归档，重新开始时清空
+    if (history_versions > 0) {
+        if (history_archive_open(&archive, HISTORY_ARCHIVE, !recovering) != 0) {
+            fprintf(stderr, "Error: cannot create history archive %s\n", HISTORY_ARCHIVE);
+            return 1;
+        }
+        markdown_set_history_limit(&doc, (size_t)history_versions, &archive);
+    }
+
+    // 重放检查点之后的日志记录，恢复时间只取决于日志长度
+    if (persistent && !document_file) {
+        // 上次运行的后台检查点未完成时旧日志仍在，先于当前日志重放；已在检查点中的版本被跳过
+        uint64_t checkpoint = doc.version;
+        long replayed_old = wal_replay(WAL_OLD_FILE, &doc);
+        long replayed = wal_replay(WAL_FILE, &doc);
+        if (replayed_old < 0 || replayed < 0) {
+            fprintf(stderr, "Error: cannot read write-ahead log %s\n", WAL_FILE);
+            return 1;
+        }
+        replayed += replayed_old;
+        if (checkpoint > 0 || replayed > 0) {
+            // 写到 stderr：stdout 的第一行必须是 PID
+            fprintf(stderr, "Recovered version %lu (checkpoint %lu, %ld versions replayed)\n", doc.version, checkpoint, replayed);
+        }
+    }
+
+    // 启用 -w 时恢复出的状态先写成新的检查点，之后每个提交的版本在广播前追加到清空的预写日志
+    if (persistent && (wal_open(&wal_log, WAL_FILE, wal_sync) != 0 || checkpoint_document() != 0)) {
+        fprintf(stderr, "Error: cannot open write-ahead log %s\n", WAL_FILE);
+        return 1;
+    }
+
+    // 初始化命令队列的 arena
+    arena_init(&command_arenas[0], COMMAND_ARENA_BLOCK);
+    arena_init(&command_arenas[1], COMMAND_ARENA_BLOCK);
 
     // 初始化客户端数组
     for (int i = 0; i < MAX_CLIENTS; i++) {
@@ -183,7 +291,12 @@ int main(int argc, char *argv[]) {
     // 打印服务器PID
     printf("Server PID: %d\n", getpid());
 
-    // 创建更新线程
+    // 创建检查点线程和更新线程
+    pthread_t checkpoint_tid;
+    if (pthread_create(&checkpoint_tid, NULL, checkpoint_thread, NULL) != 0) {
+        return 1;
+    }
+
     pthread_t update_tid;
     if (pthread_create(&update_tid, NULL, update_thread, NULL) != 0) {
         return 1;
@@ -200,7 +313,8 @@ int main(int argc, char *argv[]) {
             }
 
             // 处理服务器命令
-            if (strcmp(command, "QUIT") == 0) {
+            const command_desc *desc = command_lookup(command, strlen(command));
+            if (desc && desc->id == COMMAND_QUIT) {
                 // 检查是否有客户端连接
                 pthread_mutex_lock(&client_mutex);
                 int connected_clients = 0;
@@ -216,16 +330,41 @@ int main(int argc, char *argv[]) {
                     server_running = 0;
                 }
                 pthread_mutex_unlock(&client_mutex);
+            } else if (desc && (desc->id == COMMAND_STATS || desc->id == COMMAND_LOG)) {
+                // 文档只由更新线程访问，交给它在下一轮输出
+                __atomic_store_n(&terminal_request, (int)desc->id, __ATOMIC_RELEASE);
             }
         }
     }
 
-    // 等待更新线程结束
-    pthread_cancel(update_tid);
+    // 通知更新线程在当前一轮结束后退出，并等待它结束
+    pthread_mutex_lock(&update_mutex);
+    update_stop = 1;
+    pthread_cond_signal(&update_cond);
+    pthread_mutex_unlock(&update_mutex);
     pthread_join(update_tid, NULL);
 
-    // 保存文档并清理资源
-    save_document();
+    // 等待进行中的后台检查点完成
+    pthread_mutex_lock(&checkpoint_mutex);
+    checkpoint_stop = 1;
+    pthread_cond_signal(&checkpoint_cond);
+    pthread_mutex_unlock(&checkpoint_mutex);
+    pthread_join(checkpoint_tid, NULL);
+
+    // 正常退出时文档保存到 doc.md 后删除检查点、日志和历史归档，下次启动是新文档，只有崩溃后才会恢复；
+    // 启用 -w 且保存失败时改写最终的检查点（之后日志为空），连同归档留给下次启动恢复
+    int saved = save_document() == 0;
+    if (persistent && !saved) {
+        checkpoint_document();
+    } else {
+        if (persistent) {
+            unlink(CHECKPOINT_FILE);
+            unlink(WAL_FILE);
+            unlink(WAL_OLD_FILE);
+        }
+        unlink(HISTORY_ARCHIVE);
+        unlink(HISTORY_ARCHIVE ".idx");
+    }
     cleanup_resources();
 
     return 0;
@@ -353,25 +492,23 @@ void *client_handler(void *arg) {
         const char *role_str = (role == ROLE_READ) ? "read\n" : "write\n";
         write(s2c_fd, role_str, strlen(role_str));
 
+        // 无锁获取最近提交版本的共享快照，版本号与内容来自同一版本
+        doc_snapshot *snapshot = markdown_snapshot(&doc);
+
         // 发送文档版本号
         char version_str[32];
-        snprintf(version_str, sizeof(version_str), "%lu\n", doc.version);
+        snprintf(version_str, sizeof(version_str), "%lu\n", snapshot ? snapshot->version : doc.version);
         write(s2c_fd, version_str, strlen(version_str));
 
-        // 发送文档内容
-        pthread_mutex_lock(&doc_mutex);
-        char *content = markdown_flatten(&doc);
-        pthread_mutex_unlock(&doc_mutex);
-
-        if (content) {
+        if (snapshot) {
             // 发送文档长度
             char length_str[32];
-            snprintf(length_str, sizeof(length_str), "%zu\n", strlen(content));
+            snprintf(length_str, sizeof(length_str), "%zu\n", snapshot->length);
             write(s2c_fd, length_str, strlen(length_str));
 
-            // 发送文档内容
-            write(s2c_fd, content, strlen(content));
-            free(content);
+            // 直接从块内存 writev 文档内容
+            markdown_write_snapshot(snapshot, s2c_fd);
+            markdown_release_snapshot(snapshot);
         } else {
             // 空文档
             write(s2c_fd, "0\n", 2);
@@ -428,56 +565,93 @@ void *client_handler(void *arg) {
 
         command[bytes_read] = '\0';
 
-        // 处理命令
-        if (strncmp(command, "DISCONNECT", 10) == 0) {
-            break;
-        } else if (strncmp(command, "DOC?", 4) == 0) {
-            // 发送文档内容和版本号
-            pthread_mutex_lock(&doc_mutex);
-            char *content = markdown_flatten(&doc);
-            uint64_t current_version = doc.version;
-            pthread_mutex_unlock(&doc_mutex);
-
-            // 先发送版本号
-            char version_str[32];
-            snprintf(version_str, sizeof(version_str), "%lu\n", current_version);
-            write(s2c_fd, version_str, strlen(version_str));
-
-            if (content) {
-                write(s2c_fd, content, strlen(content));
-                printf("send content: %s\n", content);
-                write(s2c_fd, "\n", 1);
-                free(content);
-            } else {
-                write(s2c_fd, "\n", 1);
+        // 一次读取可能包含多条以换行符结尾的命令，逐条处理（最后一条可以没有换行符）
+        int disconnected = 0;
+        size_t offset = 0;
+        while (offset < (size_t)bytes_read) {
+            char *line = command + offset;
+            size_t line_length = scan_find_newline(line, bytes_read - offset);
+            line[line_length] = '\0';
+            offset += line_length + 1;
+
+            if (line_length == 0) {
+                continue;
             }
-        } else if (strncmp(command, "PERM?", 5) == 0) {
-            // 发送权限信息
-            const char *role_str = (role == ROLE_READ) ? "read\n" : "write\n";
-            write(s2c_fd, role_str, strlen(role_str));
-        } else {
-            // 添加命令到队列
-            command_node *new_node = (command_node *)malloc(sizeof(command_node));
-            if (new_node) {
-                strncpy(new_node->username, username, MAX_USERNAME_LEN - 1);
-                new_node->username[MAX_USERNAME_LEN - 1] = '\0';
-                strncpy(new_node->command, command, MAX_COMMAND_LEN - 1);
-                new_node->command[MAX_COMMAND_LEN - 1] = '\0';
-                new_node->timestamp = time(NULL);
-                new_node->next = NULL;
-
-                // 添加到队列末尾
-                if (!command_queue) {
-                    command_queue = new_node;
+
+            // 本地处理的命令按描述表分派，其余命令进入队列
+            const command_desc *desc = command_lookup(line, strcspn(line, " "));
+            command_id id = desc ? desc->id : COMMAND_COUNT;
+
+            if (id == COMMAND_DISCONNECT) {
+                disconnected = 1;
+                break;
+            } else if (id == COMMAND_DOC && line_length > desc->length) {
+                // DOC? <start> <len>：只发送一段内容，大文档可以分页读取
+                // 回复 "<version> <start> <length>\n"，随后是恰好 length 字节的内容和换行符
+                // 起点超出文档时回复 "Reject INVALID_POSITION"；长度超出文档末尾时截断，读到最后一页为止
+                parsed_cmd range;
+                doc_snapshot *snapshot = markdown_snapshot(&doc);
+                if (command_parse(line, &range) && snapshot && range.pos1 <= snapshot->length) {
+                    size_t start = range.pos1;
+                    size_t length = range.pos2 < snapshot->length - start ? range.pos2 : snapshot->length - start;
+
+                    char header[96];
+                    int header_len = snprintf(header, sizeof(header), "%lu %zu %zu\n", snapshot->version, start, length);
+                    write(s2c_fd, header, header_len);
+                    markdown_write_snapshot_range(snapshot, start, length, s2c_fd);
+                    write(s2c_fd, "\n", 1);
                 } else {
-                    command_node *current = command_queue;
-                    while (current->next) {
-                        current = current->next;
+                    char reject[64];
+                    int reject_len = snprintf(reject, sizeof(reject), "Reject %s\n", command_status_reason(INVALID_CURSOR_POS));
+                    write(s2c_fd, reject, reject_len);
+                }
+                markdown_release_snapshot(snapshot);
+            } else if (id == COMMAND_DOC) {
+                // 与连接时相同：版本号一行，长度一行，随后是恰好该长度的文档内容，
+                // 客户端按长度读取，内容中的换行符不影响解析
+                doc_snapshot *snapshot = markdown_snapshot(&doc);
+                uint64_t current_version = snapshot ? snapshot->version : doc.version;
+
+                char header[64];
+                int header_len = snprintf(header, sizeof(header), "%lu\n%zu\n", current_version,
+                                          snapshot ? snapshot->length : 0);
+                write(s2c_fd, header, header_len);
+
+                if (snapshot) {
+                    markdown_write_snapshot(snapshot, s2c_fd);
+                    markdown_release_snapshot(snapshot);
+                }
+            } else if (id == COMMAND_PERM) {
+                // 发送权限信息
+                const char *role_str = (role == ROLE_READ) ? "read\n" : "write\n";
+                write(s2c_fd, role_str, strlen(role_str));
+            } else {
+                // 添加命令到队列，节点分配在本轮的 arena 中
+                pthread_mutex_lock(&queue_mutex);
+                command_node *new_node = (command_node *)arena_alloc(&command_arenas[active_arena], sizeof(command_node));
+                if (new_node) {
+                    strncpy(new_node->username, username, MAX_USERNAME_LEN - 1);
+                    new_node->username[MAX_USERNAME_LEN - 1] = '\0';
+                    strncpy(new_node->command, line, MAX_COMMAND_LEN - 1);
+                    new_node->command[MAX_COMMAND_LEN - 1] = '\0';
+                    new_node->timestamp = time(NULL);
+                    new_node->next = NULL;
+
+                    // 添加到队列末尾
+                    if (!command_queue) {
+                        command_queue = new_node;
+                    } else {
+                        command_queue_tail->next = new_node;
                     }
-                    current->next = new_node;
+                    command_queue_tail = new_node;
                 }
+                pthread_mutex_unlock(&queue_mutex);
             }
         }
+
+        if (disconnected) {
+            break;
+        }
     }
 
     // 关闭连接
@@ -490,19 +664,43 @@ void *client_handler(void *arg) {
     return NULL;
 }
 
+/**
+ * 等待一个更新间隔，期间可以被停止请求唤醒
+ * @return 间隔正常结束返回 1，收到停止请求返回 0
+ */
+int wait_update_interval() {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += update_interval_ms / 1000;
+    deadline.tv_nsec += (long)(update_interval_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&update_mutex);
+    int result = 0;
+    while (!update_stop && result != ETIMEDOUT) {
+        result = pthread_cond_timedwait(&update_cond, &update_mutex, &deadline);
+    }
+    int running = !update_stop;
+    pthread_mutex_unlock(&update_mutex);
+    return running;
+}
+
 /**
  * 更新线程，定期处理命令队列并广播更新
  */
 void *update_thread(void *arg) {
     (void)arg; // 未使用的参数
 
-    while (server_running) {
-        // 等待指定的更新间隔
-        usleep(update_interval_ms * 1000);
+    // 等待指定的更新间隔，收到停止请求时退出
+    while (wait_update_interval()) {
 
         // 处理命令队列
         int version_changed = 0;
         command_node *command_list = NULL; // 用于临时存储命令队列
+        int tick_arena;
 
         pthread_mutex_lock(&queue_mutex);
         // 按时间戳排序命令
@@ -551,37 +749,67 @@ void *update_thread(void *arg) {
             // 保存排序后的命令队列，并清空全局队列
             command_list = command_queue;
             command_queue = NULL;
+            command_queue_tail = NULL;
+        }
+
+        // 切换 arena：新到达的命令写入另一个 arena，本轮的节点在处理完后整体释放
+        tick_arena = active_arena;
+        active_arena = 1 - active_arena;
+        pthread_mutex_unlock(&queue_mutex);
+
+        // 把本轮命令解析为一个批次，整批交给文档执行
+        size_t batch_capacity = 0;
+        for (command_node *current = command_list; current; current = current->next) {
+            batch_capacity++;
+        }
+
+        parsed_cmd *batch = NULL;
+        size_t batch_count = 0;
+        if (batch_capacity > 0) {
+            batch = (parsed_cmd *)arena_alloc(&command_arenas[tick_arena], batch_capacity * sizeof(parsed_cmd));
         }
-        // 处理命令
-        if (command_list) {
-            command_node *current = command_list;
-            command_node *next;
-
-            while (current) {
-                // 处理命令
-                process_command(current->username, current->command);
-                version_changed = 1;
-
-                next = current->next;
-                free(current);
-                current = next;
+        for (command_node *current = command_list; batch && current; current = current->next) {
+            if (prepare_command(current->username, current->command, &batch[batch_count])) {
+                batch_count++;
             }
+        }
 
-            // 如果有命令被处理，先广播更新，再增加文档版本号
-            if (version_changed) {
-                pthread_mutex_unlock(&queue_mutex);
+        if (batch_count > 0) {
+            markdown_apply_batch(&doc, batch, batch_count);
+            version_changed = doc.pending_edits != NULL;
+        }
 
-                // 广播更新（函数内部会自己获取锁）
-                broadcast_update(version_changed);
+        // 如果有命令被处理，先提交本轮编辑，再广播，使校验和对应提交后的内容
+        if (version_changed) {
+            uint64_t broadcast_version = doc.version;
 
-                // 增加文档版本号
-                markdown_increment_version(&doc);
+            // 增加文档版本号，同时原子地发布新版本的快照
+            markdown_increment_version(&doc);
 
-                // 继续下一次循环
-                continue;
+            // 启用 -w 时本轮被接受的命令作为一条记录追加到预写日志，写入后才广播
+            const history_segment *segment = persistent ? find_history_segment(&doc, doc.version) : NULL;
+            if (segment && wal_append(&wal_log, broadcast_version, segment->first, segment->last) != 0) {
+                fprintf(stderr, "Error: cannot append version %lu to write-ahead log\n", broadcast_version);
+            }
+
+            // 广播本轮的编辑结果
+            broadcast_update(broadcast_version);
+
+            // 定期请求后台检查点，崩溃恢复只需重放最近的一段日志
+            if (persistent && doc.version - checkpoint_version >= checkpoint_versions) {
+                request_checkpoint();
             }
         }
-        pthread_mutex_unlock(&queue_mutex);
+
+        // 一次性释放本轮所有命令节点
+        arena_reset(&command_arenas[tick_arena]);
+
+        int request = __atomic_exchange_n(&terminal_request, COMMAND_COUNT, __ATOMIC_ACQ_REL);
+        if (request == COMMAND_STATS) {
+            print_stats();
+        } else if (request == COMMAND_LOG) {
+            print_command_log();
+        }
     }
 
     return NULL;
@@ -627,99 +855,106 @@ client_role get_user_role(const char *username) {
 }
 
 /**
- * 处理客户端命令
+ * 把客户端命令解析为文档批处理命令
+ * 原始命令、INSERT 内容和 LINK 的 URL 都直接引用队列节点的内存，在本轮处理完后一起释放
+ * @param command 原始命令，可以以客户端所见的版本号开头
+ * @param command 原始命令
+ * @param parsed 输出的已解析命令
+ * @return 命令需要执行或记录时返回 1，用户未知或命令格式错误时返回 0
  */
-void process_command(const char *username, const char *command) {
+int prepare_command(const char *username, const char *command, parsed_cmd *parsed) {
     // 查找用户
-    int client_index = -1;
     client_role role = ROLE_NONE;
 
     for (int i = 0; i < MAX_CLIENTS; i++) {
         if (clients[i].connected && strcmp(clients[i].username, username) == 0) {
-            client_index = i;
             role = clients[i].role;
             break;
         }
     }
 
-    if (client_index == -1 || role == ROLE_NONE) {
-        return; // 用户不存在或未授权
+    if (role == ROLE_NONE) {
+        return 0; // 用户不存在或未授权
     }
 
-    // 解析命令
-    char cmd_type[32];
-    size_t pos1 = 0, pos2 = 0;
-    char content[MAX_COMMAND_LEN];
-    int level = 0;
-    uint64_t cmd_version = 0;
-
-    if (!parse_command(command, cmd_type, &pos1, &pos2, content, &level, &cmd_version)) {
-        return; // 命令格式错误
+    // 命令只能包含可打印 ASCII 字符
+    if (!scan_is_printable(command, strlen(command))) {
+        return 0;
     }
 
-    // 获取当前文档版本号用于执行命令
-    pthread_mutex_lock(&doc_mutex);
-    uint64_t current_version = doc.version;
-    pthread_mutex_unlock(&doc_mutex);
-
-    // 执行命令
-    // 只有写权限的用户才能修改文档
-    if (role != ROLE_WRITE &&
-        (strcmp(cmd_type, "INSERT") == 0 ||
-         strcmp(cmd_type, "DEL") == 0 ||
-         strcmp(cmd_type, "HEADING") == 0 ||
-         strcmp(cmd_type, "BOLD") == 0 ||
-         strcmp(cmd_type, "ITALIC") == 0 ||
-         strcmp(cmd_type, "BLOCKQUOTE") == 0 ||
-         strcmp(cmd_type, "ORDERED_LIST") == 0 ||
-         strcmp(cmd_type, "UNORDERED_LIST") == 0 ||
-         strcmp(cmd_type, "CODE") == 0 ||
-         strcmp(cmd_type, "HORIZONTAL_RULE") == 0 ||
-         strcmp(cmd_type, "LINK") == 0 ||
-         strcmp(cmd_type, "NEWLINE") == 0)) {
-        // 权限不足，创建一个状态为 UNAUTHORIZED 的命令
-        edit_command *cmd = create_command(CMD_INSERT, current_version, 0, 0, NULL, 0, username, command);
-        if (cmd) {
-            cmd->status = UNAUTHORIZED;
-            add_pending_edit(&doc, cmd);
+    // 命令前可以带客户端所见的版本号："<version> <command>"（命令名不以数字开头），
+    // 针对上一个版本的命令由文档映射到当前版本；不带版本号时按当前版本执行（文档只由更新线程修改）
+    uint64_t version = doc.version;
+    if (*command >= '0' && *command <= '9') {
+        char *version_end;
+        version = strtoull(command, &version_end, 10);
+        if (*version_end != ' ') {
+            return 0;
         }
-        return;
+        command = version_end + 1;
     }
 
-    if (strcmp(cmd_type, "INSERT") == 0) {
-        markdown_insert(&doc, current_version, pos1, content, username, command);
-    } else if (strcmp(cmd_type, "DEL") == 0) {
-        markdown_delete(&doc, current_version, pos1, pos2, username, command);
-    } else if (strcmp(cmd_type, "HEADING") == 0) {
-        markdown_heading(&doc, current_version, level, pos1, username, command);
-    } else if (strcmp(cmd_type, "BOLD") == 0) {
-        markdown_bold(&doc, current_version, pos1, pos2, username, command);
-    } else if (strcmp(cmd_type, "ITALIC") == 0) {
-        markdown_italic(&doc, current_version, pos1, pos2, username, command);
-    } else if (strcmp(cmd_type, "BLOCKQUOTE") == 0) {
-        markdown_blockquote(&doc, current_version, pos1, username, command);
-    } else if (strcmp(cmd_type, "ORDERED_LIST") == 0) {
-        markdown_ordered_list(&doc, current_version, pos1, username, command);
-    } else if (strcmp(cmd_type, "UNORDERED_LIST") == 0) {
-        markdown_unordered_list(&doc, current_version, pos1, username, command);
-    } else if (strcmp(cmd_type, "CODE") == 0) {
-        markdown_code(&doc, current_version, pos1, pos2, username, command);
-    } else if (strcmp(cmd_type, "HORIZONTAL_RULE") == 0) {
-        markdown_horizontal_rule(&doc, current_version, pos1, username, command);
-    } else if (strcmp(cmd_type, "LINK") == 0) {
-        markdown_link(&doc, current_version, pos1, pos2, content, username, command);
-    } else if (strcmp(cmd_type, "NEWLINE") == 0) {
-        markdown_newline(&doc, current_version, pos1, username, command);
+    // 解析命令，只有编辑命令进入批次
+    const command_desc *desc = command_parse(command, parsed);
+    if (!desc || !desc->needs_write) {
+        return 0; // 命令格式错误或不是编辑命令
     }
 
-    // 不再需要单独记录日志，因为我们现在使用 pending_edits
+    parsed->version = version;
+    parsed->username = username;
+    parsed->original_cmd = command;
+
+    // 只有写权限的用户才能修改文档，其余命令只记录为 UNAUTHORIZED
+    parsed->status = role == ROLE_WRITE ? SUCCESS : UNAUTHORIZED;
+
+    return 1;
+}
+
+/**
+ * 在终端输出文档的内存和碎片统计，由更新线程调用
+ */
+void print_stats() {
+    doc_stats stats;
+    markdown_stats(&doc, &stats);
+
+    printf("STATS version %lu\n", doc.version);
+    printf("content: %zu bytes, %zu bytes in text buffers, %zu bytes mapped\n",
+           stats.content_length, stats.content_bytes, stats.mapped_bytes);
+    printf("chunks: %zu, %zu bytes in headers, %zu bytes average\n",
+           stats.chunk_count, stats.chunk_bytes, markdown_average_chunk_size(&doc));
+
+    // 块大小直方图，每桶上限是前一桶的 4 倍
+    size_t low = 0;
+    size_t high = 16;
+    for (int i = 0; i < STATS_SIZE_BUCKETS; i++) {
+        if (i < STATS_SIZE_BUCKETS - 1) {
+            printf("  [%zu, %zu): %zu\n", low, high, stats.chunk_sizes[i]);
+        } else {
+            printf("  [%zu, ...): %zu\n", low, stats.chunk_sizes[i]);
+        }
+        low = high;
+        high *= 4;
+    }
+
+    printf("pending_edits: %zu commands, %zu bytes\n", stats.pending_count, stats.pending_bytes);
+    printf("edit_history: %zu commands, %zu bytes\n", stats.history_count, stats.history_bytes);
+    printf("allocations: %zu\n", stats.allocations);
+
+    pthread_mutex_lock(&checkpoint_mutex);
+    checkpoint_metrics checkpoints = checkpoint_stats;
+    pthread_mutex_unlock(&checkpoint_mutex);
+    printf("checkpoints: %zu written, %zu failed, last at version %lu: %zu bytes in %.3f ms (max %.3f ms)\n",
+           checkpoints.written, checkpoints.failed, checkpoints.last_version,
+           checkpoints.last_bytes, checkpoints.last_ms, checkpoints.max_ms);
+    fflush(stdout);
 }
 
 /**
  * 广播更新到所有客户端
+ * 在本轮编辑提交之后调用，编辑命令取自刚提交的历史段
+ * @param version 本轮编辑所基于的版本号，即提交前的版本号
  */
-void broadcast_update(int version_changed) {
-    (void)version_changed; // 标记参数为未使用
+void broadcast_update(uint64_t version) {
     // 构造广播消息
     char *message = NULL;
     size_t message_len = 0;
@@ -729,48 +964,18 @@ void broadcast_update(int version_changed) {
         return;
     }
 
-    // 版本号
-    fprintf(message_stream, "VERSION %lu\n", doc.version);
-
-    // 使用 pending_edits 构造广播消息
-    pthread_mutex_lock(&doc_mutex);
-    edit_command *cmd = doc.pending_edits;
-    // original_cmd 去除换行
-    char original_cmd[MAX_COMMAND_LEN];
-    strncpy(original_cmd, cmd->original_cmd, MAX_COMMAND_LEN - 1);
-    original_cmd[MAX_COMMAND_LEN - 1] = '\0';
-    if (original_cmd[strlen(original_cmd) - 1] == '\n') {
-        original_cmd[strlen(original_cmd) - 1] = '\0';
+    // 版本号；启用校验和时附带提交后文档的内容哈希，客户端应用完本轮编辑后据此校验
+    if (broadcast_checksum) {
+        fprintf(message_stream, "VERSION %lu %016lx\n", version, markdown_checksum(&doc));
+    } else {
+        fprintf(message_stream, "VERSION %lu\n", version);
     }
-    while (cmd) {
-        // 构造EDIT行：EDIT <username> <command>
-        fprintf(message_stream, "EDIT %s %s", cmd->username, original_cmd);
 
-        // 根据命令状态构造状态行
-        if (cmd->status == SUCCESS) {
-            fprintf(message_stream, " SUCCESS\n");
-        } else {
-            // 根据错误码构造拒绝消息
-            const char *reason = "UNKNOWN";
-            switch (cmd->status) {
-                case INVALID_CURSOR_POS:
-                    reason = "INVALID_POSITION";
-                    break;
-                case DELETED_POSITION:
-                    reason = "DELETED_POSITION";
-                    break;
-                case OUTDATED_VERSION:
-                    reason = "OUTDATED_VERSION";
-                    break;
-                case UNAUTHORIZED:
-                    reason = "UNAUTHORISED";
-                    break;
-            }
-            fprintf(message_stream, " Reject %s\n", reason);
-        }
-        cmd = cmd->next;
+    // 使用刚提交的历史段构造广播消息：EDIT <username> [<base_version>] <command> <status>
+    const history_segment *segment = find_history_segment(&doc, doc.version);
+    if (segment) {
+        history_write_edits(message_stream, version, segment->first, segment->last);
     }
-    pthread_mutex_unlock(&doc_mutex);
 
     // 结束标记
     fprintf(message_stream, "END\n");
@@ -795,17 +1000,173 @@ void broadcast_update(int version_changed) {
 
 /**
  * 保存文档到文件
+ * @return 成功（内容已 fsync 并替换 doc.md）返回 0，否则返回 -1
  */
-void save_document() {
-    pthread_mutex_lock(&doc_mutex);
+int save_document() {
+    // 保存最近提交的版本：无锁取得快照，直接从块内存 writev 到文件
+    doc_snapshot *snapshot = markdown_snapshot(&doc);
 
-    FILE *doc_file = fopen("doc.md", "w");
-    if (doc_file) {
-        markdown_print(&doc, doc_file);
-        fclose(doc_file);
+    if (!snapshot) {
+        return -1;
     }
 
-    pthread_mutex_unlock(&doc_mutex);
+    // 先写入临时文件再 rename：启动时加载的 doc.md 可能仍被映射为文档内容，不能原地截断
+    int result = -1;
+    int fd = open("doc.md.tmp", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd != -1) {
+        int written = markdown_write_snapshot(snapshot, fd);
+        if (written == 0) {
+            written = fsync(fd);
+        }
+        close(fd);
+        if (written == 0 && rename("doc.md.tmp", "doc.md") == 0) {
+            result = 0;
+        } else {
+            unlink("doc.md.tmp");
+        }
+    }
+
+    markdown_release_snapshot(snapshot);
+    return result;
+}
+
+/**
+ * 把快照写成检查点文件（内容和版本号）：写入临时文件并 fsync 后再 rename，检查点文件始终是完整的
+ * @param snapshot 快照
+ * @param bytes 返回检查点文件的大小，可为 NULL
+ * @return 成功返回 0，否则返回 -1（原来的检查点保持不变）
+ */
+int write_checkpoint(const doc_snapshot *snapshot, size_t *bytes) {
+    int fd = open(CHECKPOINT_FILE ".tmp", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        return -1;
+    }
+
+    int written = markdown_write_checkpoint(snapshot, fd);
+    off_t size = lseek(fd, 0, SEEK_CUR);
+    if (written == 0) {
+        written = fsync(fd);
+    }
+    close(fd);
+
+    if (written != 0 || rename(CHECKPOINT_FILE ".tmp", CHECKPOINT_FILE) != 0) {
+        unlink(CHECKPOINT_FILE ".tmp");
+        return -1;
+    }
+
+    if (bytes) {
+        *bytes = size < 0 ? 0 : (size_t)size;
+    }
+    return 0;
+}
+
+/**
+ * 同步写检查点并清空预写日志，只在启动时（更新线程启动前）和退出时（更新线程结束后）调用
+ * @return 成功返回 0，否则返回 -1（日志保持不变，恢复时仍可重放）
+ */
+int checkpoint_document() {
+    doc_snapshot *snapshot = markdown_snapshot(&doc);
+    if (!snapshot) {
+        return -1;
+    }
+
+    int result = write_checkpoint(snapshot, NULL);
+    if (result == 0) {
+        checkpoint_version = snapshot->version;
+        unlink(WAL_OLD_FILE);
+        result = wal_reset(&wal_log);
+    }
+
+    markdown_release_snapshot(snapshot);
+    return result;
+}
+
+/**
+ * 请求后台检查点，由更新线程在版本之间调用，只做 O(1) 的工作
+ * 先轮换预写日志，使新日志从快照的版本开始，再把快照引用交给检查点线程；
+ * 上一个检查点尚未完成时跳过，下一个版本再试。上一个检查点失败时旧日志仍需保留，
+ * 不再轮换，直接重试更新的版本（新日志中早于该版本的记录在恢复时被跳过）
+ */
+void request_checkpoint() {
+    pthread_mutex_lock(&checkpoint_mutex);
+    int busy = checkpoint_busy;
+    int retry = checkpoint_retry;
+    pthread_mutex_unlock(&checkpoint_mutex);
+    if (busy && !retry) {
+        return;
+    }
+
+    if (!busy && wal_rotate(&wal_log, WAL_FILE, WAL_OLD_FILE) != 0) {
+        fprintf(stderr, "Error: cannot rotate write-ahead log %s\n", WAL_FILE);
+        return;
+    }
+
+    doc_snapshot *snapshot = markdown_snapshot(&doc);
+    if (!snapshot) {
+        return;
+    }
+    checkpoint_version = snapshot->version;
+
+    pthread_mutex_lock(&checkpoint_mutex);
+    checkpoint_request = snapshot;
+    checkpoint_busy = 1;
+    checkpoint_retry = 0;
+    pthread_cond_signal(&checkpoint_cond);
+    pthread_mutex_unlock(&checkpoint_mutex);
+}
+
+/**
+ * 后台检查点线程：把收到的快照写成检查点，成功后删除轮换出的旧日志并记录耗时和大小
+ */
+void *checkpoint_thread(void *arg) {
+    (void)arg; // 未使用的参数
+
+    pthread_mutex_lock(&checkpoint_mutex);
+    for (;;) {
+        while (!checkpoint_request && !checkpoint_stop) {
+            pthread_cond_wait(&checkpoint_cond, &checkpoint_mutex);
+        }
+        if (!checkpoint_request) {
+            break;
+        }
+
+        doc_snapshot *snapshot = checkpoint_request;
+        checkpoint_request = NULL;
+        pthread_mutex_unlock(&checkpoint_mutex);
+
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        size_t bytes = 0;
+        int result = write_checkpoint(snapshot, &bytes);
+        if (result == 0) {
+            // 旧日志中的版本都已包含在检查点中
+            unlink(WAL_OLD_FILE);
+        } else {
+            // 旧日志保留，恢复时仍从上一个检查点重放
+            fprintf(stderr, "Error: cannot write checkpoint at version %lu\n", snapshot->version);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double elapsed_ms = (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1e6;
+
+        pthread_mutex_lock(&checkpoint_mutex);
+        if (result == 0) {
+            checkpoint_stats.written++;
+            checkpoint_stats.last_version = snapshot->version;
+            checkpoint_stats.last_bytes = bytes;
+            checkpoint_stats.last_ms = elapsed_ms;
+            if (elapsed_ms > checkpoint_stats.max_ms) {
+                checkpoint_stats.max_ms = elapsed_ms;
+            }
+            checkpoint_busy = 0;
+        } else {
+            checkpoint_stats.failed++;
+            checkpoint_retry = 1;
+        }
+        markdown_release_snapshot(snapshot);
+    }
+    pthread_mutex_unlock(&checkpoint_mutex);
+
+    return NULL;
 }
 
 /**
@@ -838,47 +1199,25 @@ void cleanup_resources() {
     // 释放命令队列
     pthread_mutex_lock(&queue_mutex);
 
-    command_node *current = command_queue;
-    command_node *next;
-
-    while (current) {
-        next = current->next;
-        free(current);
-        current = next;
-    }
-
+    arena_destroy(&command_arenas[0]);
+    arena_destroy(&command_arenas[1]);
     command_queue = NULL;
+    command_queue_tail = NULL;
 
     pthread_mutex_unlock(&queue_mutex);
 
-    // 释放日志资源
-    pthread_mutex_lock(&log_mutex);
-    if (log.versions) {
-        for (size_t i = 0; i < log.count; i++) {
-            if (log.versions[i].entries) {
-                for (size_t j = 0; j < log.versions[i].count; j++) {
-                    free(log.versions[i].entries[j]);
-                }
-                free(log.versions[i].entries);
-            }
-        }
-        free(log.versions);
-        log.versions = NULL;
-        log.count = 0;
-        log.capacity = 0;
-    }
-    pthread_mutex_unlock(&log_mutex);
-
-    // 释放文档资源
-    pthread_mutex_lock(&doc_mutex);
+    // 释放文档资源（更新线程已结束），关闭历史归档
     markdown_free(&doc);
-    pthread_mutex_unlock(&doc_mutex);
+    history_archive_close(&archive);
+    wal_close(&wal_log);
 
     // 销毁互斥锁
     pthread_mutex_destroy(&client_mutex);
-    pthread_mutex_destroy(&doc_mutex);
     pthread_mutex_destroy(&queue_mutex);
-    pthread_mutex_destroy(&log_mutex);
+    pthread_mutex_destroy(&checkpoint_mutex);
+    pthread_cond_destroy(&checkpoint_cond);
+    pthread_mutex_destroy(&update_mutex);
+    pthread_cond_destroy(&update_cond);
 }
 
 /**
@@ -908,214 +1247,18 @@ void handle_client_disconnect(int client_index) {
 }
 
 /**
- * 解析命令 - 不包含版本号
- * 格式：INSERT <pos> <content>
- * 修复：手动解析以保留内容中的空格
- */
-int parse_command(const char *command, char *cmd_type, size_t *pos1, size_t *pos2, char *content, int *level, uint64_t *version) {
-    if (!command || !cmd_type || !pos1 || !pos2 || !content || !level || !version) {
-        return 0;
-    }
-
-    // 版本号设为0，表示不使用版本检查
-    *version = 0;
-
-    // 移除末尾的换行符
-    char cmd_copy[MAX_COMMAND_LEN];
-    strncpy(cmd_copy, command, MAX_COMMAND_LEN - 1);
-    cmd_copy[MAX_COMMAND_LEN - 1] = '\0';
-
-    size_t len = strlen(cmd_copy);
-    if (len > 0 && cmd_copy[len - 1] == '\n') {
-        cmd_copy[len - 1] = '\0';
-        len--;
-    }
-
-    // 手动解析命令，避免使用strtok丢失空格
-    char *ptr = cmd_copy;
-
-    // 跳过开头的空格
-    while (*ptr == ' ') ptr++;
-
-    // 解析命令类型
-    char *cmd_start = ptr;
-    while (*ptr && *ptr != ' ') ptr++;
-
-    size_t cmd_len = ptr - cmd_start;
-    if (cmd_len > 31) cmd_len = 31;
-    strncpy(cmd_type, cmd_start, cmd_len);
-    cmd_type[cmd_len] = '\0';
-
-    // 如果命令后没有参数，直接返回（如某些单参数命令）
-    if (*ptr == '\0') {
-        return 1;
-    }
-
-    // 跳过空格
-    while (*ptr == ' ') ptr++;
-
-    // 参数部分（不再分离版本号）
-    char *args = ptr;
-
-    // 根据命令类型解析参数
-    if (strcmp(cmd_type, "INSERT") == 0) {
-        // INSERT <pos> <content>
-        char *pos_end = strchr(args, ' ');
-        if (!pos_end) return 0; // 缺少内容部分
-
-        *pos_end = '\0';
-        *pos1 = atol(args);
-
-        // 内容部分（保留所有空格）
-        char *content_start = pos_end + 1;
-        strncpy(content, content_start, MAX_COMMAND_LEN - 1);
-        content[MAX_COMMAND_LEN - 1] = '\0';
-
-    } else if (strcmp(cmd_type, "DEL") == 0) {
-        // DEL <pos> <no_char>
-        if (sscanf(args, "%zu %zu", pos1, pos2) != 2) return 0;
-
-    } else if (strcmp(cmd_type, "HEADING") == 0) {
-        // HEADING <level> <pos>
-        if (sscanf(args, "%d %zu", level, pos1) != 2) return 0;
-
-    } else if (strcmp(cmd_type, "BOLD") == 0 ||
-               strcmp(cmd_type, "ITALIC") == 0 ||
-               strcmp(cmd_type, "CODE") == 0) {
-        // <cmd> <pos_start> <pos_end>
-        if (sscanf(args, "%zu %zu", pos1, pos2) != 2) return 0;
-
-    } else if (strcmp(cmd_type, "BLOCKQUOTE") == 0 ||
-               strcmp(cmd_type, "ORDERED_LIST") == 0 ||
-               strcmp(cmd_type, "UNORDERED_LIST") == 0 ||
-               strcmp(cmd_type, "HORIZONTAL_RULE") == 0 ||
-               strcmp(cmd_type, "NEWLINE") == 0) {
-        // <cmd> <pos>
-        if (sscanf(args, "%zu", pos1) != 1) return 0;
-
-    } else if (strcmp(cmd_type, "LINK") == 0) {
-        // LINK <pos_start> <pos_end> <link>
-        char *first_space = strchr(args, ' ');
-        if (!first_space) return 0;
-
-        *first_space = '\0';
-        *pos1 = atol(args);
-
-        char *second_space = strchr(first_space + 1, ' ');
-        if (!second_space) return 0;
-
-        *second_space = '\0';
-        *pos2 = atol(first_space + 1);
-
-        // 链接内容（保留所有空格）
-        char *link_start = second_space + 1;
-        strncpy(content, link_start, MAX_COMMAND_LEN - 1);
-        content[MAX_COMMAND_LEN - 1] = '\0';
-
-    } else {
-        // 未知命令
-        return 0;
-    }
-
-    return 1;
-}
-
-/**
- * 添加日志条目
- */
-void add_log_entry(uint64_t version, const char *entry) {
-    if (!entry) return;
-
-    // 获取日志互斥锁
-    pthread_mutex_lock(&log_mutex);
-
-    // 初始化日志数组
-    if (!log.versions) {
-        log.capacity = 10;
-        log.versions = (version_log *)malloc(log.capacity * sizeof(version_log));
-        if (!log.versions) {
-            pthread_mutex_unlock(&log_mutex);
-            return;
-        }
-        memset(log.versions, 0, log.capacity * sizeof(version_log));
-    }
-
-    // 查找版本对应的日志
-    int version_index = -1;
-    for (size_t i = 0; i < log.count; i++) {
-        if (log.versions[i].version == version) {
-            version_index = i;
-            break;
-        }
-    }
-
-    // 如果没有找到，创建新的版本日志
-    if (version_index == -1) {
-        // 扩展数组容量
-        if (log.count >= log.capacity) {
-            log.capacity *= 2;
-            version_log *new_versions = (version_log *)realloc(log.versions, log.capacity * sizeof(version_log));
-            if (!new_versions) {
-                pthread_mutex_unlock(&log_mutex);
-                return;
-            }
-            log.versions = new_versions;
-        }
-
-        version_index = log.count++;
-        log.versions[version_index].version = version;
-        log.versions[version_index].entries = NULL;
-        log.versions[version_index].count = 0;
-        log.versions[version_index].capacity = 0;
-    }
-
-    // 初始化条目数组
-    if (!log.versions[version_index].entries) {
-        log.versions[version_index].capacity = 10;
-        log.versions[version_index].entries = (char **)malloc(log.versions[version_index].capacity * sizeof(char *));
-        if (!log.versions[version_index].entries) {
-            pthread_mutex_unlock(&log_mutex);
-            return;
-        }
-    }
-
-    // 扩展条目数组容量
-    if (log.versions[version_index].count >= log.versions[version_index].capacity) {
-        log.versions[version_index].capacity *= 2;
-        char **new_entries = (char **)realloc(log.versions[version_index].entries,
-                                             log.versions[version_index].capacity * sizeof(char *));
-        if (!new_entries) {
-            pthread_mutex_unlock(&log_mutex);
-            return;
-        }
-        log.versions[version_index].entries = new_entries;
-    }
-
-    // 添加新条目
-    log.versions[version_index].entries[log.versions[version_index].count] = strdup(entry);
-    if (log.versions[version_index].entries[log.versions[version_index].count]) {
-        log.versions[version_index].count++;
-    }
-
-    // 释放日志互斥锁
-    pthread_mutex_unlock(&log_mutex);
-}
-
-/**
- * 打印命令日志
+ * 在终端输出编辑历史：先通过只读映射输出已归档的版本，再输出内存中保留的版本
+ * 由更新线程调用
  */
 void print_command_log() {
-    // 获取日志互斥锁
-    pthread_mutex_lock(&log_mutex);
+    fflush(stdout);
+    history_archive_write(&archive, 0, STDOUT_FILENO);
 
-    for (size_t i = 0; i < log.count; i++) {
-        printf("VERSION %lu\n", log.versions[i].version);
-        for (size_t j = 0; j < log.versions[i].count; j++) {
-            printf("%s\n", log.versions[i].entries[j]);
-        }
+    for (size_t i = 0; i < doc.history_segment_count; i++) {
+        const history_segment *segment = &doc.history_segments[i];
+        printf("VERSION %lu\n", segment->version - 1);
+        history_write_edits(stdout, segment->version - 1, segment->first, segment->last);
         printf("END\n");
     }
-
-    // 释放日志互斥锁
-    pthread_mutex_unlock(&log_mutex);
+    fflush(stdout);
 }
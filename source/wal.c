@@ -0,0 +1,343 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "../libs/wal.h"
+#include "../libs/markdown.h"
+#include "../libs/command.h"
+
+#define WAL_PERM 0644
+
+/**
+ * 把缓冲区完整写入文件描述符，处理部分写入
+ * @return 成功返回 0，写入失败返回 -1
+ */
+static int write_all(int fd, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(fd, data, length);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += written;
+        length -= (size_t)written;
+    }
+    return 0;
+}
+
+/**
+ * 打开（不存在时创建）预写日志，新记录追加在已有内容之后
+ * @param log 日志
+ * @param path 日志文件路径
+ * @param sync 非 0 时每次追加后 fdatasync
+ * @return 成功返回 0，打开失败返回 -1
+ */
+int wal_open(wal *log, const char *path, int sync) {
+    if (!log || !path) {
+        return -1;
+    }
+
+    log->fd = open(path, O_WRONLY | O_CREAT | O_APPEND, WAL_PERM);
+    log->sync = sync;
+    log->length = 0;
+    log->records = 0;
+
+    if (log->fd == -1) {
+        return -1;
+    }
+
+    off_t end = lseek(log->fd, 0, SEEK_END);
+    log->length = end < 0 ? 0 : (size_t)end;
+    return 0;
+}
+
+/**
+ * 关闭预写日志
+ * @param log 日志
+ */
+void wal_close(wal *log) {
+    if (log && log->fd != -1) {
+        close(log->fd);
+        log->fd = -1;
+    }
+}
+
+/**
+ * 追加一个已提交版本的记录，只包含被接受的命令；整条记录一次写入
+ * @param log 日志
+ * @param version 命令执行时的已提交版本号
+ * @param first 该版本第一条命令
+ * @param last 该版本最后一条命令（包含）
+ * @return 成功返回 0，写入或同步失败返回 -1
+ */
+int wal_append(wal *log, uint64_t version, const edit_command *first, const edit_command *last) {
+    if (!log || log->fd == -1) {
+        return -1;
+    }
+
+    char *record = NULL;
+    size_t record_len = 0;
+    FILE *stream = open_memstream(&record, &record_len);
+    if (!stream) {
+        return -1;
+    }
+
+    fprintf(stream, "VERSION %lu\n", version);
+    for (const edit_command *cmd = first; cmd; cmd = cmd == last ? NULL : cmd->next) {
+        if (cmd->status != SUCCESS) {
+            continue;
+        }
+        const char *original_cmd = cmd->original_cmd ? cmd->original_cmd : "";
+        fprintf(stream, "EDIT %s ", cmd->username ? cmd->username : "");
+        if (cmd->version != version) {
+            fprintf(stream, "%lu ", cmd->version);
+        }
+        fprintf(stream, "%.*s\n", (int)strcspn(original_cmd, "\n"), original_cmd);
+    }
+    fprintf(stream, "END\n");
+    fclose(stream);
+
+    int result = write_all(log->fd, record, record_len);
+    free(record);
+
+    if (result != 0) {
+        // 写入的字节数未知，按文件实际长度继续
+        off_t end = lseek(log->fd, 0, SEEK_END);
+        log->length = end < 0 ? log->length : (size_t)end;
+        return -1;
+    }
+
+    log->length += record_len;
+    log->records++;
+
+    if (log->sync && fdatasync(log->fd) != 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * 清空日志，在日志中的所有版本都已完整保存到文档文件之后调用
+ * @param log 日志
+ * @return 成功返回 0，失败返回 -1
+ */
+int wal_reset(wal *log) {
+    if (!log || log->fd == -1 || ftruncate(log->fd, 0) != 0) {
+        return -1;
+    }
+
+    log->length = 0;
+    if (log->sync && fdatasync(log->fd) != 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * 轮换日志：把当前日志改名为 old_path，之后的记录追加到 path 处新建的空日志
+ * 后台检查点写完之前，旧日志仍保留着检查点版本之前的记录；恢复时先重放旧日志再重放新日志
+ * @param log 日志
+ * @param path 日志文件路径
+ * @param old_path 旧日志的路径，检查点完成后由调用者删除
+ * @return 成功返回 0，失败返回 -1（改名失败时继续追加到原来的日志）
+ */
+int wal_rotate(wal *log, const char *path, const char *old_path) {
+    if (!log || log->fd == -1 || !path || !old_path) {
+        return -1;
+    }
+
+    if (rename(path, old_path) != 0) {
+        return -1;
+    }
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, WAL_PERM);
+    if (fd == -1) {
+        // 放回原处，之后仍追加到原来的日志
+        rename(old_path, path);
+        return -1;
+    }
+
+    close(log->fd);
+    log->fd = fd;
+    log->length = 0;
+    return 0;
+}
+
+/**
+ * 重放一条记录：把命令解析为一个批次，按原来的顺序整批执行后提交版本
+ * @param doc 文档
+ * @param version 记录的版本号，等于文档当前版本
+ * @param body 记录中 VERSION 行之后、END 行之前的内容
+ * @param length 内容长度
+ * @return 成功返回 0，内存分配失败或命令格式错误返回 -1
+ */
+static int replay_record(document *doc, uint64_t version, const char *body, size_t length) {
+    // 复制一份，把换行符改为 '\0'，命令解析结果直接指向其中的文本
+    char *lines = (char *)malloc(length + 1);
+    if (!lines) {
+        return -1;
+    }
+    memcpy(lines, body, length);
+    lines[length] = '\0';
+
+    size_t capacity = 0;
+    for (size_t i = 0; i < length; i++) {
+        if (lines[i] == '\n') {
+            lines[i] = '\0';
+            capacity++;
+        }
+    }
+
+    parsed_cmd *batch = capacity ? (parsed_cmd *)malloc(capacity * sizeof(parsed_cmd)) : NULL;
+    if (capacity && !batch) {
+        free(lines);
+        return -1;
+    }
+
+    // 每行为 EDIT <username> [<base_version>] <command>
+    size_t count = 0;
+    int result = 0;
+    for (char *line = lines, *next; line < lines + length; line = next) {
+        next = line + strlen(line) + 1;
+        char *username = line + 5;
+        char *command = strncmp(line, "EDIT ", 5) == 0 ? strchr(username, ' ') : NULL;
+        if (!command) {
+            result = -1;
+            break;
+        }
+        *command++ = '\0';
+
+        // 基础版本只出现在基于上一版本的命令上（命令名不以数字开头）
+        uint64_t base_version = version;
+        if (*command >= '0' && *command <= '9') {
+            char *version_end;
+            base_version = strtoull(command, &version_end, 10);
+            if (*version_end != ' ') {
+                result = -1;
+                break;
+            }
+            command = version_end + 1;
+        }
+
+        parsed_cmd *cmd = &batch[count];
+        const command_desc *desc = command_parse(command, cmd);
+        if (!desc || !desc->needs_write) {
+            result = -1;
+            break;
+        }
+        cmd->version = base_version;
+        cmd->username = username;
+        cmd->original_cmd = command;
+        cmd->status = SUCCESS;
+        count++;
+    }
+
+    if (result == 0) {
+        if (count > 0) {
+            markdown_apply_batch(doc, batch, count);
+        }
+        markdown_increment_version(doc);
+    }
+
+    free(batch);
+    free(lines);
+    return result;
+}
+
+/**
+ * 把日志中从文档当前版本开始的记录依次重放到文档上，用于崩溃恢复
+ * 版本低于文档当前版本的记录已包含在检查点中，跳过；遇到不完整的末尾记录、
+ * 版本不连续或格式错误时停止。日志只读映射，不整体读入内存
+ * @param path 日志文件路径
+ * @param doc 文档，内容为检查点（或空文档）
+ * @return 重放的版本数，日志无法打开或映射时返回 -1（日志不存在时返回 0）
+ */
+long wal_replay(const char *path, document *doc) {
+    if (!path || !doc) {
+        return -1;
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return errno == ENOENT ? 0 : -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return -1;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+
+    size_t size = (size_t)st.st_size;
+    const char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return -1;
+    }
+
+    long replayed = 0;
+    const char *cursor = data;
+    const char *end = data + size;
+
+    while (cursor < end) {
+        // VERSION 行
+        const char *newline = memchr(cursor, '\n', end - cursor);
+        char header[64];
+        size_t header_len = newline ? (size_t)(newline - cursor) : 0;
+        unsigned long version;
+        int consumed = 0;
+        if (!newline || header_len >= sizeof(header)) {
+            break;
+        }
+        memcpy(header, cursor, header_len);
+        header[header_len] = '\0';
+        if (sscanf(header, "VERSION %lu%n", &version, &consumed) != 1 || (size_t)consumed != header_len) {
+            break;
+        }
+
+        // 找到本记录的 END 行，没有则是写入中途崩溃留下的不完整记录
+        const char *body = newline + 1;
+        const char *line = body;
+        while (line < end) {
+            const char *line_end = memchr(line, '\n', end - line);
+            if (!line_end) {
+                line = end;
+                break;
+            }
+            if (line_end - line == 3 && memcmp(line, "END", 3) == 0) {
+                break;
+            }
+            line = line_end + 1;
+        }
+        if (line >= end) {
+            break;
+        }
+
+        if (version > doc->version) {
+            break; // 缺少中间的版本
+        }
+        if (version == doc->version) {
+            if (replay_record(doc, version, body, (size_t)(line - body)) != 0) {
+                break;
+            }
+            replayed++;
+        }
+
+        cursor = line + 4;
+    }
+
+    munmap((void *)data, size);
+    return replayed;
+}